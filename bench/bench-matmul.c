@@ -0,0 +1,90 @@
+/**
+ * Benchmark comparing the packed and tiled matrix_multiplication() against the
+ * textbook triple loop it replaced.
+ *
+ * To compile the program:
+ *   gcc -Wall -O3 -march=native -fopenmp bench-matmul.c matrix.c util.c -o bench-matmul -lm
+ *
+ * To run the program:
+ *   ./bench-matmul [max-reference-size [size ...]]
+ * where:
+ *   - max-reference-size is the largest size the (slow) textbook loop is run
+ *     for, default 1024
+ *   - each size is the size of the square matrices multiplied, default 256,
+ *     512, 1024, 2048, and 4096
+ *
+ * For each size the time and GFLOP/s of both versions are printed along with
+ * the speedup, and the results are checked against each other.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "matrix.h"
+#include "util.h"
+
+/**
+ * The textbook i-j-k loop used by matrix_multiplication() before it was tiled.
+ */
+static void reference_multiplication(const Matrix* A, const Matrix* B, Matrix* C) {
+    size_t m = A->rows, n = A->cols, p = B->cols;
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < p; j++) {
+            double value = 0.0;
+            for (size_t k = 0; k < n; k++) { value += A->data[i*n + k] * B->data[k*p + j]; }
+            C->data[i*p + j] = value;
+        }
+    }
+}
+
+/**
+ * Returns the number of seconds taken by a single call to multiply.
+ */
+static double time_multiplication(void (*multiply)(const Matrix*, const Matrix*, Matrix*),
+        const Matrix* A, const Matrix* B, Matrix* C) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    multiply(A, B, C);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return get_time_diff(&start, &end);
+}
+
+static void tiled_multiplication(const Matrix* A, const Matrix* B, Matrix* C) { matrix_multiplication(A, B, C); }
+
+int main(int argc, const char* argv[]) {
+    static const size_t default_sizes[] = { 256, 512, 1024, 2048, 4096 };
+    size_t max_reference = argc > 1 ? (size_t)atol(argv[1]) : 1024;
+    size_t num_sizes = argc > 2 ? (size_t)(argc - 2) : sizeof(default_sizes) / sizeof(default_sizes[0]);
+
+    printf("%6s %12s %10s %12s %10s %8s\n", "size", "textbook s", "GFLOP/s", "tiled s", "GFLOP/s", "speedup");
+    for (size_t s = 0; s < num_sizes; s++) {
+        size_t size = argc > 2 ? (size_t)atol(argv[s + 2]) : default_sizes[s];
+        double gflop = 2e-9 * size * size * size;
+        Matrix* A = matrix_random(size, size);
+        Matrix* B = matrix_random(size, size);
+        Matrix* C = matrix_create_raw(size, size);
+
+        // warm up once (first touch of C and the packing buffers) before timing
+        tiled_multiplication(A, B, C);
+        double tiled = time_multiplication(tiled_multiplication, A, B, C);
+
+        if (size <= max_reference) {
+            Matrix* R = matrix_create_raw(size, size);
+            double textbook = time_multiplication(reference_multiplication, A, B, R);
+            bool same = matrix_allclose(C, R, 1e-12, 1e-9);
+            printf("%6zu %12.4f %10.2f %12.4f %10.2f %7.1fx%s\n", size, textbook, gflop / textbook,
+                   tiled, gflop / tiled, textbook / tiled, same ? "" : "  MISMATCH");
+            matrix_free(R);
+            if (!same) { return 1; }
+        } else {
+            printf("%6zu %12s %10s %12.4f %10.2f %8s\n", size, "-", "-", tiled, gflop / tiled, "-");
+        }
+
+        matrix_free(A);
+        matrix_free(B);
+        matrix_free(C);
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * Microbenchmark comparing the generic serial kernel against the kernels
+ * specialised for small systems (formulas_small.h).
+ *
+ * To compile the program:
+ *   gcc -Wall -O3 -march=native bench-small.c matrix.c util.c -o bench-small -lm
+ *
+ * To run the program:
+ *   ./bench-small num-steps input.npy [input.npy ...]
+ * where:
+ *   - num-steps is the number of time steps to run with each kernel
+ *   - each input.npy is a file describing the initial state of a system with
+ *     at most 16 bodies (e.g. sun-earth.npy, figure8.npy, pluto-charon.npy)
+ *
+ * For each input the number of steps per second of both kernels is printed
+ * along with the speedup of the specialised kernel.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "formulas.h"
+#include "formulas_small.h"
+
+// time step used for all runs, small enough to keep every example stable
+#define TIME_STEP 1e-3
+
+// number of outputs recorded by both kernels
+#define NUM_OUTPUTS 100
+
+/**
+ * Runs the generic kernel from formulas.h in the same way nbody-s does.
+ */
+static void simulateGeneric(const Matrix* input, Matrix* output, size_t num_steps, size_t output_steps, double time_step, StopPoint* stop) {
+    size_t n = input->rows;
+    Positions* positions = (Positions*)malloc(n * 3 * sizeof(Positions));
+    Positions* velocities = (Positions*)malloc(n * 3 * sizeof(Positions));
+    double* forces = (double*)malloc(n * 3 * sizeof(double));
+    double* gm = (double*)malloc(n * sizeof(double));
+    for (size_t i = 0; i < n; i++) {
+        gm[i] = G * MATRIX_AT(input, i, 0);
+        positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] = MATRIX_AT(input, i, 1);
+        positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] = MATRIX_AT(input, i, 2);
+        positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] = MATRIX_AT(input, i, 3);
+        velocities[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] = MATRIX_AT(input, i, 4);
+        velocities[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] = MATRIX_AT(input, i, 5);
+        velocities[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] = MATRIX_AT(input, i, 6);
+    }
+    for (size_t step = 1; step < num_steps && !stop_reached(stop, step); step++) {
+        calculateForces(forces, positions, gm, n);
+        calculateVelocities(velocities, forces, n, time_step);
+        calculatePositions(positions, velocities, n, time_step);
+        stop_check(stop, step);
+        if (step % output_steps == 0) {
+            for (size_t i = 0; i < n; i++) {
+                MATRIX_AT(output, step / output_steps, i * 3 + 0) = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
+                MATRIX_AT(output, step / output_steps, i * 3 + 1) = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
+                MATRIX_AT(output, step / output_steps, i * 3 + 2) = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
+            }
+        }
+    }
+    free(positions);
+    free(velocities);
+    free(gm);
+    free(forces);
+}
+
+/**
+ * Times a single run of a kernel, returning the number of steps per second.
+ */
+static double time_kernel(small_kernel kernel, const Matrix* input, Matrix* output, size_t num_steps) {
+    struct timespec start, end;
+    StopPoint stop;
+    stop_init(&stop, num_steps);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kernel(input, output, num_steps, num_steps / NUM_OUTPUTS, TIME_STEP, &stop);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (num_steps - 1) / get_time_diff(&start, &end);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 3) { fprintf(stderr, "usage: %s num-steps input.npy [input.npy ...]\n", argv[0]); return 1; }
+    size_t num_steps = atol(argv[1]);
+    if (num_steps < NUM_OUTPUTS) { fprintf(stderr, "num-steps must be at least %d\n", NUM_OUTPUTS); return 1; }
+
+    printf("%-24s %4s %14s %14s %8s\n", "input", "n", "generic st/s", "small st/s", "speedup");
+    for (int arg = 2; arg < argc; arg++) {
+        Matrix* input = matrix_from_npy_path(argv[arg]);
+        if (input == NULL) { perror(argv[arg]); return 1; }
+        if (input->cols != 7 || input->rows > SMALL_N_MAX) {
+            fprintf(stderr, "%s: must be n-by-7 with n <= %d\n", argv[arg], SMALL_N_MAX);
+            return 1;
+        }
+        Matrix* output = matrix_create_raw(NUM_OUTPUTS + 1, 3*input->rows);
+
+        // warm up both kernels once before timing them
+        time_kernel(simulateGeneric, input, output, NUM_OUTPUTS);
+        time_kernel(small_kernels[input->rows], input, output, NUM_OUTPUTS);
+        double generic = time_kernel(simulateGeneric, input, output, num_steps);
+        double small = time_kernel(small_kernels[input->rows], input, output, num_steps);
+
+        const char* name = strrchr(argv[arg], '/');
+        printf("%-24s %4zu %14.0f %14.0f %7.2fx\n", name ? name + 1 : argv[arg],
+               input->rows, generic, small, small / generic);
+
+        matrix_free(output);
+        matrix_free(input);
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+// this header tunes the kernel_tuning of the parallel formulas header that was
+// included before it (formulap.h or formulap3.h) for the current machine, and
+// needs bodies.h (see --autotune and util/tuning.h)
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <omp.h>
+
+#include "util.h"
+#include "tuning.h"
+#include "masses.h"
+
+// numbers of bodies the settings are tuned at, each one is used for the
+// numbers of bodies up to the geometric mean with the next
+static const size_t autotune_sizes[] = { 256, 1024, 4096 };
+#define AUTOTUNE_NUM_SIZES (sizeof(autotune_sizes) / sizeof(autotune_sizes[0]))
+
+// settings that are tried, one at a time from the best settings so far
+static const size_t autotune_chunks[] = { 4, 8, 16, 32, 64, 128, 256 };
+static const size_t autotune_tiles[] = { 0, 256, 1024 };
+static const size_t autotune_unrolls[] = { 1, 2, 4 };
+
+// each setting is timed this many times for at least this many seconds, and the
+// fastest time is used
+#define AUTOTUNE_REPEATS 3
+#define AUTOTUNE_MIN_TIME 0.05
+
+// this function returns the seconds taken by one calculation of the forces of n
+// bodies with the settings in kernel_tuning
+inline static double __autotune_measure(Positions* positions, double* forces, const Masses* masses, size_t n)
+{
+    double best = INFINITY;
+    for (int repeat = 0; repeat < AUTOTUNE_REPEATS; repeat++)
+    {
+        struct timespec start, end;
+        double time;
+        size_t count = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do
+        {
+            memset(forces, 0, n * 3 * sizeof(double));
+            #pragma omp parallel default(none) firstprivate(positions, forces, masses, n) num_threads(kernel_tuning.threads)
+            calculateStepForces(forces, NULL, positions, masses, n);
+            count++;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            time = get_time_diff(&start, &end);
+        } while (time < AUTOTUNE_MIN_TIME);
+        if (time / count < best) { best = time / count; }
+    }
+    return best;
+}
+
+// this function times the settings in kernel_tuning and keeps them in best if
+// they are faster
+inline static void __autotune_try(Tuning* best, double* best_time, Positions* positions, double* forces, const Masses* masses, size_t n)
+{
+    double time = __autotune_measure(positions, forces, masses, n);
+    if (time < *best_time) { *best = kernel_tuning; *best_time = time; }
+}
+
+/**
+ * Finds the fastest settings of the force kernel for several numbers of bodies
+ * on this machine with up to max_threads threads, and saves them for program
+ * to the file at path (see util/tuning.h). The schedule and chunk size are
+ * tuned first, then the tile and unroll (if the kernel uses them), and then the
+ * number of threads, each from the best settings so far. The bodies are random
+ * with different masses. Returns false if the file cannot be written.
+ */
+inline static bool autotune(const char* path, const char* program, size_t max_threads)
+{
+    Tuning defaults = kernel_tuning;
+    TuningRange ranges[AUTOTUNE_NUM_SIZES];
+    for (size_t s = 0; s < AUTOTUNE_NUM_SIZES; s++)
+    {
+        // random bodies in a cube
+        size_t n = autotune_sizes[s];
+        Arena* arena = arena_create();
+        Positions* positions = createBodyStore(arena, n);
+        double* forces = (double*)arena_alloc(arena, n * 3 * sizeof(double));
+        Masses masses = createMasses(arena, n);
+#ifdef FORMULAP3_H
+        createThreadForces(arena, n, max_threads);
+#endif
+        unsigned int seed = 1;
+        for (size_t i = 0; i < n; i++)
+        {
+            positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] = rand_r(&seed) / (double)RAND_MAX * 1e9;
+            positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] = rand_r(&seed) / (double)RAND_MAX * 1e9;
+            positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] = rand_r(&seed) / (double)RAND_MAX * 1e9;
+            masses.gm[i] = G * (1 + rand_r(&seed) / (double)RAND_MAX) * 1e20;
+        }
+
+        // start from the defaults with all of the threads, after a calculation
+        // that is not timed to fault in the memory
+        Tuning best = defaults;
+        best.threads = max_threads;
+        kernel_tuning = best;
+        #pragma omp parallel default(none) firstprivate(positions, forces, masses, n) num_threads(kernel_tuning.threads)
+        calculateStepForces(forces, NULL, positions, &masses, n);
+        double best_time = __autotune_measure(positions, forces, &masses, n), default_time = best_time;
+
+        // the schedule and chunk size
+        Tuning start = best;
+        for (int schedule = TUNING_STATIC; schedule <= TUNING_GUIDED; schedule++)
+        {
+            for (size_t c = 0; c < sizeof(autotune_chunks) / sizeof(autotune_chunks[0]) && autotune_chunks[c] <= n; c++)
+            {
+                kernel_tuning = start;
+                kernel_tuning.schedule = schedule;
+                kernel_tuning.chunk = autotune_chunks[c];
+                __autotune_try(&best, &best_time, positions, forces, &masses, n);
+            }
+        }
+
+        // the tile and unroll
+        start = best;
+        for (size_t t = 0; KERNEL_TUNES_TILES && t < sizeof(autotune_tiles) / sizeof(autotune_tiles[0]) && autotune_tiles[t] < n; t++)
+        {
+            for (size_t u = 0; u < sizeof(autotune_unrolls) / sizeof(autotune_unrolls[0]); u++)
+            {
+                kernel_tuning = start;
+                kernel_tuning.tile = autotune_tiles[t];
+                kernel_tuning.unroll = autotune_unrolls[u];
+                __autotune_try(&best, &best_time, positions, forces, &masses, n);
+            }
+        }
+
+        // the number of threads: powers of two and all of them
+        start = best;
+        for (size_t threads = 1; threads < max_threads; threads *= 2)
+        {
+            kernel_tuning = start;
+            kernel_tuning.threads = threads;
+            __autotune_try(&best, &best_time, positions, forces, &masses, n);
+        }
+
+        // each size is used up to the geometric mean with the next one
+        ranges[s].n_min = s == 0 ? 0 : ranges[s-1].n_max;
+        ranges[s].n_max = s + 1 < AUTOTUNE_NUM_SIZES ? (size_t)sqrt((double)n * autotune_sizes[s+1]) : 0;
+        ranges[s].tuning = best;
+        printf("n=%zu: ", n);
+        tuning_print(stdout, &best);
+        printf(": %.3g secs per step (%.3g with the defaults)\n", best_time, default_time);
+        fflush(stdout);
+        arena_free(arena);
+    }
+    kernel_tuning = defaults;
+
+    if (!tuning_save(path, program, ranges, AUTOTUNE_NUM_SIZES)) { perror("error saving the tuned settings"); return false; }
+    printf("saved to %s\n", path);
+    return true;
+}
+
+#endif // AUTOTUNE_H
@@ -0,0 +1,126 @@
+#ifndef BODIES_H
+#define BODIES_H
+
+// this header works with the Positions blocks of the formulas header that was
+// included before it (formulas.h, formulas3.h, formulap.h, or formulap3.h)
+
+#include <stdbool.h>
+
+#include "matrix.h"
+#include "masses.h"
+
+// number of bytes of a mapped output that are written before they are released
+#define OUTPUT_RELEASE_BYTES (64 << 20)
+
+// this function allocates a body store of Positions blocks for n bodies from the
+// arena, the unused end of the last block is zero
+inline static Positions* createBodyStore(Arena* arena, size_t n)
+{
+    return (Positions*)arena_alloc(arena, (n + BLOCK_SIZE - 1) / BLOCK_SIZE * 3 * sizeof(Positions));
+}
+
+// this function transposes the n-by-7 input rows straight into the body store
+// in a single sequential pass over the input, filling one block of BLOCK_SIZE
+// bodies at a time instead of recomputing the block for every value
+inline static void loadBodies(const Matrix* input, Positions* positions, Positions* velocities, Masses* masses)
+{
+    size_t n = input->rows;
+    const double* row = input->data;
+    double m0 = row[0];
+    bool equal = true;
+    for (size_t start = 0; start < n; start += BLOCK_SIZE)
+    {
+        Positions* p = &positions[start/BLOCK_SIZE * 3];
+        Positions* v = &velocities[start/BLOCK_SIZE * 3];
+        double* gm = &masses->gm[start];
+        size_t count = n - start < BLOCK_SIZE ? n - start : BLOCK_SIZE;
+        for (size_t k = 0; k < count; k++, row += 7)
+        {
+            gm[k] = G * row[0];
+            equal &= row[0] == m0;
+            p[0].x[k] = row[1];
+            p[1].y[k] = row[2];
+            p[2].z[k] = row[3];
+            v[0].x[k] = row[4];
+            v[1].y[k] = row[5];
+            v[2].z[k] = row[6];
+        }
+    }
+    masses->gm_equal = equal ? G * m0 : 0;
+}
+
+// this function calculates the forces for a step with the kernel matching the
+// masses, if potential is not NULL the potential of each body is also stored in
+// it (see calculateForcesImpl()) for the diagnostics of the current positions
+inline static void calculateStepForces(double* forces, double* potential, Positions* positions, const Masses* masses, size_t n)
+{
+    if (potential)
+    {
+        if (masses->gm_equal) { calculateForcesImpl(forces, potential, positions, NULL, n, true, true); }
+        else { calculateForcesImpl(forces, potential, positions, masses->gm, n, false, true); }
+    }
+    else if (masses->gm_equal) { calculateForcesEqualMass(forces, positions, n); }
+    else { calculateForces(forces, positions, masses->gm, n); }
+}
+
+// this function copies the positions of all of the bodies to a row of the output
+inline static void savePositions(Matrix* output, size_t row, Positions* positions, size_t n)
+{
+    double* out = &MATRIX_AT(output, row, 0);
+    for (size_t start = 0; start < n; start += BLOCK_SIZE)
+    {
+        Positions* p = &positions[start/BLOCK_SIZE * 3];
+        size_t count = n - start < BLOCK_SIZE ? n - start : BLOCK_SIZE;
+        for (size_t k = 0; k < count; k++, out += 3)
+        {
+            out[0] = p[0].x[k];
+            out[1] = p[1].y[k];
+            out[2] = p[2].z[k];
+        }
+    }
+}
+
+// this function is called after each row of an output created by
+// matrix_create_npy_path() is written, it releases the rows in batches of about
+// OUTPUT_RELEASE_BYTES so the memory used by the output stays bounded
+inline static void releaseOutputRows(Matrix* output, size_t row)
+{
+    size_t batch = OUTPUT_RELEASE_BYTES / (output->cols * sizeof(double));
+    if (batch == 0) { batch = 1; }
+    if ((row + 1) % batch == 0) { matrix_npy_release_rows(output, row + 1 - batch, row + 1); }
+}
+
+// this function keeps only the first rows rows of the output when the run
+// stopped early, a mapped output (see --mmap-output) is also cut in its file
+inline static bool truncateOutput(Matrix* output, const char* path, size_t rows, bool mapped)
+{
+    if (mapped) { return matrix_npy_truncate_path(path, output, rows); }
+    output->rows = rows;
+    output->size = rows * output->cols;
+    return true;
+}
+
+// this function saves the state of the bodies as an n-by-7 npy file in the
+// format of the input (the masses are copied from the input), so a run can be
+// continued from it
+inline static bool saveCheckpoint(const char* path, const Matrix* input, Positions* positions, Positions* velocities, size_t n)
+{
+    Matrix* state = matrix_create_raw(n, 7);
+    if (!state) { return false; }
+    for (size_t i = 0; i < n; i++)
+    {
+        double* row = &MATRIX_AT(state, i, 0);
+        row[0] = MATRIX_AT(input, i, 0);
+        row[1] = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
+        row[2] = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
+        row[3] = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
+        row[4] = velocities[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
+        row[5] = velocities[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
+        row[6] = velocities[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
+    }
+    bool ok = matrix_to_npy_path(path, state);
+    matrix_free(state);
+    return ok;
+}
+
+#endif // BODIES_H
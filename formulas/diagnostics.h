@@ -0,0 +1,124 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+// this header works with the Positions blocks of the formulas header that was
+// included before it (formulas.h, formulas3.h, formulap.h, or formulap3.h)
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "matrix.h"
+#include "masses.h"
+#include "options.h"
+
+// this struct has the optional output streams recorded along with the positions,
+// each has one row per output row and is NULL when its option was not given
+typedef struct {
+    Matrix* velocities;       // x, y, and z velocity of each body
+    Matrix* energy;           // kinetic, potential, and total energy
+    Matrix* angular_momentum; // x, y, and z of the total angular momentum
+    Matrix* center_of_mass;   // x, y, and z position and velocity of the center of mass
+    double* potential;        // potential of each body from the force kernel, for energy
+    bool enabled;             // true if any of the streams are recorded
+} Diagnostics;
+
+// this function creates the streams selected by the options from the arena
+inline static Diagnostics createDiagnostics(Arena* arena, const Options* opts, size_t num_outputs, size_t n)
+{
+    Diagnostics diag = { NULL, NULL, NULL, NULL, NULL, false };
+    if (opts->velocities_path) { diag.velocities = matrix_create_raw_in(arena, num_outputs, 3*n); }
+    if (opts->energy_path)
+    {
+        diag.energy = matrix_create_raw_in(arena, num_outputs, 3);
+        diag.potential = (double*)arena_alloc(arena, n * sizeof(double));
+    }
+    if (opts->angular_momentum_path) { diag.angular_momentum = matrix_create_raw_in(arena, num_outputs, 3); }
+    if (opts->center_of_mass_path) { diag.center_of_mass = matrix_create_raw_in(arena, num_outputs, 6); }
+    diag.enabled = diag.velocities || diag.energy || diag.angular_momentum || diag.center_of_mass;
+    return diag;
+}
+
+// this function records a row of every stream for the current positions and
+// velocities, the potential must have been calculated from the same positions
+// (by calculateStepForces()) if the energy is recorded
+inline static void recordDiagnostics(Diagnostics* diag, size_t row, Positions* positions, Positions* velocities, const Masses* masses, size_t n)
+{
+    double kinetic = 0, potential = 0, mass = 0;
+    double lx = 0, ly = 0, lz = 0;
+    double cx = 0, cy = 0, cz = 0, cvx = 0, cvy = 0, cvz = 0;
+    double* out = diag->velocities ? &MATRIX_AT(diag->velocities, row, 0) : NULL;
+    for (size_t start = 0; start < n; start += BLOCK_SIZE)
+    {
+        Positions* p = &positions[start/BLOCK_SIZE * 3];
+        Positions* v = &velocities[start/BLOCK_SIZE * 3];
+        const double* gm = &masses->gm[start];
+        const double* pot = diag->potential ? &diag->potential[start] : NULL;
+        size_t count = n - start < BLOCK_SIZE ? n - start : BLOCK_SIZE;
+        for (size_t k = 0; k < count; k++)
+        {
+            double m = gm[k] / G;
+            double x = p[0].x[k], y = p[1].y[k], z = p[2].z[k];
+            double vx = v[0].x[k], vy = v[1].y[k], vz = v[2].z[k];
+            if (out) { out[0] = vx; out[1] = vy; out[2] = vz; out += 3; }
+            kinetic += 0.5 * m * (vx*vx + vy*vy + vz*vz);
+            if (pot) { potential -= m * pot[k]; }
+            lx += m * (y*vz - z*vy);
+            ly += m * (z*vx - x*vz);
+            lz += m * (x*vy - y*vx);
+            mass += m;
+            cx += m * x; cy += m * y; cz += m * z;
+            cvx += m * vx; cvy += m * vy; cvz += m * vz;
+        }
+    }
+
+    // the potentials of equal-mass systems are unscaled like their forces
+    if (masses->gm_equal) { potential *= masses->gm_equal; }
+    if (diag->energy)
+    {
+        MATRIX_AT(diag->energy, row, 0) = kinetic;
+        MATRIX_AT(diag->energy, row, 1) = potential;
+        MATRIX_AT(diag->energy, row, 2) = kinetic + potential;
+    }
+    if (diag->angular_momentum)
+    {
+        MATRIX_AT(diag->angular_momentum, row, 0) = lx;
+        MATRIX_AT(diag->angular_momentum, row, 1) = ly;
+        MATRIX_AT(diag->angular_momentum, row, 2) = lz;
+    }
+    if (diag->center_of_mass)
+    {
+        double* com = &MATRIX_AT(diag->center_of_mass, row, 0);
+        com[0] = cx / mass; com[1] = cy / mass; com[2] = cz / mass;
+        com[3] = cvx / mass; com[4] = cvy / mass; com[5] = cvz / mass;
+    }
+}
+
+// this function keeps only the first rows rows of every stream, when the run
+// stopped early
+inline static void truncateDiagnostics(Diagnostics* diag, size_t rows)
+{
+    Matrix* streams[] = { diag->velocities, diag->energy, diag->angular_momentum, diag->center_of_mass };
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+    {
+        if (streams[i] && rows < streams[i]->rows) { streams[i]->rows = rows; streams[i]->size = rows * streams[i]->cols; }
+    }
+}
+
+// this function saves every stream to the file given by its option, returning
+// false if any could not be saved (the streams are freed with their arena)
+inline static bool saveDiagnostics(Diagnostics* diag, const Options* opts)
+{
+    Matrix* streams[] = { diag->velocities, diag->energy, diag->angular_momentum, diag->center_of_mass };
+    const char* paths[] = { opts->velocities_path, opts->energy_path, opts->angular_momentum_path, opts->center_of_mass_path };
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); i++)
+    {
+        if (!streams[i]) { continue; }
+        if (!matrix_to_npy_path(paths[i], streams[i])) { perror(paths[i]); ok = false; }
+    }
+    diag->enabled = false;
+    return ok;
+}
+
+#endif // DIAGNOSTICS_H
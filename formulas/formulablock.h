@@ -0,0 +1,85 @@
+#ifndef FORMULABLOCK_H
+#define FORMULABLOCK_H
+
+// this header works with the Positions blocks of formulap.h, which must be
+// included before it, and adds the kernels used by nbody-mpi and nbody-shm
+// where each process only calculates the forces on its own range of bodies
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <math.h>
+
+// this function adds the forces from the m bodies in block (with G * mass in
+// gm) to the forces on the n bodies in positions, or stores them if accumulate
+// is false, when self is true the n bodies are also in the block starting at
+// index offset so each body skips itself, and when equal_mass is true the
+// forces are left unscaled like calculateForcesEqualMass()
+__attribute__((always_inline)) inline static double* calculateBlockForcesImpl(double* forces, Positions* positions, size_t n, Positions* block, const double* gm, size_t m, bool self, size_t offset, bool accumulate, const bool equal_mass)
+{
+        #pragma omp for schedule(static, BLOCK_SIZE)
+        for (size_t i = 0; i < n; i++)
+        {
+            double forceX = 0;
+            double forceY = 0;
+            double forceZ = 0;
+            double xi = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
+            double yi = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
+            double zi = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
+            for (size_t j = 0; j < m; j++)
+            {
+                if (!self || i + offset != j)
+                {
+                    double dx = block[j/BLOCK_SIZE * 3].x[j%BLOCK_SIZE] - xi;
+                    double dy = block[j/BLOCK_SIZE * 3 + 1].y[j%BLOCK_SIZE] - yi;
+                    double dz = block[j/BLOCK_SIZE * 3 + 2].z[j%BLOCK_SIZE] - zi;
+                    double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
+                    double force = (equal_mass ? 1 : gm[j]) / (r * r * r);
+                    forceX += force * dx;
+                    forceY += force * dy;
+                    forceZ += force * dz;
+                }
+            }
+            if (accumulate)
+            {
+                forces[i * 3] += forceX;
+                forces[i * 3 + 1] += forceY;
+                forces[i * 3 + 2] += forceZ;
+            }
+            else
+            {
+                forces[i * 3] = forceX;
+                forces[i * 3 + 1] = forceY;
+                forces[i * 3 + 2] = forceZ;
+            }
+        }
+        return forces;
+}
+
+// this function calculates the forces per unit mass from one block of bodies
+inline static double* calculateBlockForces(double* forces, Positions* positions, size_t n, Positions* block, const double* gm, size_t m, bool self, size_t offset, bool accumulate)
+{
+    return calculateBlockForcesImpl(forces, positions, n, block, gm, m, self, offset, accumulate, false);
+}
+
+// this function calculates the unscaled forces from one block of bodies when
+// every body has the same mass
+inline static double* calculateBlockForcesEqualMass(double* forces, Positions* positions, size_t n, Positions* block, size_t m, bool self, size_t offset, bool accumulate)
+{
+    return calculateBlockForcesImpl(forces, positions, n, block, NULL, m, self, offset, accumulate, true);
+}
+
+// this function calculates the positions of the n bodies after a step into
+// next, leaving the current positions unchanged for other processes
+inline static Positions* calculatePositionsInto(Positions* next, Positions* positions, Positions* velocities, size_t n, double time_step)
+{
+    #pragma omp for schedule(static, BLOCK_SIZE)
+    for (size_t i = 0; i < n; i++)
+    {
+        next[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] + velocities[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] * time_step;
+        next[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] + velocities[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] * time_step;
+        next[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] + velocities[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] * time_step;
+    }
+    return next;
+}
+
+#endif // FORMULABLOCK_H
@@ -1,8 +1,12 @@
 #ifndef FORMULAP_H
 #define FORMULAP_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <math.h> // Add the missing include directive for the "math.h" header file.
 
+#include "tuning.h"
+
 #define G 6.6743015e-11
 #define SOFTENING 1e-9
 
@@ -16,41 +20,121 @@ typedef struct {
     double z[BLOCK_SIZE];
 } Positions;
 
-// this function calculates the forces
-inline static double* calculateForces(double* forces, Positions* positions, double* masses, size_t n)
+// settings of the force loop, they can be tuned for the machine (see
+// --autotune), the defaults are the schedule(static, BLOCK_SIZE) of the rows
+// with every body loaded for one row at a time
+static Tuning kernel_tuning = { TUNING_STATIC, BLOCK_SIZE, 0, 1, 0 };
+#define KERNEL_TUNES_TILES 1
+
+// this function adds the forces from the bodies j0 to j1 to the rows i to
+// i + rows (at most 4), so each body is loaded once for all of the rows, the
+// sums of each row are kept in forces and potential between the calls and are
+// still added in order of j so the result does not depend on the settings
+__attribute__((always_inline)) inline static void __calculateForceRows(double* forces, double* potential, Positions* positions, const double* gm, size_t n, size_t i, const size_t rows, size_t j0, size_t j1, const bool equal_mass, const bool with_potential)
 {
-        // this is the main loop that calculates the forces
-        // for each body in the system
-        #pragma omp for schedule(static, BLOCK_SIZE) 
-        //#pragma omp parallel for default(none) firstprivate(n, positions, masses) shared(forces) schedule(static) reduction(+:forceX, forceY, forceZ)
-        for (size_t i = 0; i < n; i++)
+    double xi[4], yi[4], zi[4], forceX[4], forceY[4], forceZ[4], pot[4];
+    for (size_t k = 0; k < rows; k++)
+    {
+        xi[k] = positions[(i+k)/BLOCK_SIZE * 3].x[(i+k)%BLOCK_SIZE];
+        yi[k] = positions[(i+k)/BLOCK_SIZE * 3 + 1].y[(i+k)%BLOCK_SIZE];
+        zi[k] = positions[(i+k)/BLOCK_SIZE * 3 + 2].z[(i+k)%BLOCK_SIZE];
+        forceX[k] = j0 ? forces[(i+k) * 3] : 0;
+        forceY[k] = j0 ? forces[(i+k) * 3 + 1] : 0;
+        forceZ[k] = j0 ? forces[(i+k) * 3 + 2] : 0;
+        pot[k] = with_potential && j0 ? potential[i+k] : 0;
+    }
+    for (size_t j = j0; j < j1; j++)
+    {
+        double xj = positions[j/BLOCK_SIZE * 3].x[j%BLOCK_SIZE];
+        double yj = positions[j/BLOCK_SIZE * 3 + 1].y[j%BLOCK_SIZE];
+        double zj = positions[j/BLOCK_SIZE * 3 + 2].z[j%BLOCK_SIZE];
+        double mj = equal_mass ? 1 : gm[j];
+        for (size_t k = 0; k < rows; k++)
         {
-            double forceX = 0;
-            double forceY = 0;
-            double forceZ = 0;
-            for (size_t j = 0; j < n; j++)
+            if (i + k != j)
             {
-                if (i != j)
-                {
-                    double dx = positions[j/BLOCK_SIZE * 3].x[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
-                    double dy = positions[j/BLOCK_SIZE * 3 + 1].y[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
-                    double dz = positions[j/BLOCK_SIZE * 3 + 2].z[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
-                    double mj = masses[j];
-                    double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
-                    double force = G * mj / (r * r * r);
-                    forceX += force * dx;
-                    forceY += force * dy;
-                    forceZ += force * dz;
-                }
+                double dx = xj - xi[k];
+                double dy = yj - yi[k];
+                double dz = zj - zi[k];
+                double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
+                double force = mj / (r * r * r);
+                forceX[k] += force * dx;
+                forceY[k] += force * dy;
+                forceZ[k] += force * dz;
+                if (with_potential) { pot[k] += mj / r; }
             }
-            forces[i * 3] = forceX;
-            forces[i * 3 + 1] = forceY;
-            forces[i * 3 + 2] = forceZ;
         }
+    }
+    for (size_t k = 0; k < rows; k++)
+    {
+        forces[(i+k) * 3] = forceX[k];
+        forces[(i+k) * 3 + 1] = forceY[k];
+        forces[(i+k) * 3 + 2] = forceZ[k];
+        if (with_potential) { potential[i+k] = j1 == n ? 0.5 * pot[k] : pot[k]; }
+    }
+}
+
+// this function calculates the forces of a chunk of rows (see kernel_tuning)
+__attribute__((always_inline)) inline static void __calculateForceChunk(double* forces, double* potential, Positions* positions, const double* gm, size_t n, size_t first, size_t last, const bool equal_mass, const bool with_potential)
+{
+    size_t tile = kernel_tuning.tile ? kernel_tuning.tile : n, unroll = kernel_tuning.unroll;
+    for (size_t j0 = 0; j0 < n; j0 += tile)
+    {
+        size_t j1 = j0 + tile < n ? j0 + tile : n;
+        size_t i = first;
+        if (unroll == 4) { for (; i + 4 <= last; i += 4) { __calculateForceRows(forces, potential, positions, gm, n, i, 4, j0, j1, equal_mass, with_potential); } }
+        if (unroll == 2) { for (; i + 2 <= last; i += 2) { __calculateForceRows(forces, potential, positions, gm, n, i, 2, j0, j1, equal_mass, with_potential); } }
+        for (; i < last; i++) { __calculateForceRows(forces, potential, positions, gm, n, i, 1, j0, j1, equal_mass, with_potential); }
+    }
+}
+
+// this function calculates the forces, it is specialised for each use by the
+// wrappers below: when equal_mass is true every body has the same mass and the
+// forces are left unscaled, and when with_potential is true half of the
+// potential of each body (sum of G * mass / r over the other bodies) is also
+// stored so the potential energy can be found without another pass
+__attribute__((always_inline)) inline static double* calculateForcesImpl(double* forces, double* potential, Positions* positions, const double* gm, size_t n, const bool equal_mass, const bool with_potential)
+{
+        // this is the main loop that calculates the forces for each body in
+        // the system, the chunks of rows are shared as kernel_tuning says
+        size_t chunk = kernel_tuning.chunk, num_chunks = (n + chunk - 1) / chunk;
+        #define FORCE_CHUNK(c) __calculateForceChunk(forces, potential, positions, gm, n, (c) * chunk, (c) * chunk + chunk < n ? (c) * chunk + chunk : n, equal_mass, with_potential)
+        if (kernel_tuning.schedule == TUNING_DYNAMIC)
+        {
+            #pragma omp for schedule(dynamic)
+            for (size_t c = 0; c < num_chunks; c++) { FORCE_CHUNK(c); }
+        }
+        else if (kernel_tuning.schedule == TUNING_GUIDED)
+        {
+            #pragma omp for schedule(guided)
+            for (size_t c = 0; c < num_chunks; c++) { FORCE_CHUNK(c); }
+        }
+        else
+        {
+            #pragma omp for schedule(static, 1)
+            for (size_t c = 0; c < num_chunks; c++) { FORCE_CHUNK(c); }
+        }
+        #undef FORCE_CHUNK
         return forces;
 }
+
+// this function calculates the forces per unit mass (the accelerations) so
+// calculateVelocities() never has to divide by the mass of a body
+inline static double* calculateForces(double* forces, Positions* positions, const double* gm, size_t n)
+{
+    return calculateForcesImpl(forces, NULL, positions, gm, n, false, false);
+}
+
+// this function calculates the forces when every body has the same mass, they
+// are left unscaled and the caller multiplies them by G * mass in the time step
+// passed to calculateVelocities()
+inline static double* calculateForcesEqualMass(double* forces, Positions* positions, size_t n)
+{
+    return calculateForcesImpl(forces, NULL, positions, NULL, n, true, false);
+}
+
 // this function calculates the velocities
-inline static Positions* calculateVelocities(Positions* velocities, double* forces, double* masses, size_t n, double time_step)
+inline static Positions* calculateVelocities(Positions* velocities, double* forces, size_t n, double time_step)
 {
     #pragma omp for schedule(static, BLOCK_SIZE)
     for (size_t i = 0; i < n; i++)
@@ -1,8 +1,18 @@
 #ifndef FORMULAP3_H
 #define FORMULAP3_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
 #include <math.h>
 
+#include <omp.h>
+
+#include "masses.h"
+#include "tuning.h"
+
 #define G 6.6743015e-11
 #define SOFTENING 1e-9
 
@@ -17,44 +27,280 @@ typedef struct {
     double z[BLOCK_SIZE];
 } Positions;
 
-// this function calculates the forces
-inline static double* calculateForces(double* forces, Positions* positions, double* masses, size_t n)
+// settings of the force loop, they can be tuned for the machine (see
+// --autotune), the defaults are the schedule(dynamic, BLOCK_SIZE) of the rows,
+// the tile and unroll settings are not used since each pair also updates the
+// forces of body j
+static Tuning kernel_tuning = { TUNING_DYNAMIC, BLOCK_SIZE, 0, 1, 0 };
+#define KERNEL_TUNES_TILES 0
+
+// partial forces of each thread for calculateForcesImpl(), each pair is added
+// to the partial forces of the thread that has its row, so no two threads ever
+// write the forces of the same body (see createThreadForces())
+static double* thread_forces = NULL;
+static size_t thread_forces_threads = 0;
+
+// this function allocates the partial forces of up to num_threads threads for n
+// bodies from the arena, it must be called before the forces are calculated by
+// that many threads
+inline static void createThreadForces(Arena* arena, size_t n, size_t num_threads)
 {
-    // this is the main loop that calculates the forces
-    // for each body in the system
-    #pragma omp for schedule(dynamic, BLOCK_SIZE) 
-    for (size_t i = 0; i < n; i++)
+    thread_forces = (double*)arena_alloc(arena, num_threads * n * 3 * sizeof(double));
+    thread_forces_threads = num_threads;
+}
+
+// this function calculates the forces of the rows first to last, each pair is
+// added to the forces of both bodies
+__attribute__((always_inline)) inline static void __calculateForceChunk(double* forces, double* potential, Positions* positions, const double* gm, size_t n, size_t first, size_t last, const bool equal_mass, const bool with_potential)
+{
+    for (size_t i = first; i < last; i++)
     {
-        
+        double xi = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
+        double yi = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
+        double zi = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
+        double mi = equal_mass ? 1 : gm[i];
+        double forceX = 0;
+        double forceY = 0;
+        double forceZ = 0;
+        double pot = 0;
         for (size_t j = i + 1; j < n; j++)
-        { 
-            double dx = positions[j/BLOCK_SIZE * 3].x[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
-            double dy = positions[j/BLOCK_SIZE * 3 + 1].y[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
-            double dz = positions[j/BLOCK_SIZE * 3 + 2].z[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];               
+        {
+            double dx = positions[j/BLOCK_SIZE * 3].x[j%BLOCK_SIZE] - xi;
+            double dy = positions[j/BLOCK_SIZE * 3 + 1].y[j%BLOCK_SIZE] - yi;
+            double dz = positions[j/BLOCK_SIZE * 3 + 2].z[j%BLOCK_SIZE] - zi;
             double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
-            double force = G * masses[i] * masses[j] / (r * r * r);
+            double force = 1 / (r * r * r);
+            double mj = equal_mass ? 1 : gm[j];
 
-            forces[i*3] += dx * force;
-            forces[i*3 + 1] += dy * force;
-            forces[i*3 + 2] += dz * force;
-            
-            forces[j*3] -= dx * force;
-            forces[j*3 + 1] -= dy * force;
-            forces[j*3 + 2] -= dz * force;
+            forceX += dx * force * mj;
+            forceY += dy * force * mj;
+            forceZ += dz * force * mj;
 
+            forces[j*3] -= dx * force * mi;
+            forces[j*3 + 1] -= dy * force * mi;
+            forces[j*3 + 2] -= dz * force * mi;
+
+            if (with_potential) { pot += mj / r; }
         }
+        forces[i*3] += forceX;
+        forces[i*3 + 1] += forceY;
+        forces[i*3 + 2] += forceZ;
+        if (with_potential) { potential[i] = pot; }
+    }
+}
+
+// this function calculates the forces per unit mass (the accelerations) so
+// calculateVelocities() never has to divide by the mass of a body, it is
+// specialised for each use by the wrappers below: when equal_mass is true every
+// body has the same mass and the forces are left unscaled, and when
+// with_potential is true the potential of each body from the bodies after it
+// (sum of G * mass / r) is also stored so the potential energy can be found
+// without another pass
+__attribute__((always_inline)) inline static double* calculateForcesImpl(double* forces, double* potential, Positions* positions, const double* gm, size_t n, const bool equal_mass, const bool with_potential)
+{
+    size_t num_threads = omp_get_num_threads();
+    if (num_threads > thread_forces_threads) { fprintf(stderr, "createThreadForces() was not called for %zu threads\n", num_threads); abort(); }
+    double* own = thread_forces + omp_get_thread_num() * n * 3;
+    memset(own, 0, n * 3 * sizeof(double));
+
+    // this is the main loop that calculates the forces for each body in the
+    // system, each pair is only visited once and the chunks of rows are shared
+    // as kernel_tuning says, into the partial forces of each thread
+    size_t chunk = kernel_tuning.chunk, num_chunks = (n + chunk - 1) / chunk;
+    #define FORCE_CHUNK(c) __calculateForceChunk(own, potential, positions, gm, n, (c) * chunk, (c) * chunk + chunk < n ? (c) * chunk + chunk : n, equal_mass, with_potential)
+    if (kernel_tuning.schedule == TUNING_STATIC)
+    {
+        #pragma omp for schedule(static, 1)
+        for (size_t c = 0; c < num_chunks; c++) { FORCE_CHUNK(c); }
+    }
+    else if (kernel_tuning.schedule == TUNING_GUIDED)
+    {
+        #pragma omp for schedule(guided)
+        for (size_t c = 0; c < num_chunks; c++) { FORCE_CHUNK(c); }
+    }
+    else
+    {
+        #pragma omp for schedule(dynamic)
+        for (size_t c = 0; c < num_chunks; c++) { FORCE_CHUNK(c); }
+    }
+    #undef FORCE_CHUNK
+
+    // add up the partial forces of each body, in order of the threads
+    #pragma omp for schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+        double forceX = 0;
+        double forceY = 0;
+        double forceZ = 0;
+        for (size_t t = 0; t < num_threads; t++)
+        {
+            const double* partial = thread_forces + (t * n + i) * 3;
+            forceX += partial[0];
+            forceY += partial[1];
+            forceZ += partial[2];
+        }
+        forces[i*3] += forceX;
+        forces[i*3 + 1] += forceY;
+        forces[i*3 + 2] += forceZ;
     }
     return forces;
 }
+
+// this function calculates the forces per unit mass (the accelerations) so
+// calculateVelocities() never has to divide by the mass of a body
+inline static double* calculateForces(double* forces, Positions* positions, const double* gm, size_t n)
+{
+    return calculateForcesImpl(forces, NULL, positions, gm, n, false, false);
+}
+
+// this function calculates the forces when every body has the same mass, they
+// are left unscaled and the caller multiplies them by G * mass in the time step
+// passed to calculateVelocities()
+inline static double* calculateForcesEqualMass(double* forces, Positions* positions, size_t n)
+{
+    return calculateForcesImpl(forces, NULL, positions, NULL, n, true, false);
+}
+
+// number of parts the pairs are split into for calculateStepForcesDeterministic(),
+// it limits the number of threads that can share the pairs
+#ifndef DETERMINISTIC_SLOTS
+#define DETERMINISTIC_SLOTS 32
+#endif
+
+// this struct stores the partial forces of calculateStepForcesDeterministic(), the
+// pairs of the rows first[k] to first[k+1] (whole blocks, chosen so each slot
+// has about the same number of pairs) are summed into sums + offset[k], which
+// has the forces of bodies first[k] to n (the only ones those pairs touch)
+typedef struct {
+    size_t count;                         // number of slots
+    size_t first[DETERMINISTIC_SLOTS+1];  // first row of each slot, the last is n
+    size_t offset[DETERMINISTIC_SLOTS];   // index of the partial forces of each slot in sums
+    double* sums;
+} ForceSlots;
+
+// this function splits the pairs of n bodies into slots and allocates their
+// partial forces from the arena, the split only depends on n so the forces do
+// not depend on the number of threads
+inline static ForceSlots createForceSlots(Arena* arena, size_t n)
+{
+    ForceSlots slots;
+    size_t num_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    slots.count = num_blocks < DETERMINISTIC_SLOTS ? num_blocks : DETERMINISTIC_SLOTS;
+    double total = (double)n * (n - 1) / 2;
+    size_t size = 0, block = 0;
+    for (size_t k = 0; k < slots.count; k++)
+    {
+        // the slot starts at the first block with k/count of the pairs before it
+        double target = total * k / slots.count;
+        if (block < k) { block = k; }
+        while (block < num_blocks)
+        {
+            double i = (double)block * BLOCK_SIZE;
+            if (i * n - i * (i + 1) / 2 >= target) { break; }
+            block++;
+        }
+        slots.first[k] = block * BLOCK_SIZE < n ? block * BLOCK_SIZE : n;
+        slots.offset[k] = size;
+        size += (n - slots.first[k]) * 3;
+    }
+    slots.first[slots.count] = n;
+    slots.sums = (double*)arena_alloc(arena, size * sizeof(double));
+    return slots;
+}
+
+// this function calculates the same forces as calculateForcesImpl() but always
+// adds them in the same order, so the results are identical for any number of
+// threads (calculateForcesImpl() adds them in an order that depends on the
+// threads and the schedule): each slot is summed by one thread in order of i and j into its own
+// partial forces, then the partial forces of each body are added in order of
+// the slots (the forces are overwritten, not added to)
+__attribute__((always_inline)) inline static double* calculateForcesDeterministicImpl(ForceSlots* slots, double* forces, double* potential, Positions* positions, const double* gm, size_t n, const bool equal_mass, const bool with_potential)
+{
+    #pragma omp for schedule(dynamic, 1)
+    for (size_t k = 0; k < slots->count; k++)
+    {
+        size_t first = slots->first[k];
+        double* sums = slots->sums + slots->offset[k] - first * 3;
+        memset(sums + first * 3, 0, (n - first) * 3 * sizeof(double));
+        for (size_t i = first; i < slots->first[k+1]; i++)
+        {
+            double xi = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
+            double yi = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
+            double zi = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
+            double mi = equal_mass ? 1 : gm[i];
+            double forceX = 0;
+            double forceY = 0;
+            double forceZ = 0;
+            double pot = 0;
+            for (size_t j = i + 1; j < n; j++)
+            {
+                double dx = positions[j/BLOCK_SIZE * 3].x[j%BLOCK_SIZE] - xi;
+                double dy = positions[j/BLOCK_SIZE * 3 + 1].y[j%BLOCK_SIZE] - yi;
+                double dz = positions[j/BLOCK_SIZE * 3 + 2].z[j%BLOCK_SIZE] - zi;
+                double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
+                double force = 1 / (r * r * r);
+                double mj = equal_mass ? 1 : gm[j];
+
+                forceX += dx * force * mj;
+                forceY += dy * force * mj;
+                forceZ += dz * force * mj;
+
+                sums[j*3] -= dx * force * mi;
+                sums[j*3 + 1] -= dy * force * mi;
+                sums[j*3 + 2] -= dz * force * mi;
+
+                if (with_potential) { pot += mj / r; }
+            }
+            sums[i*3] += forceX;
+            sums[i*3 + 1] += forceY;
+            sums[i*3 + 2] += forceZ;
+            if (with_potential) { potential[i] = pot; }
+        }
+    }
+
+    // add up the slots that touch each body, in order
+    #pragma omp for schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+        double forceX = 0;
+        double forceY = 0;
+        double forceZ = 0;
+        for (size_t k = 0; k < slots->count && slots->first[k] <= i; k++)
+        {
+            const double* sums = slots->sums + slots->offset[k] + (i - slots->first[k]) * 3;
+            forceX += sums[0];
+            forceY += sums[1];
+            forceZ += sums[2];
+        }
+        forces[i*3] = forceX;
+        forces[i*3 + 1] = forceY;
+        forces[i*3 + 2] = forceZ;
+    }
+    return forces;
+}
+
+// this function calculates the forces for a step with calculateForcesDeterministicImpl(),
+// specialised like calculateStepForces()
+inline static void calculateStepForcesDeterministic(ForceSlots* slots, double* forces, double* potential, Positions* positions, const Masses* masses, size_t n)
+{
+    if (potential)
+    {
+        if (masses->gm_equal) { calculateForcesDeterministicImpl(slots, forces, potential, positions, NULL, n, true, true); }
+        else { calculateForcesDeterministicImpl(slots, forces, potential, positions, masses->gm, n, false, true); }
+    }
+    else if (masses->gm_equal) { calculateForcesDeterministicImpl(slots, forces, NULL, positions, NULL, n, true, false); }
+    else { calculateForcesDeterministicImpl(slots, forces, NULL, positions, masses->gm, n, false, false); }
+}
+
 // this function calculates the velocities
-inline static Positions* calculateVelocities(Positions* velocities, double* forces, double* masses, size_t n, double time_step)
+inline static Positions* calculateVelocities(Positions* velocities, double* forces, size_t n, double time_step)
 {
     #pragma omp for schedule(dynamic, BLOCK_SIZE)
     for (size_t i = 0; i < n; i++)
     {
-        velocities[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] += forces[i * 3] / masses[i] * time_step;
-        velocities[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] += forces[i * 3 + 1] / masses[i] * time_step;
-        velocities[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] += forces[i * 3 + 2] / masses[i] * time_step;
+        velocities[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] += forces[i * 3] * time_step;
+        velocities[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] += forces[i * 3 + 1] * time_step;
+        velocities[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] += forces[i * 3 + 2] * time_step;
 
         forces[i * 3] = 0;
         forces[i * 3 + 1] = 0;
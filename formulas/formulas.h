@@ -1,6 +1,8 @@
 #ifndef FORMULAS_H
 #define FORMULAS_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
 
 #define G 6.6743015e-11
@@ -13,8 +15,12 @@ typedef struct {
     double z[BLOCK_SIZE];
 } Positions;
 
-// this function calculates the forces
-inline static double* calculateForces(double* forces, Positions* positions, double* masses, size_t n)
+// this function calculates the forces, it is specialised for each use by the
+// wrappers below: when equal_mass is true every body has the same mass and the
+// forces are left unscaled, and when with_potential is true half of the
+// potential of each body (sum of G * mass / r over the other bodies) is also
+// stored so the potential energy can be found without another pass
+__attribute__((always_inline)) inline static double* calculateForcesImpl(double* forces, double* potential, Positions* positions, const double* gm, size_t n, const bool equal_mass, const bool with_potential)
 {
     // this is the main loop that calculates the forces
     // for each body in the system
@@ -23,6 +29,7 @@ inline static double* calculateForces(double* forces, Positions* positions, doub
         double forceX = 0;
         double forceY = 0;
         double forceZ = 0;
+        double pot = 0;
         for (size_t j = 0; j < n; j++)
         {
             if (i != j)
@@ -30,23 +37,40 @@ inline static double* calculateForces(double* forces, Positions* positions, doub
                 double dx = positions[j/BLOCK_SIZE * 3].x[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
                 double dy = positions[j/BLOCK_SIZE * 3 + 1].y[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
                 double dz = positions[j/BLOCK_SIZE * 3 + 2].z[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
-                double mj = masses[j];
                 double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
-                double force = G * mj / (r * r * r);
+                double mj = equal_mass ? 1 : gm[j];
+                double force = mj / (r * r * r);
                 forceX += force * dx;
                 forceY += force * dy;
                 forceZ += force * dz;
+                if (with_potential) { pot += mj / r; }
             }
         }
         forces[i * 3] = forceX;
         forces[i * 3 + 1] = forceY;
         forces[i * 3 + 2] = forceZ;
+        if (with_potential) { potential[i] = 0.5 * pot; }
     }
     return forces;
 }
 
+// this function calculates the forces per unit mass (the accelerations) so
+// calculateVelocities() never has to divide by the mass of a body
+inline static double* calculateForces(double* forces, Positions* positions, const double* gm, size_t n)
+{
+    return calculateForcesImpl(forces, NULL, positions, gm, n, false, false);
+}
+
+// this function calculates the forces when every body has the same mass, they
+// are left unscaled and the caller multiplies them by G * mass in the time step
+// passed to calculateVelocities()
+inline static double* calculateForcesEqualMass(double* forces, Positions* positions, size_t n)
+{
+    return calculateForcesImpl(forces, NULL, positions, NULL, n, true, false);
+}
+
 // this function calculates the velocities
-inline static Positions* calculateVelocities(Positions* velocities, double* forces, double* masses, size_t n, double time_step)
+inline static Positions* calculateVelocities(Positions* velocities, double* forces, size_t n, double time_step)
 {
     for (size_t i = 0; i < n; i++)
     {
@@ -1,6 +1,8 @@
 #ifndef FORMULAS3_H
 #define FORMULAS3_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
 
 #define G 6.6743015e-11
@@ -12,43 +14,110 @@ typedef struct {
     double y[BLOCK_SIZE];
     double z[BLOCK_SIZE];
 } Positions;
-// this function calculates the forces
-inline static double* calculateForces(double* forces, Positions* positions, double* masses, size_t n)
+// this function calculates the forces per unit mass (the accelerations) so
+// calculateVelocities() never has to divide by the mass of a body, it is
+// specialised for each use by the wrappers below: when equal_mass is true every
+// body has the same mass and the forces are left unscaled, and when
+// with_potential is true the potential of each body from the bodies after it
+// (sum of G * mass / r) is also stored so the potential energy can be found
+// without another pass
+//
+// the pairs are visited in tiles of one block of bodies i by one block of
+// bodies j (from the same block on), so each pair is still only visited once:
+// the forces of the bodies j are summed in SoA buffers of the tile and added to
+// forces once per tile, and those of the bodies i once per block, so the inner
+// loop only reads and writes contiguous arrays and can be vectorized (with
+// -fopenmp-simd, which lets it call sqrt() on vectors)
+__attribute__((always_inline)) inline static double* calculateForcesImpl(double* forces, double* potential, Positions* positions, const double* gm, size_t n, const bool equal_mass, const bool with_potential)
 {
-    // this is the main loop that calculates the forces
-    // for each body in the system
-    for (size_t i = 0; i < n; i++)
+    for (size_t bi = 0; bi < n; bi += BLOCK_SIZE)
     {
-        
-        for (size_t j = i + 1; j < n; j++)
-        { 
-            double dx = positions[j/BLOCK_SIZE * 3].x[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
-            double dy = positions[j/BLOCK_SIZE * 3 + 1].y[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
-            double dz = positions[j/BLOCK_SIZE * 3 + 2].z[j%BLOCK_SIZE] - positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];               
-            double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
-            double force = G * masses[i] * masses[j] / (r * r * r);
+        Positions* pi = &positions[bi/BLOCK_SIZE * 3];
+        size_t ni = n - bi < BLOCK_SIZE ? n - bi : BLOCK_SIZE;
+        double fix[BLOCK_SIZE] = { 0 }, fiy[BLOCK_SIZE] = { 0 }, fiz[BLOCK_SIZE] = { 0 }, poti[BLOCK_SIZE] = { 0 };
+        for (size_t bj = bi; bj < n; bj += BLOCK_SIZE)
+        {
+            Positions* pj = &positions[bj/BLOCK_SIZE * 3];
+            size_t nj = n - bj < BLOCK_SIZE ? n - bj : BLOCK_SIZE;
+            const double* gmj = equal_mass ? NULL : &gm[bj];
+            double fjx[BLOCK_SIZE] = { 0 }, fjy[BLOCK_SIZE] = { 0 }, fjz[BLOCK_SIZE] = { 0 };
+            for (size_t a = 0; a < ni; a++)
+            {
+                double xi = pi[0].x[a];
+                double yi = pi[1].y[a];
+                double zi = pi[2].z[a];
+                double mi = equal_mass ? 1 : gm[bi + a];
+                double forceX = 0;
+                double forceY = 0;
+                double forceZ = 0;
+                double pot = 0;
+                // within the block of i itself only the bodies after i
+                #pragma omp simd reduction(+:forceX, forceY, forceZ, pot)
+                for (size_t k = bj == bi ? a + 1 : 0; k < nj; k++)
+                {
+                    double dx = pj[0].x[k] - xi;
+                    double dy = pj[1].y[k] - yi;
+                    double dz = pj[2].z[k] - zi;
+                    double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
+                    double force = 1 / (r * r * r);
+                    double mj = equal_mass ? 1 : gmj[k];
+
+                    forceX += dx * force * mj;
+                    forceY += dy * force * mj;
+                    forceZ += dz * force * mj;
 
-            forces[i*3] += dx * force;
-            forces[i*3 + 1] += dy * force;
-            forces[i*3 + 2] += dz * force;
-            
-            forces[j*3] -= dx * force;
-            forces[j*3 + 1] -= dy * force;
-            forces[j*3 + 2] -= dz * force;
+                    fjx[k] -= dx * force * mi;
+                    fjy[k] -= dy * force * mi;
+                    fjz[k] -= dz * force * mi;
 
+                    if (with_potential) { pot += mj / r; }
+                }
+                fix[a] += forceX;
+                fiy[a] += forceY;
+                fiz[a] += forceZ;
+                poti[a] += pot;
+            }
+            for (size_t k = 0; k < nj; k++)
+            {
+                forces[(bj + k)*3] += fjx[k];
+                forces[(bj + k)*3 + 1] += fjy[k];
+                forces[(bj + k)*3 + 2] += fjz[k];
+            }
+        }
+        for (size_t a = 0; a < ni; a++)
+        {
+            forces[(bi + a)*3] += fix[a];
+            forces[(bi + a)*3 + 1] += fiy[a];
+            forces[(bi + a)*3 + 2] += fiz[a];
+            if (with_potential) { potential[bi + a] = poti[a]; }
         }
     }
     return forces;
 }
 
+// this function calculates the forces per unit mass (the accelerations) so
+// calculateVelocities() never has to divide by the mass of a body
+inline static double* calculateForces(double* forces, Positions* positions, const double* gm, size_t n)
+{
+    return calculateForcesImpl(forces, NULL, positions, gm, n, false, false);
+}
+
+// this function calculates the forces when every body has the same mass, they
+// are left unscaled and the caller multiplies them by G * mass in the time step
+// passed to calculateVelocities()
+inline static double* calculateForcesEqualMass(double* forces, Positions* positions, size_t n)
+{
+    return calculateForcesImpl(forces, NULL, positions, NULL, n, true, false);
+}
+
 // this function calculates the velocities
-inline static Positions* calculateVelocities(Positions* velocities, double* forces, double* masses, size_t n, double time_step)
+inline static Positions* calculateVelocities(Positions* velocities, double* forces, size_t n, double time_step)
 {
     for (size_t i = 0; i < n; i++)
     {
-        velocities[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] += forces[i * 3] / masses[i] * time_step;
-        velocities[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] += forces[i * 3 + 1] / masses[i] * time_step;
-        velocities[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] += forces[i * 3 + 2] / masses[i] * time_step;
+        velocities[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] += forces[i * 3] * time_step;
+        velocities[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] += forces[i * 3 + 1] * time_step;
+        velocities[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] += forces[i * 3 + 2] * time_step;
 
         forces[i * 3] = 0;
         forces[i * 3 + 1] = 0;
@@ -0,0 +1,134 @@
+#ifndef FORMULAS_SMALL_H
+#define FORMULAS_SMALL_H
+
+#include <math.h>
+
+#include "matrix.h"
+#include "stop.h"
+
+#define G 6.6743015e-11
+#define SOFTENING 1e-9
+
+// largest number of bodies that gets a kernel specialised for its exact size
+#define SMALL_N_MAX 16
+
+typedef void (*small_kernel)(const Matrix* input, Matrix* output, size_t num_steps, size_t output_steps, double time_step, StopPoint* stop);
+
+// this function runs the whole simulation for a system of exactly N bodies
+// it is only ever called with a constant N, so every loop has a compile-time
+// trip count and is fully unrolled, the state lives in registers instead of
+// the Positions blocks, and each pair is visited once (Newton's third law)
+// so there is no force array and no i != j branch, it stops early like the
+// step loops of the programs after a signal (see stop.h)
+__attribute__((always_inline))
+inline static void simulateSmallN(const size_t N, const Matrix* input, Matrix* output, size_t num_steps, size_t output_steps, double time_step, StopPoint* stop)
+{
+    double x[SMALL_N_MAX], y[SMALL_N_MAX], z[SMALL_N_MAX];
+    double vx[SMALL_N_MAX], vy[SMALL_N_MAX], vz[SMALL_N_MAX];
+    double gm[SMALL_N_MAX];
+
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < N; i++)
+    {
+        gm[i] = G * MATRIX_AT(input, i, 0);
+        x[i] = MATRIX_AT(input, i, 1);
+        y[i] = MATRIX_AT(input, i, 2);
+        z[i] = MATRIX_AT(input, i, 3);
+        vx[i] = MATRIX_AT(input, i, 4);
+        vy[i] = MATRIX_AT(input, i, 5);
+        vz[i] = MATRIX_AT(input, i, 6);
+    }
+
+    for (size_t step = 1; step < num_steps && !stop_reached(stop, step); step++)
+    {
+        // accumulate the accelerations of every pair
+        double ax[SMALL_N_MAX] = {0}, ay[SMALL_N_MAX] = {0}, az[SMALL_N_MAX] = {0};
+        #pragma GCC unroll 16
+        for (size_t i = 0; i < N; i++)
+        {
+            #pragma GCC unroll 16
+            for (size_t j = i + 1; j < N; j++)
+            {
+                double dx = x[j] - x[i];
+                double dy = y[j] - y[i];
+                double dz = z[j] - z[i];
+                double r = sqrt((dx * dx) + (dy * dy) + (dz * dz) + SOFTENING);
+                double f = 1 / (r * r * r);
+                ax[i] += dx * f * gm[j];
+                ay[i] += dy * f * gm[j];
+                az[i] += dz * f * gm[j];
+                ax[j] -= dx * f * gm[i];
+                ay[j] -= dy * f * gm[i];
+                az[j] -= dz * f * gm[i];
+            }
+        }
+
+        // update the velocities and positions
+        #pragma GCC unroll 16
+        for (size_t i = 0; i < N; i++)
+        {
+            vx[i] += ax[i] * time_step;
+            vy[i] += ay[i] * time_step;
+            vz[i] += az[i] * time_step;
+            x[i] += vx[i] * time_step;
+            y[i] += vy[i] * time_step;
+            z[i] += vz[i] * time_step;
+        }
+        stop_check(stop, step);
+
+        // periodically copy the positions to the output data
+        if (step % output_steps == 0)
+        {
+            #pragma GCC unroll 16
+            for (size_t i = 0; i < N; i++)
+            {
+                MATRIX_AT(output, step / output_steps, i * 3 + 0) = x[i];
+                MATRIX_AT(output, step / output_steps, i * 3 + 1) = y[i];
+                MATRIX_AT(output, step / output_steps, i * 3 + 2) = z[i];
+            }
+        }
+    }
+
+    if (stop_last_step(stop) + 1 == num_steps && num_steps % output_steps != 0)
+    {
+        // save positions to the last row of the output matrix
+        #pragma GCC unroll 16
+        for (size_t i = 0; i < N; i++)
+        {
+            MATRIX_AT(output, output->rows - 1, i * 3 + 0) = x[i];
+            MATRIX_AT(output, output->rows - 1, i * 3 + 1) = y[i];
+            MATRIX_AT(output, output->rows - 1, i * 3 + 2) = z[i];
+        }
+    }
+}
+
+// stamps out the kernel for one specific number of bodies
+#define SMALL_KERNEL(N) \
+    static void simulateSmall##N(const Matrix* input, Matrix* output, size_t num_steps, size_t output_steps, double time_step, StopPoint* stop) \
+    { simulateSmallN(N, input, output, num_steps, output_steps, time_step, stop); }
+
+SMALL_KERNEL(1)  SMALL_KERNEL(2)  SMALL_KERNEL(3)  SMALL_KERNEL(4)
+SMALL_KERNEL(5)  SMALL_KERNEL(6)  SMALL_KERNEL(7)  SMALL_KERNEL(8)
+SMALL_KERNEL(9)  SMALL_KERNEL(10) SMALL_KERNEL(11) SMALL_KERNEL(12)
+SMALL_KERNEL(13) SMALL_KERNEL(14) SMALL_KERNEL(15) SMALL_KERNEL(16)
+
+#undef SMALL_KERNEL
+
+// kernels indexed by the number of bodies
+static const small_kernel small_kernels[SMALL_N_MAX + 1] = {
+    NULL,
+    simulateSmall1,  simulateSmall2,  simulateSmall3,  simulateSmall4,
+    simulateSmall5,  simulateSmall6,  simulateSmall7,  simulateSmall8,
+    simulateSmall9,  simulateSmall10, simulateSmall11, simulateSmall12,
+    simulateSmall13, simulateSmall14, simulateSmall15, simulateSmall16,
+};
+
+// this function runs the simulation with the kernel specialised for the number
+// of bodies in the input, the first row of the output must already be filled,
+// the last step it ran is stop_last_step(stop)
+inline static void simulateSmall(const Matrix* input, Matrix* output, size_t num_steps, size_t output_steps, double time_step, StopPoint* stop)
+{
+    small_kernels[input->rows](input, output, num_steps, output_steps, time_step, stop);
+}
+
+#endif // FORMULAS_SMALL_H
@@ -0,0 +1,24 @@
+#ifndef MASSES_H
+#define MASSES_H
+
+#include "arena.h"
+
+#define G 6.6743015e-11
+
+// this struct stores the masses after they have been preprocessed once at load
+// time so the kernels never multiply by G or divide by a mass
+typedef struct {
+    double* gm;      // G * mass of each body
+    double gm_equal; // G * mass when every body has the same mass, otherwise 0
+} Masses;
+
+// this function allocates the arrays for n bodies from the arena (aligned for
+// the kernels), they are filled in along with the rest of the body store by
+// loadBodies()
+inline static Masses createMasses(Arena* arena, size_t n)
+{
+    Masses masses = { (double*)arena_alloc(arena, n * sizeof(double)), 0 };
+    return masses;
+}
+
+#endif // MASSES_H
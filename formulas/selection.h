@@ -0,0 +1,175 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+// this header works with the Positions blocks of the formulas header that was
+// included before it (formulas.h, formulas3.h, formulap.h, or formulap3.h) and
+// needs bodies.h
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "matrix.h"
+#include "options.h"
+
+// rows of a region output that are allocated at first (a power of two), it
+// doubles when full
+#define REGION_INITIAL_ROWS 1024
+
+// this struct selects which positions are saved in the output (see --track,
+// --region, and --every), all of them in every output row if none are given
+typedef struct {
+    size_t* bodies;   // bodies saved in each row in order, NULL for all of them
+    size_t count;     // number of bodies saved in each row
+    bool region;      // only the bodies inside box are saved, as rows of [row, body, x, y, z]
+    double box[6];    // lowest x, y, and z and highest x, y, and z of the region
+    size_t every;     // only every this many output rows are saved, and the last one
+    size_t last;      // last output row of the run
+    bool mapped;      // the output is mapped from its file (see --mmap-output)
+    bool enabled;     // true if any of the options were given
+} OutputSelection;
+
+// this function parses a list of bodies like 0,3,10-19 into the selection,
+// it is called twice: first to count the bodies and then to store them
+inline static bool __parseTrackList(const char* list, size_t n, size_t* bodies, size_t* count)
+{
+    *count = 0;
+    const char* s = list;
+    while (*s)
+    {
+        char* end;
+        size_t first = strtoull(s, &end, 10), last = first;
+        if (end == s) { return false; }
+        if (*end == '-')
+        {
+            s = end + 1;
+            last = strtoull(s, &end, 10);
+            if (end == s || last < first) { return false; }
+        }
+        if (last >= n) { return false; }
+        for (size_t i = first; i <= last; i++, (*count)++) { if (bodies) { bodies[*count] = i; } }
+        if (*end == ',') { end++; } else if (*end) { return false; }
+        s = end;
+    }
+    return *count > 0;
+}
+
+// this function creates the selection of the options for n bodies and
+// num_outputs output rows from the arena, it returns false after printing an
+// error if --track or --region are invalid
+inline static bool createOutputSelection(OutputSelection* sel, Arena* arena, const Options* opts, size_t n, size_t num_outputs)
+{
+    memset(sel, 0, sizeof(OutputSelection));
+    sel->count = n;
+    sel->every = opts->every ? opts->every : 1;
+    sel->last = num_outputs - 1;
+    sel->mapped = opts->mmap_output;
+    sel->enabled = opts->track || opts->region || sel->every > 1;
+    if (opts->track)
+    {
+        size_t count;
+        if (!__parseTrackList(opts->track, n, NULL, &count)) { fprintf(stderr, "--track must be a list of bodies from 0 to %zu like 0,3,10-19\n", n - 1); return false; }
+        sel->bodies = (size_t*)arena_alloc(arena, count * sizeof(size_t));
+        __parseTrackList(opts->track, n, sel->bodies, &sel->count);
+    }
+    if (opts->region)
+    {
+        double* b = sel->box;
+        int end = 0;
+        if (sscanf(opts->region, "%lf,%lf,%lf,%lf,%lf,%lf%n", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6 || opts->region[end] ||
+            b[0] > b[3] || b[1] > b[4] || b[2] > b[5])
+        {
+            fprintf(stderr, "--region must be xmin,ymin,zmin,xmax,ymax,zmax\n");
+            return false;
+        }
+        sel->region = true;
+    }
+    return true;
+}
+
+// this function returns the number of rows of the output for the output rows
+// from 0 to num_outputs - 1 (fewer than in the run if it stopped early)
+inline static size_t selectedOutputRows(const OutputSelection* sel, size_t num_outputs)
+{
+    size_t last = num_outputs - 1;
+    return last == sel->last ? (last + sel->every - 1) / sel->every + 1 : last / sel->every + 1;
+}
+
+// this function creates the output matrix for the selection, either in memory
+// or directly in the output file, a region output starts empty and grows
+inline static Matrix* createSelectedOutput(Arena* arena, const OutputSelection* sel, const char* path, size_t num_outputs)
+{
+    if (sel->region)
+    {
+        Matrix* output = matrix_create_raw(REGION_INITIAL_ROWS, 5);
+        if (output) { output->rows = 0; output->size = 0; }
+        return output;
+    }
+    size_t rows = selectedOutputRows(sel, num_outputs);
+    return sel->mapped ? matrix_create_npy_path(path, rows, 3*sel->count) : matrix_create_raw_in(arena, rows, 3*sel->count);
+}
+
+// this function appends the bodies of the selection inside the region to a
+// region output, each as a row of [row, body, x, y, z]
+inline static void __saveRegion(Matrix* output, const OutputSelection* sel, size_t row, Positions* positions)
+{
+    const double* b = sel->box;
+    for (size_t j = 0; j < sel->count; j++)
+    {
+        size_t i = sel->bodies ? sel->bodies[j] : j;
+        double x = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
+        double y = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
+        double z = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
+        if (x < b[0] || y < b[1] || z < b[2] || x > b[3] || y > b[4] || z > b[5]) { continue; }
+        // the rows allocated are the next power of two, so it is full at a power of two
+        if (output->rows >= REGION_INITIAL_ROWS && (output->rows & (output->rows - 1)) == 0)
+        {
+            double* data = (double*)realloc(output->data, 2 * output->rows * 5 * sizeof(double));
+            if (!data) { perror("error growing the region output"); exit(1); }
+            output->data = data;
+        }
+        double* out = &output->data[output->size];
+        out[0] = row; out[1] = i; out[2] = x; out[3] = y; out[4] = z;
+        output->rows++;
+        output->size += 5;
+    }
+}
+
+// this function saves the selected positions of output row row, if the row is
+// saved at all, and releases the rows of a mapped output that are written
+inline static void saveSelectedPositions(Matrix* output, const OutputSelection* sel, size_t row, Positions* positions, size_t n)
+{
+    if (!sel->enabled)
+    {
+        savePositions(output, row, positions, n);
+        if (sel->mapped) { releaseOutputRows(output, row); }
+        return;
+    }
+    if (row % sel->every != 0 && row != sel->last) { return; }
+    if (sel->region) { __saveRegion(output, sel, row, positions); return; }
+    size_t out_row = (row + sel->every - 1) / sel->every;
+    if (!sel->bodies) { savePositions(output, out_row, positions, n); }
+    else
+    {
+        double* out = &MATRIX_AT(output, out_row, 0);
+        for (size_t j = 0; j < sel->count; j++, out += 3)
+        {
+            size_t i = sel->bodies[j];
+            out[0] = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
+            out[1] = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
+            out[2] = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
+        }
+    }
+    if (sel->mapped) { releaseOutputRows(output, out_row); }
+}
+
+// this function keeps only the output rows of the first num_outputs output
+// rows when the run stopped early (a region output only has those)
+inline static bool truncateSelectedOutput(Matrix* output, const OutputSelection* sel, const char* path, size_t num_outputs)
+{
+    if (sel->region) { return true; }
+    return truncateOutput(output, path, selectedOutputRows(sel, num_outputs), sel->mapped);
+}
+
+#endif // SELECTION_H
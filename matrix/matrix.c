@@ -5,21 +5,38 @@
 #define __STDC_WANT_LIB_EXT2__ 1 // allows some extra features in C
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
 #include <math.h>
+#include <float.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "matrix.h"
+#include "matrix_loop_helpers.h"
 #include "matrix_io_helpers.h"
+#include "matrix_multiply_helpers.h"
 
 #define DATA_MALLOCED   1 // data is from malloc(), needs free()
 #define DATA_MEMMAPPED  2 // data is from mmap(), needs munmap()
 #define DATA_BORROWED   3 // data is from elsewhere and should not be freed
+#define DATA_ARENA      4 // data and the Matrix are from an arena, freed with it
+
+// the external definitions of the inline functions in matrix.h, so every file
+// gets the same function pointers for them
+extern inline double matrix_reciprocal(double a);
+extern inline double matrix_positive(double a);
+extern inline double matrix_negative(double a);
+extern inline double matrix_add(double a, double b);
+extern inline double matrix_subtract(double a, double b);
+extern inline double matrix_multiply(double a, double b);
+extern inline double matrix_divide(double a, double b);
 
 
 //////////////////// Matrix Creation Functions //////////////////// 
@@ -47,12 +64,29 @@ Matrix* matrix_create_raw(size_t rows, size_t cols) {
 }
 
 /**
- * Frees a Matrix object and its data (if not borrowed).
+ * Creates a new matrix of the given rows and columns from an arena. The data
+ * is zeroed. Returns the newly created matrix.
+ */
+Matrix* matrix_create_raw_in(Arena* arena, size_t rows, size_t cols) {
+    Matrix* M = (Matrix*)arena_alloc(arena, sizeof(Matrix));
+    double* data = (double*)arena_alloc(arena, rows*cols*sizeof(double));
+    if (!M || !data) { return NULL; }
+    M->rows = rows;
+    M->cols = cols;
+    M->size = rows * cols;
+    M->data = data;
+    M->data_source = DATA_ARENA;
+    return M;
+}
+
+/**
+ * Frees a Matrix object and its data (if not borrowed or from an arena).
  */
 void matrix_free(Matrix* M) {
+    if (M->data_source == DATA_ARENA) { return; }
     if (M->data_source == DATA_MEMMAPPED) {
         size_t addr = ((size_t)M->data) & ~(sysconf(_SC_PAGE_SIZE)-1);
-        munmap((void*)addr, M->size*sizeof(double));
+        munmap((void*)addr, ((size_t)M->data) - addr + M->size*sizeof(double));
     } else if (M->data_source == DATA_MALLOCED) {
         free(M->data);
     }
@@ -120,44 +154,50 @@ Matrix* matrix_copy(const Matrix* M) {
  * row has more values than the first row, those extra values are ignored. If
  * any row has less than the first row, the missing data is filled with 0s. If
  * there is a problem reading from the file, NULL is returned.
+ *
+ * The rest of the file (from its current position) is memory-mapped, or read
+ * all at once if it cannot be mapped (e.g. a pipe), and large files are parsed
+ * by several threads when compiled with OpenMP.
  */
 Matrix* matrix_from_csv(FILE* file) {
-    // Get the first line from the file
-    char* line = NULL;
-    size_t len = 0;
-    if (getline(&line, &len, file) <= 0 || len <= 0) {
-        free(line);
-        return NULL;
-    }
-
-    // Parse the first line of the file, getting the number of columns
-    double* data = NULL;
-    size_t rows = 1, cols = __read_csv_first_line(line, &data);
-    if (cols == 0) { free(line); free(data); return NULL; }
-
-    // Get remaining rows of the file
-    size_t rows_alloc = cols; // assume square, adjust later if needed
-    data = (double*)realloc(data, cols*rows_alloc*sizeof(double));
-    while (!feof(file)) {
-        if (getline(&line, &len, file) <= 0) { break; }
-        __read_csv_line(line, &(data[rows*cols]), cols);
-        if (++rows == rows_alloc) {
-            rows_alloc += rows_alloc > 128 ? 128 : rows_alloc;
-            data = (double*)realloc(data, rows_alloc*cols*sizeof(double));
+    // Map the rest of the file if it is a regular file
+    struct stat st;
+    long pos = ftell(file);
+    char* buf = NULL;
+    size_t len = 0, map_len = 0;
+    if (pos >= 0 && fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > pos) {
+        map_len = st.st_size;
+        buf = (char*)mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (buf == MAP_FAILED) { return NULL; }
+        madvise(buf, map_len, MADV_SEQUENTIAL);
+        len = map_len - pos;
+        fseek(file, 0, SEEK_END);
+    } else {
+        // Otherwise read everything that is left
+        size_t alloc = 0;
+        while (!feof(file) && !ferror(file)) {
+            if (len == alloc) {
+                alloc = alloc ? 2*alloc : CSV_CHUNK_SIZE;
+                buf = (char*)realloc(buf, alloc);
+            }
+            len += fread(buf + len, 1, alloc - len, file);
         }
+        if (ferror(file)) { free(buf); return NULL; }
     }
-    free(line);
 
-    // Make the final matrix
-    return matrix_alloc(rows, cols,
-        (double*)realloc(data, rows*cols*sizeof(double)), DATA_MALLOCED);
+    // Parse it
+    size_t rows = 0, cols = 0;
+    double* data = len ? __read_csv(map_len ? buf + pos : buf, len, &rows, &cols) : NULL;
+    if (map_len) { munmap(buf, map_len); } else { free(buf); }
+    if (!data) { return NULL; }
+    return matrix_alloc(rows, cols, data, DATA_MALLOCED);
 }
 
 /**
  * Same as matrix_from_csv() but takes a file path instead.
  */
 Matrix* matrix_from_csv_path(const char* path) {
-    FILE* f = fopen(path, "r+");
+    FILE* f = fopen(path, "r");
     if (!f) { return NULL; }
     Matrix* M = matrix_from_csv(f);
     fclose(f);
@@ -165,18 +205,38 @@ Matrix* matrix_from_csv_path(const char* path) {
 }
 
 /**
- * Saves a matrix to a CSV file.
+ * Saves a matrix to a CSV file. Every value is written so that it reads back
+ * as exactly the same value, with the fewest digits possible for nearly all
+ * values. Large matrices are formatted by several threads when compiled with
+ * OpenMP.
  * 
  * If the file argument is given as stdout, this will print it to the terminal.
  */
 void matrix_to_csv(FILE* file, const Matrix* M) {
     if (M->rows < 1 || M->cols < 1) { return; }
-    for (size_t i = 0, ind = 0; i < M->rows; i++, ind++) {
-        for (size_t j = 0; j < M->cols-1; j++, ind++) {
-            fprintf(file, "%f,", M->data[ind]);
+
+    // rows are formatted in chunks of about CSV_CHUNK_SIZE bytes, a batch of
+    // chunks at a time, and then written in order
+    size_t chunk_rows = CSV_CHUNK_SIZE / (M->cols * CSV_MAX_VAL_LEN);
+    if (chunk_rows == 0) { chunk_rows = 1; }
+    size_t num_chunks = (M->rows + chunk_rows - 1) / chunk_rows;
+    size_t batch = num_chunks < CSV_WRITE_BATCH ? num_chunks : CSV_WRITE_BATCH;
+    size_t chunk_size = chunk_rows * M->cols * CSV_MAX_VAL_LEN;
+    char* buf = (char*)malloc(batch * chunk_size);
+    size_t lens[CSV_WRITE_BATCH];
+    for (size_t first = 0; first < num_chunks; first += batch) {
+        size_t count = num_chunks - first < batch ? num_chunks - first : batch;
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic) if(count > 1)
+#endif
+        for (size_t c = 0; c < count; c++) {
+            size_t row = (first + c) * chunk_rows;
+            size_t num_rows = M->rows - row < chunk_rows ? M->rows - row : chunk_rows;
+            lens[c] = __write_csv_rows(buf + c*chunk_size, &M->data[row*M->cols], num_rows, M->cols);
         }
-        fprintf(file, "%f\n", M->data[ind]);
+        for (size_t c = 0; c < count; c++) { fwrite(buf + c*chunk_size, 1, lens[c], file); }
     }
+    free(buf);
 }
 
 /**
@@ -192,10 +252,13 @@ bool matrix_to_csv_path(const char* path, const Matrix* M) {
 
 /**
  * Creates a new matrix by loading the data from the given NPY file. This is
- * a file format used by the numpy library. This function only supports arrays
- * that are little-endian doubles, c-contiguous, and 1 or 2 dimensional. The
- * file is loaded as memory-mapped so it is backed by the file and loaded
- * on-demand. The file should be opened for reading or reading and writing.
+ * a file format used by the numpy library. This function supports arrays of
+ * 32 or 64-bit floats of either byte order, stored by row or by column
+ * (fortran_order), that are 1 or 2 dimensional, in any version of the format.
+ * Arrays of native doubles stored by row are loaded as memory-mapped so they
+ * are backed by the file and loaded on-demand. Anything else is converted to
+ * them while it is read, so changes to the matrix do not reach the file. The
+ * file should be opened for reading or reading and writing.
  * 
  * This will return NULL if the data cannot be read, the file format is not
  * recognized, there are memory allocation issues, or the array is not a
@@ -204,7 +267,9 @@ bool matrix_to_csv_path(const char* path, const Matrix* M) {
 Matrix* matrix_from_npy(FILE* file) {
     // Read the header, check it, and get the shape of the matrix
     size_t sh[2], offset;
-    if (!__npy_read_header(file, sh, &offset)) { return NULL; }
+    __npy_format format;
+    if (!__npy_read_header(file, sh, &offset, &format)) { return NULL; }
+    if (!NPY_IS_NATIVE(format)) { return __npy_load_converted(file, sh, offset, format); }
 
     // Get the memory mapped data
     void* x = (void*)mmap(NULL, sh[0]*sh[1]*sizeof(double) + offset,
@@ -227,21 +292,90 @@ Matrix* matrix_from_npy_path(const char* path) {
     return M;
 }
 
+/**
+ * Privately maps a NPY file (or loads it if it needs converting) for
+ * matrix_from_npy_readonly() and matrix_from_npy_sparse(). When sequential,
+ * the kernel is told the data will be read in order and soon, otherwise that
+ * it will be read in scattered places so nothing else is read ahead.
+ */
+static Matrix* __npy_map_readonly(FILE* file, bool sequential) {
+    // Read the header, check it, and get the shape of the matrix
+    size_t sh[2], offset;
+    __npy_format format;
+    if (!__npy_read_header(file, sh, &offset, &format)) { return NULL; }
+    if (!NPY_IS_NATIVE(format)) { return __npy_load_converted(file, sh, offset, format); }
+
+    // Get the privately memory mapped data
+    size_t length = sh[0]*sh[1]*sizeof(double) + offset;
+    void* x = (void*)mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+                          fileno(file), 0);
+    if (x == MAP_FAILED) { return NULL; }
+    if (sequential) {
+        madvise(x, length, MADV_SEQUENTIAL);
+        madvise(x, length, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+        madvise(x, length, MADV_HUGEPAGE); // only a hint, ignored if unsupported
+#endif
+    } else {
+        madvise(x, length, MADV_RANDOM);
+    }
+
+    // Make the matrix itself
+    double* data = (double*)(((char*)x) + offset);
+    return matrix_alloc(sh[0], sh[1], data, DATA_MEMMAPPED);
+}
+
+/**
+ * Creates a new matrix by loading the data from the given NPY file without
+ * ever writing to it. This is the same as matrix_from_npy() except that the
+ * file only needs to be opened for reading and the mapping is private: the
+ * matrix can still be modified but the changes are copy-on-write and never
+ * reach the file. The kernel is told the data will be read sequentially and
+ * soon so it starts reading ahead immediately.
+ */
+Matrix* matrix_from_npy_readonly(FILE* file) {
+    return __npy_map_readonly(file, true);
+}
+
+/**
+ * Same as matrix_from_npy_readonly() but takes a file path instead.
+ */
+Matrix* matrix_from_npy_readonly_path(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { return NULL; }
+    Matrix* M = matrix_from_npy_readonly(f);
+    fclose(f);
+    return M;
+}
+
+/**
+ * Same as matrix_from_npy_readonly() except that nothing is read ahead: only
+ * the pages of the file that are used are ever read. This is for taking a
+ * small part of a large file, such as some of the rows or columns.
+ */
+Matrix* matrix_from_npy_sparse(FILE* file) {
+    return __npy_map_readonly(file, false);
+}
+
+/**
+ * Same as matrix_from_npy_sparse() but takes a file path instead.
+ */
+Matrix* matrix_from_npy_sparse_path(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { return NULL; }
+    Matrix* M = matrix_from_npy_sparse(f);
+    fclose(f);
+    return M;
+}
+
 /**
  * Saves a matrix to a NPY file. This is a file format used by the numpy
  * library. This will return false if the data cannot be written.
  */
 bool matrix_to_npy(FILE* file, const Matrix* M) {
     // create the header
-    char header[128];
-    size_t len = snprintf(header, sizeof(header), "\x93NUMPY\x01   "
-        "{'descr': '<f8', 'fortran_order': False, 'shape': (%zu, %zu), }",
-        M->rows, M->cols);
-    if (len < 0) { return false; }
-    header[7] = 0; // have to after the string is written
-    *(unsigned short*)&header[8] = sizeof(header) - 10;
-    memset(header + len, ' ', sizeof(header)-len-1);
-    header[sizeof(header)-1] = '\n';
+    char header[NPY_HEADER_SIZE];
+    if (!__npy_write_header(header, M->rows, M->cols)) { return false; }
 
     // write the header and the data
     return fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
@@ -260,6 +394,78 @@ bool matrix_to_npy_path(const char* path, const Matrix* M) {
 }
 
 
+/**
+ * Creates a new matrix of the given rows and columns that is backed directly by
+ * a new NPY file at the given path. The file is created with its final size
+ * (the space is allocated up front so the disk cannot fill up part way through)
+ * and mapped shared, so anything written to the matrix ends up in the file
+ * without ever calling matrix_to_npy(). The data is NOT initialized. Once the
+ * matrix is freed the file is complete. Returns NULL if the file cannot be
+ * created, allocated, or mapped.
+ */
+Matrix* matrix_create_npy_path(const char* path, size_t rows, size_t cols) {
+    char header[NPY_HEADER_SIZE];
+    if (!__npy_write_header(header, rows, cols)) { errno = EINVAL; return NULL; }
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) { return NULL; }
+    size_t length = sizeof(header) + rows*cols*sizeof(double);
+    int err = posix_fallocate(fd, 0, length);
+    if (err == EOPNOTSUPP || err == EINVAL) {
+        err = ftruncate(fd, length) ? errno : 0; // file system can't preallocate
+    }
+    if (err || pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+        if (err) { errno = err; }
+        close(fd);
+        return NULL;
+    }
+    void* x = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (x == MAP_FAILED) { return NULL; }
+    return matrix_alloc(rows, cols, (double*)(((char*)x) + sizeof(header)),
+                        DATA_MEMMAPPED);
+}
+
+/**
+ * Releases the memory of rows [first, last) of a matrix created with
+ * matrix_create_npy_path() once they are completely written. Writeback of the
+ * rows to the file is started and they are dropped from the memory of the
+ * process (the data remains in the file). Writing to them again afterwards is
+ * allowed but slow. This also works for a matrix memory-mapped by
+ * matrix_from_npy_readonly() once rows are no longer needed, since they are
+ * read back from the file when used again. Nothing is done for matrices that
+ * are not memory-mapped.
+ */
+void matrix_npy_release_rows(Matrix* M, size_t first, size_t last) {
+    if (M->data_source != DATA_MEMMAPPED) { return; }
+    size_t page = sysconf(_SC_PAGE_SIZE);
+    size_t start = ((size_t)&M->data[first*M->cols]) & ~(page-1);
+    size_t end = ((size_t)&M->data[last*M->cols] + page-1) & ~(page-1);
+    if (end <= start) { return; }
+    msync((void*)start, end - start, MS_ASYNC);
+    madvise((void*)start, end - start, MADV_DONTNEED);
+}
+
+/**
+ * Shrinks a matrix created with matrix_create_npy_path() (from the file at
+ * path) to its first rows rows, for example when a run stops early. The shape
+ * in the header of the file is updated, the file is cut after those rows, and
+ * the mapping of the rest is removed, so the file is a valid NPY file of the
+ * rows. Returns false if the matrix is not mapped or has fewer rows, or if the
+ * file cannot be cut.
+ */
+bool matrix_npy_truncate_path(const char* path, Matrix* M, size_t rows) {
+    if (M->data_source != DATA_MEMMAPPED || rows > M->rows) { errno = EINVAL; return false; }
+    char* header = ((char*)M->data) - NPY_HEADER_SIZE;
+    if (!__npy_write_header(header, rows, M->cols)) { errno = EINVAL; return false; }
+    size_t page = sysconf(_SC_PAGE_SIZE);
+    size_t keep = ((size_t)&M->data[rows*M->cols] + page-1) & ~(page-1);
+    size_t end = ((size_t)&M->data[M->size] + page-1) & ~(page-1);
+    if (end > keep) { munmap((void*)keep, end - keep); }
+    M->rows = rows;
+    M->size = rows*M->cols;
+    return truncate(path, NPY_HEADER_SIZE + M->size*sizeof(double)) == 0;
+}
+
 //////////////////// Matrix Comparison Functions //////////////////// 
 
 /**
@@ -282,12 +488,21 @@ bool matrix_equal(const Matrix* A, const Matrix* B) {
  */
 bool matrix_allclose(const Matrix* A, const Matrix* B, double rtol, double atol) {
     if (A->rows != B->rows || A->cols != B->cols) { return false; }
-    for (size_t i = 0; i < A->size; i++) {
-        if (fabs(A->data[i] - B->data[i]) >= atol + rtol * fabs(B->data[i])) {
-            return false;
+    size_t size = A->size, num_chunks = (size + REDUCE_CHUNK_SIZE - 1) / REDUCE_CHUNK_SIZE;
+    bool close = true;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) reduction(&&:close) if(size >= PARALLEL_MIN_SIZE)
+#endif
+    for (size_t c = 0; c < num_chunks; c++) {
+        if (!close) { continue; } // this thread has already found a difference
+        size_t last = size - c*REDUCE_CHUNK_SIZE < REDUCE_CHUNK_SIZE ? size : (c+1)*REDUCE_CHUNK_SIZE;
+        bool far = false;
+        for (size_t i = c*REDUCE_CHUNK_SIZE; i < last; i++) {
+            far |= !(fabs(A->data[i] - B->data[i]) <= atol + rtol * fabs(B->data[i])); // also nan
         }
+        close = !far;
     }
-    return true;
+    return close;
 }
 
 
@@ -298,7 +513,7 @@ bool matrix_allclose(const Matrix* A, const Matrix* B, double rtol, double atol)
  * the return value of the function. This operates in-place.
  */
 void matrix_apply(Matrix* M, unary_func func) {
-    for (size_t i = 0; i < M->size; i++) { M->data[i] = func(M->data[i]); }
+    __unary_all(func, M->data, M->data, M->size);
 }
 
 /**
@@ -307,7 +522,7 @@ void matrix_apply(Matrix* M, unary_func func) {
  */
 Matrix* matrix_map(const Matrix* M, unary_func func) {
     Matrix* out = matrix_create_raw(M->rows, M->cols);
-    for (size_t i = 0; i < M->size; i++) { out->data[i] = func(M->data[i]); }
+    __unary_all(func, out->data, M->data, M->size);
     return out;
 }
 
@@ -319,9 +534,7 @@ Matrix* matrix_map(const Matrix* M, unary_func func) {
  */
 bool matrix_matrix_apply(Matrix* A, const Matrix* B, binary_func func) {
     if (A->rows != B->rows || A->cols != B->cols) { return false; }
-    for (size_t i = 0; i < A->size; i++) {
-        A->data[i] = func(A->data[i], B->data[i]);
-    }
+    __binary_all(func, A->data, A->data, B->data, A->size);
     return true;
 }
 
@@ -333,9 +546,7 @@ bool matrix_matrix_apply(Matrix* A, const Matrix* B, binary_func func) {
 Matrix* matrix_matrix_map(const Matrix* A, const Matrix* B, binary_func func) {
     if (A->rows != B->rows || A->cols != B->cols) { return NULL; }
     Matrix* out = matrix_create_raw(A->rows, A->cols);
-    for (size_t i = 0; i < A->size; i++) {
-        out->data[i] = func(A->data[i], B->data[i]);
-    }
+    __binary_all(func, out->data, A->data, B->data, A->size);
     return out;
 }
 
@@ -345,7 +556,7 @@ Matrix* matrix_matrix_map(const Matrix* A, const Matrix* B, binary_func func) {
  * with the return value of the function. This operates in-place.
  */
 void matrix_scalar_apply(Matrix* A, double b, binary_func func) {
-    for (size_t i = 0; i < A->size; i++) { A->data[i] = func(A->data[i], b); }
+    __binary_scalar_all(func, A->data, A->data, b, A->size);
 }
 
 /**
@@ -355,7 +566,7 @@ void matrix_scalar_apply(Matrix* A, double b, binary_func func) {
  */
 Matrix* matrix_scalar_map(const Matrix* A, double b, binary_func func) {
     Matrix* out = matrix_create_raw(A->rows, A->cols);
-    for (size_t i = 0; i < A->size; i++) { out->data[i] = func(A->data[i], b); }
+    __binary_scalar_all(func, out->data, A->data, b, A->size);
     return out;
 }
 
@@ -365,7 +576,7 @@ Matrix* matrix_scalar_map(const Matrix* A, double b, binary_func func) {
  * with the return value of the function. This operates in-place.
  */
 void scalar_matrix_apply(double a, Matrix* B, binary_func func) {
-    for (size_t i = 0; i < B->size; i++) { B->data[i] = func(a, B->data[i]); }
+    __scalar_binary_all(func, B->data, a, B->data, B->size);
 }
 
 /**
@@ -375,7 +586,7 @@ void scalar_matrix_apply(double a, Matrix* B, binary_func func) {
  */
 Matrix* scalar_matrix_map(double a, const Matrix* B, binary_func func) {
     Matrix* out = matrix_create_raw(B->rows, B->cols);
-    for (size_t i = 0; i < B->size; i++) { out->data[i] = func(a, B->data[i]); }
+    __scalar_binary_all(func, out->data, a, B->data, B->size);
     return out;
 }
 
@@ -384,9 +595,7 @@ Matrix* scalar_matrix_map(double a, const Matrix* B, binary_func func) {
  * reducing down to a single value. Useful for things like fmax().
  */
 double matrix_reduce(const Matrix* A, binary_func func) {
-    double val = A->data[0];
-    for (size_t i = 1; i < A->size; i++) { val = func(A->data[i], val); }
-    return val;
+    return A->size > 0 ? __reduce_all(func, A->data, A->size) : NAN;
 }
 
 /**
@@ -395,13 +604,7 @@ double matrix_reduce(const Matrix* A, binary_func func) {
  */
 Matrix* matrix_reduce_rows(const Matrix* A, binary_func func) {
     Matrix* out = matrix_create_raw(A->rows, 1);
-    for (size_t i = 0; i < A->rows; i++) {
-        double val = MATRIX_AT(A, i, 0);
-        for (size_t j = 1; j < A->cols; j++) {
-            val = func(MATRIX_AT(A, i, j), val);
-        }
-        MATRIX_AT(out, i, 0) = val;
-    }
+    __reduce_rows_all(func, A, out->data);
     return out;
 }
 
@@ -412,13 +615,7 @@ Matrix* matrix_reduce_rows(const Matrix* A, binary_func func) {
  */
 Matrix* matrix_reduce_cols(const Matrix* A, binary_func func) {
     Matrix* out = matrix_create_raw(1, A->cols);
-    for (size_t i = 0; i < A->cols; i++) {
-        double val = MATRIX_AT(A, 0, i);
-        for (size_t j = 1; j < A->rows; j++) {
-            val = func(MATRIX_AT(A, j, i), val);
-        }
-        MATRIX_AT(out, 0, i) = val;
-    }
+    __reduce_cols_all(func, A, out->data);
     return out;
 }
 
@@ -428,8 +625,8 @@ Matrix* matrix_reduce_cols(const Matrix* A, binary_func func) {
 /**
  * Matrix multiplication. https://en.wikipedia.org/wiki/Matrix_multiplication
  * Output is written to the third argument which must be the right size.
- * If the inner dimensions are not equal or output not the right size, this
- * returns false.
+ * If the inner dimensions are not equal or output not the right size, or the
+ * memory for the packed blocks cannot be allocated, this returns false.
  */
 bool matrix_multiplication(const Matrix* A, const Matrix* B, Matrix* C) {
     const size_t m = A->rows, n = A->cols, p = B->cols;
@@ -438,15 +635,10 @@ bool matrix_multiplication(const Matrix* A, const Matrix* B, Matrix* C) {
         return false;
     }
 
-    for (size_t i = 0; i < m; i++) {
-        for (size_t j = 0; j < p; j++) {
-            double value = 0;
-            for (size_t k = 0; k < n; k++) {
-                value += MATRIX_AT(A, i, k) * MATRIX_AT(B, k, j);
-            }
-            MATRIX_AT(C, i, j) = value;
-        }
+    // packed and tiled (see matrix_multiply_helpers.h)
+    if (!__gemm(m, n, p, A->data, B->data, C->data)) {
+        errno = ENOMEM;
+        return false;
     }
-    
     return true;
 }
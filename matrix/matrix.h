@@ -12,12 +12,13 @@
 #include <stdio.h>
 #include <math.h>
 
+#include "arena.h"
 
 struct _Matrix {
     // Our basic matrix structure
     size_t rows, cols, size; // size is simply rows*cols, but it comes up a lot
     double* data;
-    char data_source; // one of DATA_MALLOCED, DATA_MEMMAPPED, or DATA_BORROWED
+    char data_source; // one of DATA_MALLOCED, DATA_MEMMAPPED, DATA_BORROWED, or DATA_ARENA
 };
 typedef struct _Matrix Matrix; // make type "struct _Matrix" just "Matrix"
 
@@ -34,10 +35,19 @@ typedef double (*binary_func)(double, double);
  */
 Matrix* matrix_create_raw(size_t rows, size_t cols);
 
+/**
+ * Creates a new matrix of the given rows and columns with both the Matrix and
+ * its data allocated from an arena, so they are freed by arena_free(). The data
+ * is aligned for SIMD loads (see arena_alloc()) and is all set to zeroes.
+ * Returns the newly created matrix or NULL if the memory cannot be allocated.
+ * The data_source attribute is set to DATA_ARENA.
+ */
+Matrix* matrix_create_raw_in(Arena* arena, size_t rows, size_t cols);
+
 /**
  * Frees a Matrix object. Depending on the data_source, either the data is
  * free()ed, munmap()ed, or nothing is done to it. Afterwards the Matrix
- * variable itself is freed.
+ * variable itself is freed (unless it is from an arena).
  */
 void matrix_free(Matrix* M);
 
@@ -79,6 +89,10 @@ Matrix* matrix_copy(const Matrix* M);
  * row has more values than the first row, those extra values are ignored. If
  * any row has less than the first row, the missing data is filled with 0s. If
  * there is a problem reading from the file, NULL is returned.
+ *
+ * The rest of the file (from its current position) is memory-mapped, or read
+ * all at once if it cannot be mapped (e.g. a pipe), and large files are parsed
+ * by several threads when compiled with OpenMP.
  */
 Matrix* matrix_from_csv(FILE* file);
 
@@ -88,7 +102,10 @@ Matrix* matrix_from_csv(FILE* file);
 Matrix* matrix_from_csv_path(const char* path);
 
 /**
- * Saves a matrix to a CSV file.
+ * Saves a matrix to a CSV file. Every value is written so that it reads back
+ * as exactly the same value, with the fewest digits possible for nearly all
+ * values. Large matrices are formatted by several threads when compiled with
+ * OpenMP.
  * 
  * If the file argument is given as stdout, this will print it to the terminal.
  */
@@ -101,10 +118,13 @@ bool matrix_to_csv_path(const char* path, const Matrix* M);
 
 /**
  * Creates a new matrix by loading the data from the given NPY file. This is
- * a file format used by the numpy library. This function only supports arrays
- * that are little-endian doubles, c-contiguous, and 1 or 2 dimensional. The
- * file is loaded as memory-mapped so it is backed by the file and loaded
- * on-demand. The file should be opened for reading or reading and writing.
+ * a file format used by the numpy library. This function supports arrays of
+ * 32 or 64-bit floats of either byte order, stored by row or by column
+ * (fortran_order), that are 1 or 2 dimensional, in any version of the format.
+ * Arrays of native doubles stored by row are loaded as memory-mapped so they
+ * are backed by the file and loaded on-demand. Anything else is converted to
+ * them while it is read, so changes to the matrix do not reach the file. The
+ * file should be opened for reading or reading and writing.
  * 
  * This will return NULL if the data cannot be read, the file format is not
  * recognized, there are memory allocation issues, or the array is not a
@@ -117,6 +137,32 @@ Matrix* matrix_from_npy(FILE* file);
  */
 Matrix* matrix_from_npy_path(const char* path);
 
+/**
+ * Creates a new matrix by loading the data from the given NPY file without
+ * ever writing to it. This is the same as matrix_from_npy() except that the
+ * file only needs to be opened for reading and the mapping is private: the
+ * matrix can still be modified but the changes are copy-on-write and never
+ * reach the file. The data is expected to be read sequentially.
+ */
+Matrix* matrix_from_npy_readonly(FILE* file);
+
+/**
+ * Same as matrix_from_npy_readonly() but takes a file path instead.
+ */
+Matrix* matrix_from_npy_readonly_path(const char* path);
+
+/**
+ * Same as matrix_from_npy_readonly() except that nothing is read ahead: only
+ * the pages of the file that are used are ever read. This is for taking a
+ * small part of a large file, such as some of the rows or columns.
+ */
+Matrix* matrix_from_npy_sparse(FILE* file);
+
+/**
+ * Same as matrix_from_npy_sparse() but takes a file path instead.
+ */
+Matrix* matrix_from_npy_sparse_path(const char* path);
+
 /**
  * Saves a matrix to a NPY file. This is a file format used by the numpy
  * library. This will return false if the data cannot be written.
@@ -129,6 +175,38 @@ bool matrix_to_npy(FILE* file, const Matrix* M);
 bool matrix_to_npy_path(const char* path, const Matrix* M);
 
 
+/**
+ * Creates a new matrix of the given rows and columns that is backed directly by
+ * a new NPY file at the given path. The file is created with its final size
+ * and mapped so anything written to the matrix ends up in the file without
+ * ever calling matrix_to_npy(). The data is NOT initialized. Once the matrix is
+ * freed the file is complete. Returns NULL if the file cannot be created,
+ * allocated, or mapped.
+ */
+Matrix* matrix_create_npy_path(const char* path, size_t rows, size_t cols);
+
+/**
+ * Releases the memory of rows [first, last) of a matrix created with
+ * matrix_create_npy_path() once they are completely written. Writeback of the
+ * rows to the file is started and they are dropped from the memory of the
+ * process (the data remains in the file). Writing to them again afterwards is
+ * allowed but slow. This also works for a matrix memory-mapped by
+ * matrix_from_npy_readonly() once rows are no longer needed, since they are
+ * read back from the file when used again. Nothing is done for matrices that
+ * are not memory-mapped.
+ */
+void matrix_npy_release_rows(Matrix* M, size_t first, size_t last);
+
+/**
+ * Shrinks a matrix created with matrix_create_npy_path() (from the file at
+ * path) to its first rows rows, for example when a run stops early. The shape
+ * in the header of the file is updated, the file is cut after those rows, and
+ * the mapping of the rest is removed, so the file is a valid NPY file of the
+ * rows. Returns false if the matrix is not mapped or has fewer rows, or if the
+ * file cannot be cut.
+ */
+bool matrix_npy_truncate_path(const char* path, Matrix* M, size_t rows);
+
 //////////////////// Matrix Comparison Functions //////////////////// 
 
 /**
@@ -158,6 +236,8 @@ bool matrix_allclose(const Matrix* A, const Matrix* B, double rtol, double atol)
 //    a Matrix* or a double [for scalar])
 //  * all of these functions are incredibly similar, just a few changes between
 //    each one
+//  * large matrices are split between threads when compiled with OpenMP, so
+//    custom functions must be safe to call from multiple threads
 
 
 /**
@@ -251,7 +331,10 @@ Matrix* scalar_matrix_map(double a, const Matrix* B, binary_func func);
 
 /**
  * Apply a binary function to every elements and the previous return value,
- * reducing down to a single value. Useful for things like fmax().
+ * reducing down to a single value. Useful for things like fmax(). Reductions
+ * with matrix_add, matrix_multiply, fmin, and fmax are done in fixed chunks in
+ * parallel, so the result does not depend on the number of threads (but may
+ * differ in the last bits from a single in-order sum). This returns nan for an empty matrix.
  */
 double matrix_reduce(const Matrix* A, binary_func func);
 
@@ -272,13 +355,21 @@ Matrix* matrix_reduce_cols(const Matrix* A, binary_func func);
 //////////////////// Unary and Binary Functions //////////////////// 
 // These are to be used with the *_apply() and *_map() functions like:
 //   M = matrix_map(A, sin)    // creates a new matrix where each value is the sin of the corresponding value in A
-//   matrix_apply(M, negative) // replaces all values in M with their negative
-//   C = matrix_matrix_map(A, B, subtract) // all values in C are the difference of values in A and B
+//   matrix_apply(M, matrix_negative) // replaces all values in M with their negative
+//   C = matrix_matrix_map(A, B, matrix_subtract) // all values in C are the difference of values in A and B
+// The matrix_ versions of the functions below and fabs, sqrt, floor, ceil,
+// trunc, fmin, and fmax are recognized by those functions and run as inlined,
+// vectorized loops, the others are called for each value. The matrix_ versions
+// are inline instead of static inline so they have the same address in every
+// file (matrix.c has their external definitions).
 
 // Unary functions
 static inline double reciprocal(double a) { return 1 / a; }
 static inline double positive(double a) { return +a; }
 static inline double negative(double a) { return -a; }
+inline double matrix_reciprocal(double a) { return 1 / a; }
+inline double matrix_positive(double a) { return +a; }
+inline double matrix_negative(double a) { return -a; }
 // included in math.h:
 // fabs, exp, exp2, expm1, log, log10, log2, log1p, sqrt, cbrt
 // sin, cos, tan, asin, acos, atan, sinh, cosh, tanh, asinh, acosh, atanh
@@ -286,11 +377,15 @@ static inline double negative(double a) { return -a; }
 // ceil, floor, trunc, round, nearbyint, rint
 // and more
 
-// Binary functions
+// Binary functions (element-wise)
 static inline double add(double a, double b) { return a + b; }
 static inline double subtract(double a, double b) { return a - b; }
 static inline double multiply(double a, double b) { return a * b; }
 static inline double divide(double a, double b) { return a / b; }
+inline double matrix_add(double a, double b) { return a + b; }
+inline double matrix_subtract(double a, double b) { return a - b; }
+inline double matrix_multiply(double a, double b) { return a * b; }
+inline double matrix_divide(double a, double b) { return a / b; }
 // included in math.h:
 // fmod, remainder, fmin, fmax, fdim, pow, hypot, atan2
 
@@ -308,7 +403,7 @@ static inline double divide(double a, double b) { return a / b; }
 /**
  * Matrix multiplication. https://en.wikipedia.org/wiki/Matrix_multiplication
  * Output is written to the third argument which must be the right size.
- * If the inner dimensions are not equal or output not the right size, this
- * returns false.
+ * If the inner dimensions are not equal or output not the right size, or the
+ * memory for the packed blocks cannot be allocated, this returns false.
  */
 bool matrix_multiplication(const Matrix* A, const Matrix* B, Matrix* C);
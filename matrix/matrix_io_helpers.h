@@ -1,42 +1,443 @@
 ////////// CSV File Reading //////////
+// The whole file is mapped (or read) into memory and split into chunks of
+// about CSV_CHUNK_SIZE bytes that start at the beginning of a line. The lines
+// of every chunk are counted in parallel, giving the row each chunk starts at,
+// then the chunks are parsed in parallel straight into the matrix.
 
-static inline double __read_csv_val(const char* tok) {
+// number of bytes of the file in each chunk that is parsed or written at once
+#define CSV_CHUNK_SIZE (1 << 20)
+
+// number of chunks written at a time by matrix_to_csv()
+#define CSV_WRITE_BATCH 16
+
+// longest a value can be written as (e.g. -2.2250738585072014e-308) plus a comma
+#define CSV_MAX_VAL_LEN 25
+
+// powers of ten that are exact doubles
+static const double __csv_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#if LDBL_MANT_DIG == 64
+// powers of ten that are exact long doubles
+static const long double __csv_pow10_ld[] = {
+    1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L,
+    1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L,
+};
+#endif
+
+static inline bool __csv_is_space(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+/**
+ * Parses a plain decimal number that fills [s, end) using only exact
+ * operations: when the digits fit in 53 bits and the power of ten is exact,
+ * a single multiply or divide is correctly rounded (Clinger's fast path).
+ * With 64-bit long doubles (x86) all 19 digits and powers up to 10^27 are
+ * exact, and the product is only rounded wrongly to a double when it is next
+ * to a halfway point, which is checked. Returns false for anything else so it
+ * can be parsed with strtod().
+ */
+static inline bool __csv_parse_fast(const char* s, const char* end, double* out) {
+    bool neg = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) { s++; }
+    uint64_t mantissa = 0;
+    int digits = 0, exp = 0;
+    bool any = false;
+    for (; s < end && *s >= '0' && *s <= '9'; s++, any = true) {
+        if (mantissa == 0 && *s == '0') { continue; }
+        if (++digits > 19) { return false; }
+        mantissa = mantissa*10 + (*s - '0');
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && *s >= '0' && *s <= '9'; s++, any = true) {
+            if (mantissa == 0 && *s == '0') { exp--; continue; }
+            if (++digits > 19) { return false; }
+            mantissa = mantissa*10 + (*s - '0');
+            exp--;
+        }
+    }
+    if (!any) { return false; }
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        bool exp_neg = ++s < end && *s == '-';
+        if (s < end && (*s == '-' || *s == '+')) { s++; }
+        if (s == end || *s < '0' || *s > '9') { return false; }
+        int e = 0;
+        for (; s < end && *s >= '0' && *s <= '9'; s++) { if (e < 10000) { e = e*10 + (*s - '0'); } }
+        exp += exp_neg ? -e : e;
+    }
+    if (s != end) { return false; }
+    double val;
+    if (mantissa == 0) { val = 0.0; }
+    else if (mantissa <= (1ULL << 53) && exp >= -22 && exp <= 22) {
+        val = exp < 0 ? (double)mantissa / __csv_pow10[-exp] : (double)mantissa * __csv_pow10[exp];
+    }
+#if LDBL_MANT_DIG == 64
+    else if (exp >= -27 && exp <= 27) {
+        long double x = exp < 0 ? (long double)mantissa / __csv_pow10_ld[-exp] : (long double)mantissa * __csv_pow10_ld[exp];
+        uint64_t significand;
+        memcpy(&significand, &x, sizeof(significand));
+        unsigned int low = significand & 0x7FF; // the bits dropped when rounding to a double
+        if (low >= 0x3FF && low <= 0x401) { return false; }
+        val = (double)x;
+    }
+#endif
+    else { return false; }
+    *out = neg ? -val : val;
+    return true;
+}
+
+/**
+ * Parses the value in [s, end), which has no surrounding whitespace, falling
+ * back to strtod() for anything the fast path does not handle.
+ */
+static inline double __read_csv_val(const char* s, const char* end) {
     double val;
-    int off;
-    if (sscanf(tok, " %lf %n", &val, &off) != 1 || off != strlen(tok)) {
+    if (__csv_parse_fast(s, end, &val)) { return val; }
+    char buf[128];
+    size_t len = end - s;
+    char* tok = len < sizeof(buf) ? buf : (char*)malloc(len + 1);
+    memcpy(tok, s, len);
+    tok[len] = 0;
+    char* stop;
+    val = strtod(tok, &stop);
+    if (stop != tok + len) {
         fprintf(stderr, "Not a number in CSV file, using 0.0: %s\n", tok);
-        return 0.0;
+        val = 0.0;
     }
+    if (tok != buf) { free(tok); }
     return val;
 }
 
-static inline size_t __read_csv_first_line(char* line, double** out) {
-    char* tok = strtok(line, ",\n");
-    size_t i = 0, size = 16;
-    double* vals = (double*)malloc(16*sizeof(double));
-    while (tok) {
-        vals[i] = __read_csv_val(tok);
-        if (++i == size) {
-            size += size > 512 ? 512 : size;
-            vals = (double*)realloc(vals, size*sizeof(double));
-        }
-        tok = strtok(NULL, ",");
+/**
+ * Finds the next non-empty value in the line [*s, end), setting *s to its
+ * start and returning its end, or returns NULL if there are no more values.
+ * Empty values (e.g. from ",,") are skipped.
+ */
+static inline const char* __csv_next_val(const char** s, const char* end) {
+    const char* p = *s;
+    while (true) {
+        while (p < end && (__csv_is_space(*p) || *p == ',')) { p++; }
+        if (p >= end) { *s = end; return NULL; }
+        const char* comma = (const char*)memchr(p, ',', end - p);
+        const char* val_end = comma ? comma : end;
+        const char* trimmed = val_end;
+        while (trimmed > p && __csv_is_space(trimmed[-1])) { trimmed--; }
+        if (trimmed > p) { *s = p; return trimmed; }
+        p = val_end;
     }
-    *out = vals;
-    return i;
 }
 
-static inline void __read_csv_line(char* line, double* out, size_t count) {
-    char* tok = strtok(line, ",\n");
+/**
+ * Counts the values in the line [s, end).
+ */
+static inline size_t __csv_count_vals(const char* s, const char* end) {
+    size_t count = 0;
+    for (const char* val_end; (val_end = __csv_next_val(&s, end)); s = val_end) { count++; }
+    return count;
+}
+
+/**
+ * Reads the line [s, end) into count values of out, ignoring extra values and
+ * filling missing ones with 0s.
+ */
+static inline void __read_csv_line(const char* s, const char* end, double* out, size_t count) {
     size_t i = 0;
-    while (tok) {
-        out[i] = __read_csv_val(tok);
-        if (++i == count) { return; } // stop reading
-        tok = strtok(NULL, ",");
+    for (const char* val_end; i < count && (val_end = __csv_next_val(&s, end)); s = val_end) {
+        out[i++] = __read_csv_val(s, val_end);
     }
     memset(out+i, 0, (count-i)*sizeof(double)); // zero-fill remainder
 }
 
+/**
+ * Returns the start of the line after the one containing s (or end).
+ */
+static inline const char* __csv_next_line(const char* s, const char* end) {
+    const char* nl = (const char*)memchr(s, '\n', end - s);
+    return nl ? nl + 1 : end;
+}
+
+/**
+ * Counts the lines in [s, end), which starts at the beginning of a line.
+ */
+static inline size_t __csv_count_lines(const char* s, const char* end) {
+    size_t count = 0;
+    for (; s < end; s = __csv_next_line(s, end)) { count++; }
+    return count;
+}
+
+/**
+ * Parses the CSV data in [buf, buf+len), returning the values (one row for
+ * each line) and setting the number of rows and columns. Returns NULL if
+ * there are no values in the first line.
+ */
+static inline double* __read_csv(const char* buf, size_t len, size_t* rows_out, size_t* cols_out) {
+    const char* end = buf + len;
+    const char* body = __csv_next_line(buf, end);
+    size_t cols = __csv_count_vals(buf, body);
+    if (cols == 0) { return NULL; }
+
+    // split the rest of the file into chunks of whole lines
+    size_t num_chunks = (end - body + CSV_CHUNK_SIZE - 1) / CSV_CHUNK_SIZE;
+    Arena* scratch = arena_create();
+    const char** starts = (const char**)arena_alloc(scratch, (num_chunks + 1) * sizeof(char*));
+    size_t* first_row = (size_t*)arena_alloc(scratch, (num_chunks + 1) * sizeof(size_t));
+    starts[0] = body;
+    for (size_t c = 1; c < num_chunks; c++) {
+        const char* s = body + c*CSV_CHUNK_SIZE;
+        starts[c] = s > starts[c-1] ? __csv_next_line(s - 1, end) : starts[c-1];
+    }
+    starts[num_chunks] = end;
+
+    // count the lines of each chunk to find the row each one starts at
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) if(num_chunks > 1)
+#endif
+    for (size_t c = 0; c < num_chunks; c++) { first_row[c+1] = __csv_count_lines(starts[c], starts[c+1]); }
+    first_row[0] = 1;
+    for (size_t c = 0; c < num_chunks; c++) { first_row[c+1] += first_row[c]; }
+    size_t rows = first_row[num_chunks];
+
+    // parse every chunk into its rows
+    double* data = (double*)malloc(rows*cols*sizeof(double));
+    __read_csv_line(buf, body, data, cols);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) if(num_chunks > 1)
+#endif
+    for (size_t c = 0; c < num_chunks; c++) {
+        double* out = &data[first_row[c]*cols];
+        for (const char* s = starts[c], *next; s < starts[c+1]; s = next, out += cols) {
+            next = __csv_next_line(s, starts[c+1]);
+            __read_csv_line(s, next, out, cols);
+        }
+    }
+    arena_free(scratch);
+    *rows_out = rows;
+    *cols_out = cols;
+    return data;
+}
+
+
+////////// CSV File Writing //////////
+
+/**
+ * Writes the digits of an integer value to buf, returning the length.
+ */
+static inline int __csv_format_int(char* buf, uint64_t val) {
+    char digits[20];
+    int len = 0;
+    do { digits[len++] = '0' + val % 10; val /= 10; } while (val);
+    for (int i = 0; i < len; i++) { buf[i] = digits[len-1-i]; }
+    return len;
+}
+
+// A value is written with the Grisu2 algorithm (F. Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers", 2010): the
+// value and the bounds of the interval that rounds to it are scaled by a
+// cached power of ten into 64-bit fixed point, and digits are generated until
+// the value is known to be within the interval. The result always reads back
+// as exactly the same double and is the shortest such one for nearly all.
+
+// a 64-bit significand and binary exponent, f * 2^e
+typedef struct { uint64_t f; int e; } __diy_fp;
+
+// the normalized powers 10^k for k = -348, -340, ..., 340
+static const __diy_fp __grisu_pow10[] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 }, { 0x8b16fb203055ac76ULL, -1166 },
+    { 0xcf42894a5dce35eaULL, -1140 }, { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+    { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 }, { 0xbe5691ef416bd60cULL, -1007 },
+    { 0x8dd01fad907ffc3cULL, -980 }, { 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+    { 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 }, { 0x823c12795db6ce57ULL, -847 },
+    { 0xc21094364dfb5637ULL, -821 }, { 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+    { 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 }, { 0xb23867fb2a35b28eULL, -688 },
+    { 0x84c8d4dfd2c63f3bULL, -661 }, { 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+    { 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 }, { 0xf3e2f893dec3f126ULL, -529 },
+    { 0xb5b5ada8aaff80b8ULL, -502 }, { 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+    { 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 }, { 0xa6dfbd9fb8e5b88fULL, -369 },
+    { 0xf8a95fcf88747d94ULL, -343 }, { 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+    { 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 }, { 0xe45c10c42a2b3b06ULL, -210 },
+    { 0xaa242499697392d3ULL, -183 }, { 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+    { 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 }, { 0x9c40000000000000ULL, -50 },
+    { 0xe8d4a51000000000ULL, -24 }, { 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+    { 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 }, { 0xd5d238a4abe98068ULL, 109 },
+    { 0x9f4f2726179a2245ULL, 136 }, { 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+    { 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 }, { 0x924d692ca61be758ULL, 269 },
+    { 0xda01ee641a708deaULL, 295 }, { 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+    { 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 }, { 0xc83553c5c8965d3dULL, 428 },
+    { 0x952ab45cfa97a0b3ULL, 455 }, { 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+    { 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 }, { 0x88fcf317f22241e2ULL, 588 },
+    { 0xcc20ce9bd35c78a5ULL, 614 }, { 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+    { 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 }, { 0xbb764c4ca7a44410ULL, 747 },
+    { 0x8bab8eefb6409c1aULL, 774 }, { 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+    { 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 }, { 0x80444b5e7aa7cf85ULL, 907 },
+    { 0xbf21e44003acdd2dULL, 933 }, { 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+    { 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 }, { 0xaf87023b9bf0ee6bULL, 1066 },
+};
+
+// powers of ten that fit in 64 bits
+static const uint64_t __grisu_pow10_int[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+static inline __diy_fp __diy_fp_multiply(__diy_fp a, __diy_fp b) {
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    __diy_fp r = { (uint64_t)(p >> 64) + (uint64_t)((p >> 63) & 1), a.e + b.e + 64 };
+    return r;
+}
+
+static inline __diy_fp __diy_fp_normalize(__diy_fp a) {
+    int shift = __builtin_clzll(a.f);
+    __diy_fp r = { a.f << shift, a.e - shift };
+    return r;
+}
+
+/**
+ * Moves the last digit of buf down while that brings it closer to the value
+ * and keeps it inside the interval (Grisu's round and weed step).
+ */
+static inline void __grisu_round(char* buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/**
+ * Writes the digits of the positive, finite value to buf and returns how many
+ * there are, setting *k so the value is the digits times 10^k.
+ */
+static inline int __grisu2(double val, char* buf, int* k) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    uint64_t significand = bits & ((1ULL << 52) - 1);
+    int biased_exp = (int)(bits >> 52);
+    __diy_fp v = biased_exp ? (__diy_fp){ significand | (1ULL << 52), biased_exp - 1075 } : (__diy_fp){ significand, -1074 };
+
+    // the bounds of the values that round to val, with the same exponent
+    __diy_fp plus = __diy_fp_normalize((__diy_fp){ (v.f << 1) + 1, v.e - 1 });
+    __diy_fp minus = v.f == (1ULL << 52) ? (__diy_fp){ (v.f << 2) - 1, v.e - 2 } : (__diy_fp){ (v.f << 1) - 1, v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    // scale by the cached power that puts the exponent in [-60, -32]
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int index = (int)dk;
+    if (dk - index > 0.0) { index++; }
+    index = (index >> 3) + 1;
+    *k = -(-348 + index * 8);
+    __diy_fp c = __grisu_pow10[index];
+    __diy_fp w = __diy_fp_multiply(__diy_fp_normalize(v), c);
+    __diy_fp wp = __diy_fp_multiply(plus, c), wm = __diy_fp_multiply(minus, c);
+    wm.f++; wp.f--;
+
+    // generate digits of the upper bound until it is within delta of it
+    uint64_t delta = wp.f - wm.f, wp_w = wp.f - w.f;
+    int shift = -wp.e;
+    uint64_t one = 1ULL << shift;
+    uint32_t p1 = (uint32_t)(wp.f >> shift);
+    uint64_t p2 = wp.f & (one - 1);
+    int kappa = 1, len = 0;
+    while (kappa < 10 && p1 >= __grisu_pow10_int[kappa]) { kappa++; }
+    while (kappa > 0) {
+        uint32_t div = (uint32_t)__grisu_pow10_int[kappa - 1];
+        uint32_t d = p1 / div;
+        p1 %= div;
+        if (d || len) { buf[len++] = '0' + d; }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            __grisu_round(buf, len, delta, rest, __grisu_pow10_int[kappa] << shift, wp_w);
+            return len;
+        }
+    }
+    while (true) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> shift);
+        if (d || len) { buf[len++] = '0' + d; }
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            __grisu_round(buf, len, delta, p2, one, -kappa < 20 ? wp_w * __grisu_pow10_int[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+/**
+ * Writes a value to buf so that it reads back as exactly the same double,
+ * using as few digits as possible, returning the length.
+ */
+static inline int __csv_format_val(char* buf, double val) {
+    // whole numbers are common (e.g. masses and ids) and need no rounding
+    if (val == trunc(val) && fabs(val) < 1e15) {
+        int sign = signbit(val) ? 1 : 0;
+        if (sign) { buf[0] = '-'; }
+        return sign + __csv_format_int(buf + sign, (uint64_t)fabs(val));
+    }
+    if (!isfinite(val)) { return snprintf(buf, CSV_MAX_VAL_LEN, "%g", val); }
+
+    char* out = buf;
+    if (val < 0) { *out++ = '-'; val = -val; }
+    char digits[20];
+    int k, len = __grisu2(val, digits, &k);
+    int point = len + k; // position of the decimal point in the digits
+    if (point > 0 && point <= 17) {
+        // 123.45 or 12300
+        if (k >= 0) {
+            memcpy(out, digits, len);
+            memset(out + len, '0', k);
+            out += point;
+        } else {
+            memcpy(out, digits, point);
+            out[point] = '.';
+            memcpy(out + point + 1, digits + point, len - point);
+            out += len + 1;
+        }
+    } else if (point > -4 && point <= 0) {
+        // 0.00123
+        *out++ = '0'; *out++ = '.';
+        memset(out, '0', -point);
+        memcpy(out - point, digits, len);
+        out += len - point;
+    } else {
+        // 1.2345e-67
+        *out++ = digits[0];
+        if (len > 1) {
+            *out++ = '.';
+            memcpy(out, digits + 1, len - 1);
+            out += len - 1;
+        }
+        *out++ = 'e';
+        int exp = point - 1;
+        if (exp < 0) { *out++ = '-'; exp = -exp; }
+        out += __csv_format_int(out, exp);
+    }
+    return out - buf;
+}
+
+/**
+ * Writes count rows of cols values from data to buf, returning the length.
+ * The buffer must have room for CSV_MAX_VAL_LEN characters per value.
+ */
+static inline size_t __write_csv_rows(char* buf, const double* data, size_t count, size_t cols) {
+    char* out = buf;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < cols; j++) {
+            out += __csv_format_val(out, *data++);
+            *out++ = ',';
+        }
+        out[-1] = '\n';
+    }
+    return out - buf;
+}
+
 
 ////////// NPY File Reading //////////
 
@@ -55,7 +456,7 @@ static inline const char* __py_dict_value(const char* dict, const char* key) {
     return s;
 }
 
-static inline char* __py_dict_value_str(const char* dict, const char* key) {
+static inline char* __py_dict_value_str(Arena* arena, const char* dict, const char* key) {
     const char* s = __py_dict_value(dict, key);
     if (!s) { return NULL; }
     char c = *s;
@@ -63,8 +464,8 @@ static inline char* __py_dict_value_str(const char* dict, const char* key) {
     const char* end = ++s;
     while (*end != c) { end++; }
     size_t len = end - s;
-    char* data = malloc(len+1);
-    strncpy(data, s, len);
+    char* data = (char*)arena_alloc(arena, len+1);
+    memcpy(data, s, len);
     data[len] = 0;
     return data;
 }
@@ -91,49 +492,190 @@ static inline bool __py_dict_value_tuple(const char* dict,
         (sscanf(s, " %zu , %zu , %c", &val[0], &val[1], &c) == 3 && c == ')'));
 }
 
-static inline bool __npy_read_header(FILE* file, size_t* sh, size_t* offset) {
-    unsigned char header[10];
-    if (fread(header, 1, 10, file) != 10) { return false; }
+// how the data of a NPY file is stored
+typedef struct {
+    size_t elem_size; // 8 for doubles or 4 for floats
+    bool swap;        // the bytes are in the opposite order of this machine
+    bool fortran;     // stored by column instead of by row
+} __npy_format;
+
+// true if the data can be used directly as the data of a matrix
+#define NPY_IS_NATIVE(format) ((format).elem_size == 8 && !(format).swap && !(format).fortran)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define NPY_NATIVE_ORDER '<'
+#else
+#define NPY_NATIVE_ORDER '>'
+#endif
+
+/**
+ * Parses a descr of a little or big-endian 32 or 64-bit float (e.g. '<f8',
+ * '>f4', or 'float64').
+ */
+static inline bool __npy_parse_descr(const char* descr, __npy_format* format) {
+    if (strcmp(descr, "float64") == 0) { descr = "f8"; }
+    else if (strcmp(descr, "float32") == 0) { descr = "f4"; }
+    char order = NPY_NATIVE_ORDER;
+    if (*descr == '<' || *descr == '>' || *descr == '=') { order = *descr++; }
+    if (order == '=') { order = NPY_NATIVE_ORDER; }
+    if (strcmp(descr, "f8") == 0) { format->elem_size = 8; }
+    else if (strcmp(descr, "f4") == 0) { format->elem_size = 4; }
+    else { return false; }
+    format->swap = order != NPY_NATIVE_ORDER;
+    return true;
+}
+
+static inline bool __npy_read_header(FILE* file, size_t* sh, size_t* offset, __npy_format* format) {
+    // version 1 has a 2 byte header length, versions 2 and 3 have 4 bytes (and
+    // version 3 allows utf-8 in the header, which makes no difference here)
+    unsigned char header[12];
+    if (fread(header, 1, 8, file) != 8) { return false; }
     if (memcmp(header, "\x93NUMPY", 6) != 0) { errno = EINVAL; return false; }
-    // header[6] is major file version
-    // header[7] is minor file version
-    int len = *(unsigned short*)(header+8); // assumes running on little-endian
-    *offset = sizeof(header) + len;
-    char* dict = (char*)malloc(len+1);
-    if (fread(dict, 1, len, file) != len || dict[0] != '{') {
-        free(dict);
-        errno = EINVAL;
-        return false;
+    int major = header[6];
+    size_t len_size = major == 1 ? 2 : 4;
+    if (major < 1 || major > 3 || fread(header+8, 1, len_size, file) != len_size) { errno = EINVAL; return false; }
+    size_t len = header[8] | (header[9] << 8);
+    if (len_size == 4) { len |= ((size_t)header[10] << 16) | ((size_t)header[11] << 24); }
+    *offset = 8 + len_size + len;
+    Arena* scratch = arena_create();
+    char* dict = (char*)arena_alloc(scratch, len+1);
+    bool ok = dict && fread(dict, 1, len, file) == len && dict[0] == '{';
+    if (ok) {
+        dict[len] = 0;
+
+        // only allowed descr are 32 and 64-bit floats of either byte order
+        char* descr = __py_dict_value_str(scratch, dict, "descr");
+        ok = descr && __npy_parse_descr(descr, format) &&
+            // either order is allowed
+            __py_dict_value_bool(dict, "fortran_order", &format->fortran) &&
+            // only allowed to be 0d, 1d, or 2d, but this is checked elsewhere
+            __py_dict_value_tuple(dict, "shape", sh) && sh[0] >= 1 && sh[1] >= 1;
     }
-    dict[len] = 0;
+    arena_free(scratch);
+    if (!ok) { errno = EINVAL; return false; }
 
-    // only allowed descr: 'float64', 'f8', or '<f8'
-    char* descr = __py_dict_value_str(dict, "descr");
-    if (!descr) { free(dict); errno = EINVAL; return false; }
-    if (strcmp(descr, "float64") != 0 && strcmp(descr, "f8") != 0 &&
-        strcmp(descr, "<f8") != 0) {
+    // the file must have all of the data
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) &&
+        (size_t)st.st_size < *offset + sh[0]*sh[1]*format->elem_size) {
         errno = EINVAL;
-        free(descr);
-        free(dict);
         return false;
     }
-    free(descr);
+    return true;
+}
 
-    // only allowed fortran_order is false
-    bool fortran_order = false;
-    if (!__py_dict_value_bool(dict, "fortran_order", &fortran_order) &&
-        fortran_order) {
-        errno = EINVAL;
-        free(dict);
-        return false;
+
+////////// NPY Conversion //////////
+// Data that is not already native doubles stored by row is converted to them
+// in a single pass while copying it out of the file. Data stored by column is
+// transposed in square blocks so both the reads and writes stay in the cache.
+
+// number of rows and columns of each block of the transpose
+#define NPY_TRANSPOSE_BLOCK 32
+
+// number of rows converted at a time by each thread
+#define NPY_CONVERT_ROWS 64
+
+__attribute__((always_inline))
+static inline double __npy_value(const char* src, size_t elem_size, bool swap) {
+    if (elem_size == 4) {
+        uint32_t bits;
+        memcpy(&bits, src, sizeof(bits));
+        if (swap) { bits = __builtin_bswap32(bits); }
+        float val;
+        memcpy(&val, &bits, sizeof(val));
+        return val;
     }
+    uint64_t bits;
+    memcpy(&bits, src, sizeof(bits));
+    if (swap) { bits = __builtin_bswap64(bits); }
+    double val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
 
-    // only allowed to be 0d, 1d, or 2d, but this is checked elsewhere
-    if (!__py_dict_value_tuple(dict, "shape", sh) || sh[0] < 1 || sh[1] < 1) {
-        errno = EINVAL;
-        free(dict);
-        return false;
+/**
+ * Converts rows [first, last) of the rows-by-cols data at src to dst. This is
+ * always inlined with a constant format so every loop can be vectorized.
+ */
+__attribute__((always_inline))
+static inline void __npy_convert_rows(const char* src, double* dst, size_t rows, size_t cols,
+        size_t first, size_t last, size_t elem_size, bool swap, bool fortran) {
+    if (!fortran) {
+        src += first*cols*elem_size;
+        dst += first*cols;
+        for (size_t i = 0; i < (last-first)*cols; i++) { dst[i] = __npy_value(src + i*elem_size, elem_size, swap); }
+        return;
     }
-    free(dict);
+    for (size_t ib = first; ib < last; ib += NPY_TRANSPOSE_BLOCK) {
+        size_t i_end = last - ib < NPY_TRANSPOSE_BLOCK ? last : ib + NPY_TRANSPOSE_BLOCK;
+        for (size_t jb = 0; jb < cols; jb += NPY_TRANSPOSE_BLOCK) {
+            size_t j_end = cols - jb < NPY_TRANSPOSE_BLOCK ? cols : jb + NPY_TRANSPOSE_BLOCK;
+            for (size_t i = ib; i < i_end; i++) {
+                for (size_t j = jb; j < j_end; j++) {
+                    dst[i*cols + j] = __npy_value(src + (j*rows + i)*elem_size, elem_size, swap);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Converts the rows-by-cols data at src, stored as given by format, to
+ * native doubles stored by row in dst.
+ */
+static inline void __npy_convert(const char* src, double* dst, size_t rows, size_t cols, __npy_format format) {
+    size_t num_chunks = (rows + NPY_CONVERT_ROWS - 1) / NPY_CONVERT_ROWS;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if(rows*cols >= PARALLEL_MIN_SIZE)
+#endif
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t first = c*NPY_CONVERT_ROWS, last = rows - first < NPY_CONVERT_ROWS ? rows : first + NPY_CONVERT_ROWS;
+        #define __NPY_CONVERT(elem_size, swap) \
+            if (format.fortran) { __npy_convert_rows(src, dst, rows, cols, first, last, elem_size, swap, true); } \
+            else { __npy_convert_rows(src, dst, rows, cols, first, last, elem_size, swap, false); }
+        if (format.elem_size == 4) {
+            if (format.swap) { __NPY_CONVERT(4, true) } else { __NPY_CONVERT(4, false) }
+        } else {
+            if (format.swap) { __NPY_CONVERT(8, true) } else { __NPY_CONVERT(8, false) }
+        }
+        #undef __NPY_CONVERT
+    }
+}
+
+/**
+ * Creates a new matrix from the data of a NPY file that is not stored as
+ * native doubles by row, converting it while reading it from a mapping of the
+ * file. Returns NULL if the file cannot be mapped.
+ */
+static inline Matrix* __npy_load_converted(FILE* file, const size_t* sh, size_t offset, __npy_format format) {
+    size_t length = offset + sh[0]*sh[1]*format.elem_size;
+    void* x = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (x == MAP_FAILED) { return NULL; }
+    madvise(x, length, format.fortran ? MADV_WILLNEED : MADV_SEQUENTIAL);
+    Matrix* M = matrix_create_raw(sh[0], sh[1]);
+    __npy_convert((const char*)x + offset, M->data, sh[0], sh[1], format);
+    munmap(x, length);
+    return M;
+}
+
+
+////////// NPY File Writing //////////
+// Files are always written as version 1.0, native doubles stored by row: the
+// header of a 2-D array always fits in the 64-byte aligned 128 bytes, so the
+// larger header length of version 2.0 is never needed.
+
+#define NPY_HEADER_SIZE 128
+
+static inline bool __npy_write_header(char* header, size_t rows, size_t cols) {
+    int len = snprintf(header, NPY_HEADER_SIZE, "\x93NUMPY\x01   "
+        "{'descr': '%cf8', 'fortran_order': False, 'shape': (%zu, %zu), }",
+        NPY_NATIVE_ORDER, rows, cols);
+    if (len < 0 || len >= NPY_HEADER_SIZE) { return false; }
+    header[7] = 0; // have to after the string is written
+    header[8] = (NPY_HEADER_SIZE - 10) & 0xFF; // little-endian header length
+    header[9] = (NPY_HEADER_SIZE - 10) >> 8;
+    memset(header + len, ' ', NPY_HEADER_SIZE-len-1);
+    header[NPY_HEADER_SIZE-1] = '\n';
     return true;
 }
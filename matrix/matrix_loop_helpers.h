@@ -0,0 +1,266 @@
+////////// Element-wise Loops //////////
+// The *_apply(), *_map(), and reduce functions check if they were given one of
+// the built-in functions (or a common one from math.h) and then run a loop with
+// the operation inlined so it can be vectorized. Any other function is still
+// called through the pointer. Large matrices are split between threads when
+// compiled with OpenMP.
+
+// number of elements below which the loops are run on a single thread
+#define PARALLEL_MIN_SIZE 32768
+
+// number of elements given to a thread at a time by the element-wise loops
+#define ELEMENTWISE_CHUNK_SIZE 4096
+
+// number of elements in each chunk of a reduction, the chunks do not depend on
+// the number of threads so neither does the result
+#define REDUCE_CHUNK_SIZE 4096
+
+// number of independent accumulators used within each chunk of a reduction
+#define REDUCE_LANES 8
+
+// number of columns of each block in matrix_reduce_cols()
+#define REDUCE_COLS_BLOCK 512
+
+// this goes before a loop that covers size elements of a matrix
+#ifdef _OPENMP
+#define __PRAGMA(x) _Pragma(#x)
+#define __PARALLEL_FOR(size) __PRAGMA(omp parallel for schedule(static) if((size) >= PARALLEL_MIN_SIZE))
+#else
+#define __PARALLEL_FOR(size)
+#endif
+
+// the operations that are inlined, OP_CALL calls the function pointer
+enum { OP_CALL, OP_NEGATIVE, OP_POSITIVE, OP_RECIPROCAL, OP_FABS, OP_SQRT, OP_FLOOR, OP_CEIL, OP_TRUNC };
+enum { OP_ADD = OP_TRUNC + 1, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_FMIN, OP_FMAX };
+
+static inline int __unary_op(unary_func func) {
+    if (func == matrix_negative || func == negative) { return OP_NEGATIVE; }
+    if (func == matrix_positive || func == positive) { return OP_POSITIVE; }
+    if (func == matrix_reciprocal || func == reciprocal) { return OP_RECIPROCAL; }
+    if (func == fabs) { return OP_FABS; }
+    if (func == sqrt) { return OP_SQRT; }
+    if (func == floor) { return OP_FLOOR; }
+    if (func == ceil) { return OP_CEIL; }
+    if (func == trunc) { return OP_TRUNC; }
+    return OP_CALL;
+}
+
+static inline int __binary_op(binary_func func) {
+    if (func == matrix_add || func == add) { return OP_ADD; }
+    if (func == matrix_subtract || func == subtract) { return OP_SUBTRACT; }
+    if (func == matrix_multiply || func == multiply) { return OP_MULTIPLY; }
+    if (func == matrix_divide || func == divide) { return OP_DIVIDE; }
+    if (func == fmin) { return OP_FMIN; }
+    if (func == fmax) { return OP_FMAX; }
+    return OP_CALL;
+}
+
+// these run stmt with the constant op for func so the operation is inlined
+#define __WITH_UNARY_OP(func, stmt) switch (__unary_op(func)) { \
+    case OP_NEGATIVE: { const int op = OP_NEGATIVE; stmt; break; } \
+    case OP_POSITIVE: { const int op = OP_POSITIVE; stmt; break; } \
+    case OP_RECIPROCAL: { const int op = OP_RECIPROCAL; stmt; break; } \
+    case OP_FABS: { const int op = OP_FABS; stmt; break; } \
+    case OP_SQRT: { const int op = OP_SQRT; stmt; break; } \
+    case OP_FLOOR: { const int op = OP_FLOOR; stmt; break; } \
+    case OP_CEIL: { const int op = OP_CEIL; stmt; break; } \
+    case OP_TRUNC: { const int op = OP_TRUNC; stmt; break; } \
+    default: { const int op = OP_CALL; stmt; break; } \
+}
+#define __WITH_BINARY_OP(func, stmt) switch (__binary_op(func)) { \
+    case OP_ADD: { const int op = OP_ADD; stmt; break; } \
+    case OP_SUBTRACT: { const int op = OP_SUBTRACT; stmt; break; } \
+    case OP_MULTIPLY: { const int op = OP_MULTIPLY; stmt; break; } \
+    case OP_DIVIDE: { const int op = OP_DIVIDE; stmt; break; } \
+    case OP_FMIN: { const int op = OP_FMIN; stmt; break; } \
+    case OP_FMAX: { const int op = OP_FMAX; stmt; break; } \
+    default: { const int op = OP_CALL; stmt; break; } \
+}
+
+// reductions of these are split into chunks, the others are folded in order
+static inline bool __is_associative(int op) {
+    return op == OP_ADD || op == OP_MULTIPLY || op == OP_FMIN || op == OP_FMAX;
+}
+
+__attribute__((always_inline)) static inline double __unary(const int op, unary_func func, double a) {
+    switch (op) {
+    case OP_NEGATIVE: return -a;
+    case OP_POSITIVE: return +a;
+    case OP_RECIPROCAL: return 1 / a;
+    case OP_FABS: return fabs(a);
+    case OP_SQRT: return sqrt(a);
+    case OP_FLOOR: return floor(a);
+    case OP_CEIL: return ceil(a);
+    case OP_TRUNC: return trunc(a);
+    default: return func(a);
+    }
+}
+
+__attribute__((always_inline)) static inline double __binary(const int op, binary_func func, double a, double b) {
+    switch (op) {
+    case OP_ADD: return a + b;
+    case OP_SUBTRACT: return a - b;
+    case OP_MULTIPLY: return a * b;
+    case OP_DIVIDE: return a / b;
+    case OP_FMIN: return (a < b || b != b) ? a : b; // same as fmin() but can be vectorized
+    case OP_FMAX: return (a > b || b != b) ? a : b; // same as fmax() but can be vectorized
+    default: return func(a, b);
+    }
+}
+
+// The parallel loops below are over chunks of elements and choose the
+// operation inside each chunk since OpenMP moves the body of a parallel loop to
+// a separate function before anything is inlined, so an operation chosen
+// outside of it would not be a constant in the loop over the elements.
+
+__attribute__((always_inline)) static inline void __unary_range(const int op, unary_func func,
+        double* out, const double* in, size_t count) {
+    for (size_t i = 0; i < count; i++) { out[i] = __unary(op, func, in[i]); }
+}
+
+// a_scalar and b_scalar are true when a or b point to a single value used for
+// every element instead of an array
+__attribute__((always_inline)) static inline void __binary_range(const int op, binary_func func, double* out,
+        const double* a, const bool a_scalar, const double* b, const bool b_scalar, size_t count) {
+    double a0 = *a, b0 = *b;
+    for (size_t i = 0; i < count; i++) { out[i] = __binary(op, func, a_scalar ? a0 : a[i], b_scalar ? b0 : b[i]); }
+}
+
+/**
+ * Sets out[i] = func(in[i]) for every element.
+ */
+static void __unary_all(unary_func func, double* out, const double* in, size_t size) {
+    size_t num_chunks = (size + ELEMENTWISE_CHUNK_SIZE - 1) / ELEMENTWISE_CHUNK_SIZE;
+    __PARALLEL_FOR(size)
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t first = c * ELEMENTWISE_CHUNK_SIZE;
+        size_t count = size - first < ELEMENTWISE_CHUNK_SIZE ? size - first : ELEMENTWISE_CHUNK_SIZE;
+        __WITH_UNARY_OP(func, __unary_range(op, func, out + first, in + first, count));
+    }
+}
+
+/**
+ * Sets out[i] = func(a[i], b[i]) for every element.
+ */
+static void __binary_all(binary_func func, double* out, const double* a, const double* b, size_t size) {
+    size_t num_chunks = (size + ELEMENTWISE_CHUNK_SIZE - 1) / ELEMENTWISE_CHUNK_SIZE;
+    __PARALLEL_FOR(size)
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t first = c * ELEMENTWISE_CHUNK_SIZE;
+        size_t count = size - first < ELEMENTWISE_CHUNK_SIZE ? size - first : ELEMENTWISE_CHUNK_SIZE;
+        __WITH_BINARY_OP(func, __binary_range(op, func, out + first, a + first, false, b + first, false, count));
+    }
+}
+
+/**
+ * Sets out[i] = func(a[i], b) for every element.
+ */
+static void __binary_scalar_all(binary_func func, double* out, const double* a, double b, size_t size) {
+    size_t num_chunks = (size + ELEMENTWISE_CHUNK_SIZE - 1) / ELEMENTWISE_CHUNK_SIZE;
+    __PARALLEL_FOR(size)
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t first = c * ELEMENTWISE_CHUNK_SIZE;
+        size_t count = size - first < ELEMENTWISE_CHUNK_SIZE ? size - first : ELEMENTWISE_CHUNK_SIZE;
+        __WITH_BINARY_OP(func, __binary_range(op, func, out + first, a + first, false, &b, true, count));
+    }
+}
+
+/**
+ * Sets out[i] = func(a, b[i]) for every element.
+ */
+static void __scalar_binary_all(binary_func func, double* out, double a, const double* b, size_t size) {
+    size_t num_chunks = (size + ELEMENTWISE_CHUNK_SIZE - 1) / ELEMENTWISE_CHUNK_SIZE;
+    __PARALLEL_FOR(size)
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t first = c * ELEMENTWISE_CHUNK_SIZE;
+        size_t count = size - first < ELEMENTWISE_CHUNK_SIZE ? size - first : ELEMENTWISE_CHUNK_SIZE;
+        __WITH_BINARY_OP(func, __binary_range(op, func, out + first, &a, true, b + first, false, count));
+    }
+}
+
+/**
+ * Folds count values in order: val = func(in[i], val).
+ */
+__attribute__((always_inline)) static inline double __reduce_ordered(const int op, binary_func func,
+        const double* in, size_t count) {
+    double val = in[0];
+    for (size_t i = 1; i < count; i++) { val = __binary(op, func, in[i], val); }
+    return val;
+}
+
+/**
+ * Folds count values with REDUCE_LANES independent accumulators (so it can be
+ * vectorized) that are combined in a fixed order at the end if the operation
+ * is associative, otherwise folds them in order.
+ */
+__attribute__((always_inline)) static inline double __reduce_lanes(const int op, binary_func func,
+        const double* in, size_t count) {
+    if (!__is_associative(op) || count < 2*REDUCE_LANES) { return __reduce_ordered(op, func, in, count); }
+    double lanes[REDUCE_LANES];
+    memcpy(lanes, in, sizeof(lanes));
+    size_t i = REDUCE_LANES;
+    for (; i + REDUCE_LANES <= count; i += REDUCE_LANES) {
+        for (size_t k = 0; k < REDUCE_LANES; k++) { lanes[k] = __binary(op, func, in[i+k], lanes[k]); }
+    }
+    double val = lanes[0];
+    for (size_t k = 1; k < REDUCE_LANES; k++) { val = __binary(op, func, lanes[k], val); }
+    for (; i < count; i++) { val = __binary(op, func, in[i], val); }
+    return val;
+}
+
+/**
+ * Reduces size values. Associative operations are reduced in fixed chunks of
+ * REDUCE_CHUNK_SIZE (in parallel) and then the results of the chunks in order,
+ * others are folded in order.
+ */
+static double __reduce_all(binary_func func, const double* in, size_t size) {
+    double val;
+    size_t num_chunks = (size + REDUCE_CHUNK_SIZE - 1) / REDUCE_CHUNK_SIZE;
+    if (num_chunks <= 1 || !__is_associative(__binary_op(func))) {
+        __WITH_BINARY_OP(func, val = __reduce_lanes(op, func, in, size));
+        return val;
+    }
+    double* partial = (double*)malloc(num_chunks * sizeof(double));
+    __PARALLEL_FOR(size)
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t first = c * REDUCE_CHUNK_SIZE;
+        size_t count = size - first < REDUCE_CHUNK_SIZE ? size - first : REDUCE_CHUNK_SIZE;
+        __WITH_BINARY_OP(func, partial[c] = __reduce_lanes(op, func, in + first, count));
+    }
+    __WITH_BINARY_OP(func, val = __reduce_ordered(op, func, partial, num_chunks));
+    free(partial);
+    return val;
+}
+
+/**
+ * Reduces each row of A into out (in parallel over the rows).
+ */
+static void __reduce_rows_all(binary_func func, const Matrix* A, double* out) {
+    __PARALLEL_FOR(A->size)
+    for (size_t i = 0; i < A->rows; i++) {
+        __WITH_BINARY_OP(func, out[i] = __reduce_lanes(op, func, &MATRIX_AT(A, i, 0), A->cols));
+    }
+}
+
+__attribute__((always_inline)) static inline void __reduce_cols_range(const int op, binary_func func,
+        const Matrix* A, double* out, size_t first, size_t last) {
+    memcpy(out + first, A->data + first, (last - first) * sizeof(double));
+    for (size_t i = 1; i < A->rows; i++) {
+        const double* row = &MATRIX_AT(A, i, 0);
+        for (size_t j = first; j < last; j++) { out[j] = __binary(op, func, row[j], out[j]); }
+    }
+}
+
+/**
+ * Reduces each column of A into out, going down the rows in order for blocks
+ * of REDUCE_COLS_BLOCK columns at a time (in parallel over the blocks).
+ */
+static void __reduce_cols_all(binary_func func, const Matrix* A, double* out) {
+    size_t cols = A->cols, num_blocks = (cols + REDUCE_COLS_BLOCK - 1) / REDUCE_COLS_BLOCK;
+    __PARALLEL_FOR(A->size)
+    for (size_t b = 0; b < num_blocks; b++) {
+        size_t first = b * REDUCE_COLS_BLOCK;
+        size_t last = cols - first < REDUCE_COLS_BLOCK ? cols : first + REDUCE_COLS_BLOCK;
+        __WITH_BINARY_OP(func, __reduce_cols_range(op, func, A, out, first, last));
+    }
+}
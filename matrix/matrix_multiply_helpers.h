@@ -0,0 +1,189 @@
+////////// Matrix Multiplication //////////
+// C = A*B is computed in tiles so the parts of A and B being used stay in the
+// caches (the usual GotoBLAS/BLIS loop order):
+//   - for each panel of NC columns of B
+//     - for each block of KC rows of that panel, packed so each NR columns are
+//       contiguous
+//       - for each block of MC rows of A (in parallel), packed so each MR rows
+//         are contiguous
+//         - for each MR-by-NR tile of C, a micro-kernel keeps the tile in
+//           registers while going down the KC values of k
+// The packed blocks are padded with zeros so the micro-kernel always works on
+// a full tile, only the part of a tile inside C is written.
+
+// size of the tile of C kept in registers by the micro-kernel, GEMM_NR columns
+// are GEMM_NR/GEMM_VEC vectors (AVX-512 has 32 512-bit registers, AVX has 16
+// 256-bit registers, and SSE2 has 16 128-bit registers)
+#if defined(__AVX512F__)
+#define GEMM_VEC 8
+#define GEMM_MR 8
+#define GEMM_NR 16
+#elif defined(__AVX__)
+#define GEMM_VEC 4
+#define GEMM_MR 4
+#define GEMM_NR 8
+#else
+#define GEMM_VEC 2
+#define GEMM_MR 4
+#define GEMM_NR 4
+#endif
+
+// sizes of the blocks: a MR-by-KC sliver of A and KC-by-NR sliver of B should
+// fit in L1, a MC-by-KC block of A in L2, and a KC-by-NC panel of B in L3
+#define GEMM_KC 384
+#define GEMM_MC 96
+#define GEMM_NC 2048
+
+// matrices with fewer than this many multiply-adds use a simple loop instead
+#define GEMM_MIN_WORK (64*64*64)
+
+// alignment (in bytes) of the packed blocks, aligned_alloc() also needs their
+// sizes to be a multiple of it
+#define GEMM_ALIGN 64
+#define GEMM_ALIGN_SIZE(bytes) (((bytes) + GEMM_ALIGN - 1) / GEMM_ALIGN * GEMM_ALIGN)
+
+/**
+ * Packs the mc-by-kc block of A at a (with row stride lda) into slivers of
+ * GEMM_MR rows where the GEMM_MR values for each k are contiguous.
+ */
+static inline void __gemm_pack_a(const double* a, size_t lda, size_t mc, size_t kc, double* packed) {
+    for (size_t i = 0; i < mc; i += GEMM_MR) {
+        size_t rows = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+        for (size_t k = 0; k < kc; k++) {
+            for (size_t r = 0; r < GEMM_MR; r++) { packed[r] = r < rows ? a[(i+r)*lda + k] : 0; }
+            packed += GEMM_MR;
+        }
+    }
+}
+
+/**
+ * Packs the kc-by-nc block of B at b (with row stride ldb) into slivers of
+ * GEMM_NR columns where the GEMM_NR values for each k are contiguous.
+ */
+static inline void __gemm_pack_b(const double* b, size_t ldb, size_t kc, size_t nc, double* packed) {
+    for (size_t j = 0; j < nc; j += GEMM_NR) {
+        size_t cols = nc - j < GEMM_NR ? nc - j : GEMM_NR;
+        double* sliver = packed + j*kc;
+        for (size_t k = 0; k < kc; k++) {
+            const double* row = b + k*ldb + j;
+            for (size_t c = 0; c < GEMM_NR; c++) { sliver[c] = c < cols ? row[c] : 0; }
+            sliver += GEMM_NR;
+        }
+    }
+}
+
+// a vector of GEMM_VEC doubles (using GCC vector extensions)
+typedef double gemm_vec __attribute__((vector_size(GEMM_VEC * sizeof(double))));
+
+/**
+ * Computes a GEMM_MR-by-GEMM_NR tile of A*B from packed slivers of A and B and
+ * either stores it in or adds it to the tile of C at c (with row stride ldc),
+ * only the first rows and cols of the tile are written.
+ */
+static inline void __gemm_micro_kernel(size_t kc, const double* restrict a, const double* restrict b,
+        double* c, size_t ldc, size_t rows, size_t cols, bool accumulate) {
+    gemm_vec tile[GEMM_MR][GEMM_NR / GEMM_VEC];
+    for (size_t i = 0; i < GEMM_MR; i++) {
+        for (size_t v = 0; v < GEMM_NR / GEMM_VEC; v++) { tile[i][v] = (gemm_vec){ 0 }; }
+    }
+    for (size_t k = 0; k < kc; k++, a += GEMM_MR, b += GEMM_NR) {
+        gemm_vec bk[GEMM_NR / GEMM_VEC];
+        for (size_t v = 0; v < GEMM_NR / GEMM_VEC; v++) { memcpy(&bk[v], b + v*GEMM_VEC, sizeof(gemm_vec)); }
+        for (size_t i = 0; i < GEMM_MR; i++) {
+            for (size_t v = 0; v < GEMM_NR / GEMM_VEC; v++) { tile[i][v] += a[i] * bk[v]; }
+        }
+    }
+    double out[GEMM_MR][GEMM_NR];
+    memcpy(out, tile, sizeof(out));
+    for (size_t i = 0; i < rows; i++) {
+        double* row = c + i*ldc;
+        if (accumulate) { for (size_t j = 0; j < cols; j++) { row[j] += out[i][j]; } }
+        else { for (size_t j = 0; j < cols; j++) { row[j] = out[i][j]; } }
+    }
+}
+
+/**
+ * Computes the mc-by-nc block of C at c from packed blocks of A and B.
+ */
+static inline void __gemm_macro_kernel(size_t mc, size_t nc, size_t kc, const double* a, const double* b,
+        double* c, size_t ldc, bool accumulate) {
+    for (size_t j = 0; j < nc; j += GEMM_NR) {
+        size_t cols = nc - j < GEMM_NR ? nc - j : GEMM_NR;
+        for (size_t i = 0; i < mc; i += GEMM_MR) {
+            size_t rows = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+            __gemm_micro_kernel(kc, a + i*kc, b + j*kc, c + i*ldc + j, ldc, rows, cols, accumulate);
+        }
+    }
+}
+
+/**
+ * Computes C = A*B where A is m-by-n and B is n-by-p, all stored by row.
+ * Returns false if the packed blocks cannot be allocated (C is then left
+ * incomplete).
+ */
+static bool __gemm(size_t m, size_t n, size_t p, const double* A, const double* B, double* C) {
+    if (m*n*p < GEMM_MIN_WORK || n == 0) {
+        // small matrices go straight through an i-k-j loop that reads B by row
+        memset(C, 0, m*p*sizeof(double));
+        for (size_t i = 0; i < m; i++) {
+            for (size_t k = 0; k < n; k++) {
+                double a = A[i*n + k];
+                for (size_t j = 0; j < p; j++) { C[i*p + j] += a * B[k*p + j]; }
+            }
+        }
+        return true;
+    }
+
+    // the packed blocks are rounded up to whole slivers
+    size_t nc_max = ((p < GEMM_NC ? p : GEMM_NC) + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+    size_t mc_max = (GEMM_MC + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+    double* packed_b = (double*)aligned_alloc(GEMM_ALIGN, GEMM_ALIGN_SIZE(GEMM_KC * nc_max * sizeof(double)));
+    if (!packed_b) { return false; }
+    size_t num_blocks = (m + GEMM_MC - 1) / GEMM_MC;
+    bool ok = true;
+
+#ifdef _OPENMP
+    #pragma omp parallel if(m*n*p >= 8*GEMM_MIN_WORK) shared(ok)
+#endif
+    {
+        // every thread has to skip the loops if any of them has no packed_a,
+        // since they meet at the barriers of the loops
+        double* packed_a = (double*)aligned_alloc(GEMM_ALIGN, GEMM_ALIGN_SIZE(mc_max * GEMM_KC * sizeof(double)));
+        if (!packed_a) {
+#ifdef _OPENMP
+            #pragma omp atomic write
+#endif
+            ok = false;
+        }
+#ifdef _OPENMP
+        #pragma omp barrier
+#endif
+        for (size_t jc = 0; ok && jc < p; jc += GEMM_NC) {
+            size_t nc = p - jc < GEMM_NC ? p - jc : GEMM_NC;
+            for (size_t pc = 0; pc < n; pc += GEMM_KC) {
+                size_t kc = n - pc < GEMM_KC ? n - pc : GEMM_KC;
+
+                // every thread packs some of the slivers of the panel of B
+#ifdef _OPENMP
+                #pragma omp for schedule(static)
+#endif
+                for (size_t j = 0; j < nc; j += GEMM_NR) {
+                    __gemm_pack_b(B + pc*p + jc + j, p, kc, nc - j < GEMM_NR ? nc - j : GEMM_NR, packed_b + j*kc);
+                }
+
+                // then the blocks of rows of C are shared between the threads
+#ifdef _OPENMP
+                #pragma omp for schedule(dynamic, 1)
+#endif
+                for (size_t block = 0; block < num_blocks; block++) {
+                    size_t ic = block * GEMM_MC, mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+                    __gemm_pack_a(A + ic*n + pc, n, mc, kc, packed_a);
+                    __gemm_macro_kernel(mc, nc, kc, packed_a, packed_b, C + ic*p + jc, p, pc > 0);
+                }
+            }
+        }
+        free(packed_a);
+    }
+    free(packed_b);
+    return ok;
+}
@@ -0,0 +1,240 @@
+/**
+ * Compressed trajectory files (see trajectory.h for the format).
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <zlib.h>
+
+#include "matrix.h"
+#include "trajectory.h"
+
+// the file starts with this followed by the header fields, all little-endian
+#define TRAJECTORY_MAGIC "\x93NBTRAJ\x01"
+#define TRAJECTORY_MAGIC_LEN 8
+
+typedef struct {
+    uint64_t rows, cols, chunk_frames;
+    double precision;
+    uint64_t num_chunks;
+} TrajectoryHeader;
+
+// largest quantized value, leaving room for the differences to not overflow
+#define MAX_QUANTIZED ((double)(1LL << 61))
+
+
+////////// Encoding //////////
+
+static inline uint64_t __bits(double x) { uint64_t u; memcpy(&u, &x, 8); return u; }
+static inline double __from_bits(uint64_t u) { double x; memcpy(&x, &u, 8); return x; }
+static inline uint64_t __zigzag(int64_t x) { return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63); }
+static inline int64_t __unzigzag(uint64_t u) { return (int64_t)(u >> 1) ^ -(int64_t)(u & 1); }
+
+/**
+ * Converts the frames of a chunk to the differences between frames. Returns
+ * false if a value cannot be quantized.
+ */
+static bool __delta_encode(const double* frames, size_t count, size_t cols,
+                           double precision, uint64_t* words) {
+    if (precision == 0) {
+        for (size_t j = 0; j < cols; j++) { words[j] = __bits(frames[j]); }
+        for (size_t i = cols; i < count*cols; i++) {
+            words[i] = __bits(frames[i]) ^ __bits(frames[i-cols]);
+        }
+        return true;
+    }
+    int64_t prev = 0;
+    for (size_t i = 0; i < count*cols; i++) {
+        double q = round(frames[i] / precision);
+        if (!(fabs(q) <= MAX_QUANTIZED)) { errno = ERANGE; return false; } // also nan
+        if (i >= cols) { prev = (int64_t)round(frames[i-cols] / precision); }
+        words[i] = __zigzag((int64_t)q - prev);
+    }
+    return true;
+}
+
+/**
+ * Reverses __delta_encode(), writing the frames.
+ */
+static void __delta_decode(const uint64_t* words, size_t count, size_t cols,
+                           double precision, double* frames) {
+    if (precision == 0) {
+        uint64_t* bits = (uint64_t*)frames;
+        memcpy(bits, words, cols*sizeof(uint64_t));
+        for (size_t i = cols; i < count*cols; i++) { bits[i] = words[i] ^ bits[i-cols]; }
+        for (size_t i = 0; i < count*cols; i++) { frames[i] = __from_bits(bits[i]); }
+        return;
+    }
+    int64_t* q = (int64_t*)frames;
+    for (size_t i = 0; i < count*cols; i++) {
+        q[i] = __unzigzag(words[i]) + (i >= cols ? q[i-cols] : 0);
+    }
+    for (size_t i = 0; i < count*cols; i++) { frames[i] = q[i] * precision; }
+}
+
+/**
+ * Shuffles the bytes of n 8-byte words so byte b of word i is at b*n+i.
+ */
+static void __shuffle(const uint64_t* words, size_t n, unsigned char* out) {
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = words[i];
+        for (size_t b = 0; b < 8; b++, w >>= 8) { out[b*n + i] = (unsigned char)w; }
+    }
+}
+
+/**
+ * Reverses __shuffle().
+ */
+static void __unshuffle(const unsigned char* in, size_t n, uint64_t* words) {
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = 0;
+        for (size_t b = 8; b-- > 0; ) { w = (w << 8) | in[b*n + i]; }
+        words[i] = w;
+    }
+}
+
+
+////////// Writing //////////
+
+/**
+ * Saves a matrix to a compressed trajectory file.
+ */
+bool matrix_to_trajectory_path(const char* path, const Matrix* M, double precision) {
+    if (precision < 0 || !isfinite(precision)) { errno = EINVAL; return false; }
+    TrajectoryHeader header = { M->rows, M->cols, TRAJECTORY_CHUNK_FRAMES, precision,
+        (M->rows + TRAJECTORY_CHUNK_FRAMES - 1) / TRAJECTORY_CHUNK_FRAMES };
+    size_t num_chunks = header.num_chunks;
+    unsigned char** chunks = (unsigned char**)calloc(num_chunks, sizeof(unsigned char*));
+    uint64_t* sizes = (uint64_t*)calloc(num_chunks, sizeof(uint64_t));
+    bool ok = chunks && sizes;
+
+    // compress every chunk independently
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) if(num_chunks > 1)
+#endif
+    for (size_t c = 0; c < num_chunks; c++) {
+        if (!ok) { continue; }
+        size_t first = c * TRAJECTORY_CHUNK_FRAMES;
+        size_t count = M->rows - first < TRAJECTORY_CHUNK_FRAMES ? M->rows - first : TRAJECTORY_CHUNK_FRAMES;
+        size_t n = count * M->cols;
+        uint64_t* words = (uint64_t*)malloc(n * sizeof(uint64_t));
+        unsigned char* shuffled = (unsigned char*)malloc(n * sizeof(uint64_t));
+        uLongf size = compressBound(n * sizeof(uint64_t));
+        chunks[c] = (unsigned char*)malloc(size);
+        if (!words || !shuffled || !chunks[c] ||
+            !__delta_encode(&MATRIX_AT(M, first, 0), count, M->cols, precision, words)) {
+            ok = false;
+        } else {
+            __shuffle(words, n, shuffled);
+            if (compress2(chunks[c], &size, shuffled, n * sizeof(uint64_t), 1) != Z_OK) { ok = false; }
+            sizes[c] = size;
+        }
+        free(words);
+        free(shuffled);
+    }
+
+    // write the header, the size of every chunk, and then the chunks
+    FILE* f = ok ? fopen(path, "wb") : NULL;
+    ok = f && fwrite(TRAJECTORY_MAGIC, 1, TRAJECTORY_MAGIC_LEN, f) == TRAJECTORY_MAGIC_LEN &&
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(sizes, sizeof(uint64_t), num_chunks, f) == num_chunks;
+    for (size_t c = 0; ok && c < num_chunks; c++) {
+        ok = fwrite(chunks[c], 1, sizes[c], f) == sizes[c];
+    }
+    if (f && fclose(f) != 0) { ok = false; }
+
+    for (size_t c = 0; chunks && c < num_chunks; c++) { free(chunks[c]); }
+    free(chunks);
+    free(sizes);
+    return ok;
+}
+
+
+////////// Reading //////////
+
+/**
+ * Reads the magic and header of a trajectory file.
+ */
+static bool __read_trajectory_header(FILE* f, TrajectoryHeader* header) {
+    char magic[TRAJECTORY_MAGIC_LEN];
+    if (fread(magic, 1, TRAJECTORY_MAGIC_LEN, f) != TRAJECTORY_MAGIC_LEN ||
+        memcmp(magic, TRAJECTORY_MAGIC, TRAJECTORY_MAGIC_LEN) != 0 ||
+        fread(header, sizeof(*header), 1, f) != 1 || header->chunk_frames == 0 ||
+        header->num_chunks != (header->rows + header->chunk_frames - 1) / header->chunk_frames) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Checks if the file at the given path is a compressed trajectory file.
+ */
+bool is_trajectory_path(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { return false; }
+    TrajectoryHeader header;
+    bool ok = __read_trajectory_header(f, &header);
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Creates a new matrix by loading the data from the given compressed
+ * trajectory file.
+ */
+Matrix* matrix_from_trajectory_path(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { return NULL; }
+    TrajectoryHeader header;
+    if (!__read_trajectory_header(f, &header)) { fclose(f); return NULL; }
+    size_t num_chunks = header.num_chunks, cols = header.cols;
+
+    // read the sizes of the chunks and then all of the compressed data
+    uint64_t* offsets = (uint64_t*)malloc((num_chunks + 1) * sizeof(uint64_t));
+    bool ok = offsets && fread(offsets + 1, sizeof(uint64_t), num_chunks, f) == num_chunks;
+    if (ok) {
+        offsets[0] = 0;
+        for (size_t c = 0; c < num_chunks; c++) { offsets[c+1] += offsets[c]; }
+    }
+    unsigned char* data = ok ? (unsigned char*)malloc(offsets[num_chunks] + 1) : NULL;
+    ok = data && fread(data, 1, offsets[num_chunks], f) == offsets[num_chunks];
+    fclose(f);
+    Matrix* M = ok ? matrix_create_raw(header.rows, cols) : NULL;
+
+    // decompress every chunk independently
+    ok = M != NULL;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1) if(num_chunks > 1)
+#endif
+    for (size_t c = 0; c < num_chunks; c++) {
+        if (!ok) { continue; }
+        size_t first = c * header.chunk_frames;
+        size_t count = header.rows - first < header.chunk_frames ? header.rows - first : header.chunk_frames;
+        size_t n = count * cols;
+        uLongf size = n * sizeof(uint64_t);
+        unsigned char* shuffled = (unsigned char*)malloc(size);
+        uint64_t* words = (uint64_t*)malloc(size);
+        if (!shuffled || !words ||
+            uncompress(shuffled, &size, data + offsets[c], offsets[c+1] - offsets[c]) != Z_OK ||
+            size != n * sizeof(uint64_t)) {
+            ok = false;
+        } else {
+            __unshuffle(shuffled, n, words);
+            __delta_decode(words, count, cols, header.precision, &MATRIX_AT(M, first, 0));
+        }
+        free(shuffled);
+        free(words);
+    }
+
+    free(offsets);
+    free(data);
+    if (!ok && M) { matrix_free(M); M = NULL; errno = EINVAL; }
+    return M;
+}
@@ -0,0 +1,50 @@
+/**
+ * Compressed trajectory files. These store a matrix where each row is a frame
+ * (such as the positions of every body at an output step) in much less space
+ * than a NPY file. They can be read with matrix_from_trajectory_path() or with
+ * scripts/trajectory.py.
+ *
+ * Each chunk of TRAJECTORY_CHUNK_FRAMES frames is compressed independently
+ * (and in parallel when compiled with OpenMP):
+ *   - the first frame of a chunk is stored as is and every other frame as the
+ *     difference from the frame before it, which is mostly zeros for smooth
+ *     trajectories
+ *   - the bytes of the 8-byte values are shuffled so all of the first bytes
+ *     come first, then all of the second bytes, and so on
+ *   - the shuffled bytes are compressed with zlib (deflate, an LZ77 coder) at
+ *     its fastest level
+ *
+ * When lossless, the difference is the XOR of the bits of the values so every
+ * value is restored exactly. Otherwise every value is rounded to the nearest
+ * multiple of the precision (so the error is at most half of it) and the
+ * difference is of those integers.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "matrix.h"
+
+// number of frames compressed together
+#define TRAJECTORY_CHUNK_FRAMES 64
+
+/**
+ * Saves a matrix to a compressed trajectory file. If precision is 0 the values
+ * are stored losslessly, otherwise they are rounded to the nearest multiple of
+ * precision. This will return false if the data cannot be compressed (e.g. a
+ * value is too large for the precision) or written.
+ */
+bool matrix_to_trajectory_path(const char* path, const Matrix* M, double precision);
+
+/**
+ * Creates a new matrix by loading the data from the given compressed
+ * trajectory file. This will return NULL if the data cannot be read or the
+ * file format is not recognized.
+ */
+Matrix* matrix_from_trajectory_path(const char* path);
+
+/**
+ * Checks if the file at the given path is a compressed trajectory file.
+ */
+bool is_trajectory_path(const char* path);
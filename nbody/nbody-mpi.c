@@ -0,0 +1,282 @@
+/**
+ * Runs a simulation of the n-body problem in 3D across several processes
+ * (possibly on several machines) with MPI, each using OpenMP threads.
+ *
+ * To compile the program:
+ *   mpicc -Wall -fopenmp -O3 -march=native nbody-mpi.c options.c matrix.c trajectory.c util.c -o nbody-mpi -lm -lz
+ *
+ * To run the program:
+ *   mpirun -np num-procs ./nbody-mpi time-step total-time outputs-per-body input.npy output.npy [opt: num-threads]
+ * where:
+ *   - num-procs is the number of processes, on a single machine this can be
+ *     more than the number of cores with --oversubscribe for testing
+ *   - time-step is the amount of time between steps (Δt, in seconds)
+ *   - total-time is the total amount of time to simulate (in seconds)
+ *   - outputs-per-body is the number of positions to output per body
+ *   - input.npy is the file describing the initial state of the system (below),
+ *     it is only read by the first process
+ *   - output.npy is the output of the program (see below), it is only written
+ *     by the first process
+ *   - last argument is an optional number of threads per process (the number
+ *     of cores the process is bound to if not provided)
+ *
+ * input.npy and output.npy are the same as for nbody-p.
+ *
+ * The bodies are split into one contiguous range per process (in whole blocks
+ * of BLOCK_SIZE bodies). Every step, each process calculates the forces on its
+ * bodies from one block of positions at a time while the blocks travel around
+ * a ring of the processes: each block is sent on to the next process while the
+ * forces from it are calculated and the next block is received. After as many
+ * steps of the ring as there are processes every process has seen every body.
+ * The output rows are gathered to the first process without waiting for them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <omp.h>
+#include <mpi.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "options.h"
+#include "trajectory.h"
+
+#define BLOCK_SIZE 32
+#include "formulap.h"
+#include "formulablock.h"
+#include "masses.h"
+#include "bodies.h"
+
+// tag of the messages with blocks of positions going around the ring
+#define TAG_RING 1
+
+// this prints an error from the first process only and ends every process
+#define EXIT_ERROR(...) do { if (rank == 0) { fprintf(stderr, __VA_ARGS__); } MPI_Finalize(); return 1; } while (0)
+
+// this function copies the positions of the n bodies of this process to buf as
+// the x, y, and z of each body like they are in a row of the output
+static void packPositions(double* buf, Positions* positions, size_t n)
+{
+    for (size_t start = 0; start < n; start += BLOCK_SIZE)
+    {
+        Positions* p = &positions[start/BLOCK_SIZE * 3];
+        size_t count = n - start < BLOCK_SIZE ? n - start : BLOCK_SIZE;
+        for (size_t k = 0; k < count; k++, buf += 3)
+        {
+            buf[0] = p[0].x[k];
+            buf[1] = p[1].y[k];
+            buf[2] = p[2].z[k];
+        }
+    }
+}
+
+// this function starts sending a block of positions to the next process in
+// the ring and receiving the next block from the previous process
+static void startRingStage(Positions* block, Positions* next, size_t values, int left, int right, MPI_Request* requests)
+{
+    MPI_Irecv(next, values, MPI_DOUBLE, left, TAG_RING, MPI_COMM_WORLD, &requests[0]);
+    MPI_Isend(block, values, MPI_DOUBLE, right, TAG_RING, MPI_COMM_WORLD, &requests[1]);
+}
+
+// this function starts gathering the positions of every process into a row of
+// the output on the first process, once the previous row has been gathered
+// (and released if the output is mapped)
+static void gatherRow(Matrix* output, size_t row, Positions* positions, size_t n, double* send,
+                      const int* counts, const int* displs, MPI_Request* request, size_t* pending_row, bool release)
+{
+    MPI_Wait(request, MPI_STATUS_IGNORE);
+    if (release && *pending_row != SIZE_MAX) { releaseOutputRows(output, *pending_row); }
+    packPositions(send, positions, n);
+    MPI_Igatherv(send, 3*n, MPI_DOUBLE, output ? &MATRIX_AT(output, row, 0) : NULL,
+                 counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD, request);
+    *pending_row = row;
+}
+
+
+int main(int argc, const char* argv[]) {
+    // start MPI, only the main thread of each process makes MPI calls
+    int provided, rank, num_procs;
+    MPI_Init_thread(&argc, (char***)&argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
+    if (provided < MPI_THREAD_FUNNELED) { EXIT_ERROR("MPI does not support threads\n"); }
+
+    // parse arguments
+    Options opts;
+    if (!parse_options(&argc, argv, &opts)) { MPI_Finalize(); return 1; }
+    if (argc != 6 && argc != 7) {
+        if (rank == 0) { fprintf(stderr, "usage: %s [options] time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); print_options(stderr); }
+        MPI_Finalize();
+        return 1;
+    }
+    if (opts.velocities_path || opts.energy_path || opts.angular_momentum_path || opts.center_of_mass_path || opts.tlb_stats ||
+        opts.checkpoint_path || opts.track || opts.region || opts.every || opts.progress > 0 || opts.progress_path ||
+        opts.autotune || opts.tuning_path) {
+        EXIT_ERROR("--velocities, --energy, --angular-momentum, --center-of-mass, --tlb-stats, --checkpoint, --track, --region, --every, --progress, --progress-file, --autotune, and --tuning are not supported by %s\n", argv[0]);
+    }
+    double time_step = atof(argv[1]), total_time = atof(argv[2]);
+    if (time_step <= 0 || total_time <= 0 || time_step > total_time) { EXIT_ERROR("time-step and total-time must be positive with total-time > time-step\n"); }
+    size_t num_outputs = atoi(argv[3]);
+    if (num_outputs <= 0) { EXIT_ERROR("outputs-per-body must be positive\n"); }
+    size_t num_threads = argc == 7 ? atoi(argv[6]) : get_num_cores_affinity();
+    if (num_threads <= 0) { EXIT_ERROR("num-threads must be positive\n"); }
+
+    // the first process reads the input and sends it to the others, all of
+    // them stop if it could not (it already printed why)
+    Matrix* input = NULL;
+    unsigned long long header[2] = { 0, 0 }; // whether the input was read, and n
+    if (rank == 0) {
+        input = matrix_from_npy_readonly_path(argv[4]);
+        if (input == NULL) { perror("error reading input"); }
+        else if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); }
+        else { header[0] = 1; header[1] = input->rows; }
+    }
+    MPI_Bcast(header, 2, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+    if (!header[0]) { MPI_Finalize(); return 1; }
+    unsigned long long n = header[1];
+    if (n == 0) { EXIT_ERROR("input.npy must have at least 1 row\n"); }
+    if (rank != 0) { input = matrix_create_raw(n, 7); }
+    MPI_Bcast(input->data, 7*n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    size_t num_steps = (size_t)(total_time / time_step + 0.5);
+    if (num_steps < num_outputs) { num_outputs = 1; }
+    size_t output_steps = num_steps/num_outputs;
+    num_outputs = (num_steps+output_steps-1)/output_steps;
+
+    // split the bodies into a range of whole blocks for each process, the last
+    // processes may have fewer bodies (or none)
+    size_t num_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t proc_blocks = (num_blocks + num_procs - 1) / num_procs;
+    size_t proc_bodies = proc_blocks * BLOCK_SIZE;
+    int* counts = (int*)malloc(num_procs * sizeof(int)); // number of output values of each process
+    int* displs = (int*)malloc(num_procs * sizeof(int)); // offset of them in an output row
+    for (int p = 0; p < num_procs; p++) {
+        size_t first = p * proc_bodies < n ? p * proc_bodies : n;
+        size_t last = first + proc_bodies < n ? first + proc_bodies : n;
+        counts[p] = 3 * (last - first);
+        displs[p] = 3 * first;
+    }
+    size_t first = displs[rank] / 3, count = counts[rank] / 3;
+    if (num_threads > count && count > 0) { num_threads = count; }
+    int right = (rank + 1) % num_procs, left = (rank + num_procs - 1) % num_procs;
+
+    // variables available now:
+    //   time_step    number of seconds between each time point
+    //   num_steps    number of time steps to simulate
+    //   num_outputs  number of times the position will be output for all bodies
+    //   output_steps number of steps between each output of the position
+    //   num_threads  number of threads to use in this process
+    //   input        n-by-7 Matrix of input data
+    //   n            number of bodies to simulate
+    //   first, count range of bodies of this process
+
+    // start the clock once every process is ready
+    MPI_Barrier(MPI_COMM_WORLD);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // every process loads all of the bodies (padded to a whole number of
+    // blocks for every process) and works on its range of them, every buffer
+    // of the run comes from one arena and is freed with it
+    Arena* arena = arena_create_huge(opts.hugepages);
+    Positions* positions = createBodyStore(arena, proc_blocks * num_procs * BLOCK_SIZE);
+    Positions* velocities = createBodyStore(arena, proc_blocks * num_procs * BLOCK_SIZE);
+    double* forces = (double*)arena_alloc(arena, count * 3 * sizeof(double));
+    Masses masses = createMasses(arena, n);
+    loadBodies(input, positions, velocities, &masses);
+    Positions* local = &positions[first/BLOCK_SIZE * 3];
+    Positions* local_velocities = &velocities[first/BLOCK_SIZE * 3];
+
+    // the two buffers the blocks of other processes are received into
+    size_t block_values = proc_blocks * 3 * sizeof(Positions) / sizeof(double);
+    Positions* buffers[2] = {
+        createBodyStore(arena, proc_bodies),
+        createBodyStore(arena, proc_bodies),
+    };
+    MPI_Request ring[2];
+
+    // create the output matrix on the first process, either in memory or
+    // directly in the output file
+    Matrix* output = NULL;
+    if (rank == 0) {
+        output = opts.mmap_output ? matrix_create_npy_path(argv[5], num_outputs, 3*n) : matrix_create_raw_in(arena, num_outputs, 3*n);
+        if (output == NULL) { perror("error creating output"); MPI_Abort(MPI_COMM_WORLD, 1); }
+
+        // save positions to row `0` of output
+        for (size_t i = 0; i < n; i++) {
+            MATRIX_AT(output, 0, i * 3 + 0) = MATRIX_AT(input, i, 1);
+            MATRIX_AT(output, 0, i * 3 + 1) = MATRIX_AT(input, i, 2);
+            MATRIX_AT(output, 0, i * 3 + 2) = MATRIX_AT(input, i, 3);
+        }
+    }
+    double* send = (double*)arena_alloc(arena, count * 3 * sizeof(double));
+    MPI_Request gather = MPI_REQUEST_NULL;
+    size_t gathered_row = SIZE_MAX;
+    bool release = rank == 0 && opts.mmap_output;
+
+    // forces of equal-mass systems are unscaled so G * mass is folded into the time step
+    double kick = masses.gm_equal ? masses.gm_equal * time_step : time_step;
+
+    // run the simulation for each time step
+    #pragma omp parallel default(none) firstprivate(local, local_velocities, masses, forces, count, output, send, counts, displs, release, buffers, block_values, proc_bodies, rank, num_procs, left, right) shared(time_step, kick, output_steps, num_steps, ring, gather, gathered_row) num_threads(num_threads)
+    for (size_t step = 1; step < num_steps; step++) {
+        // compute the forces from each block as it goes around the ring
+        Positions* block = local;
+        for (int stage = 0; stage < num_procs; stage++) {
+            int owner = (rank + num_procs - stage) % num_procs;
+            size_t owner_first = owner * proc_bodies, owner_count = counts[owner] / 3;
+            Positions* next = buffers[stage % 2];
+            #pragma omp master
+            if (stage + 1 < num_procs) { startRingStage(block, next, block_values, left, right, ring); }
+            if (masses.gm_equal) { calculateBlockForcesEqualMass(forces, local, count, block, owner_count, owner == rank, 0, stage > 0); }
+            else { calculateBlockForces(forces, local, count, block, &masses.gm[owner_first], owner_count, owner == rank, 0, stage > 0); }
+            #pragma omp master
+            if (stage + 1 < num_procs) { MPI_Waitall(2, ring, MPI_STATUSES_IGNORE); }
+            #pragma omp barrier
+            block = next;
+        }
+        calculateVelocities(local_velocities, forces, count, kick);
+        calculatePositions(local, local_velocities, count, time_step);
+
+        // Periodically copy the positions to the output data
+        if (step % output_steps == 0) {
+            #pragma omp master
+            gatherRow(output, step / output_steps, local, count, send, counts, displs, &gather, &gathered_row, release);
+        }
+    }
+
+    if (num_steps % output_steps != 0) {
+        // save positions to row 'num_outputs - 1' of the output matrix
+        gatherRow(output, num_outputs - 1, local, count, send, counts, displs, &gather, &gathered_row, release);
+    }
+    MPI_Wait(&gather, MPI_STATUS_IGNORE);
+
+    // get the end and computation time
+    MPI_Barrier(MPI_COMM_WORLD);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (rank == 0) {
+        double time = get_time_diff(&start, &end);
+        printf("%f secs\n", time);
+
+        // save results (a mapped output is already in the file)
+        if (opts.compress) {
+            if (!matrix_to_trajectory_path(argv[5], output, opts.precision)) { perror("error writing output"); }
+        } else if (!opts.mmap_output) {
+            matrix_to_npy_path(argv[5], output);
+        }
+        matrix_free(output);
+    }
+
+    // cleanup
+    free(counts);
+    free(displs);
+    matrix_free(input);
+    arena_free(arena);
+
+    MPI_Finalize();
+    return 0;
+}
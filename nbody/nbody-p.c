@@ -2,7 +2,7 @@
  * Runs a simulation of the n-body problem in 3D.
  * 
  * To compile the program:
- *   gcc -Wall -fopenmp -O3 -march=native nbody-p.c matrix.c util.c -o nbody-p -lm
+ *   gcc -Wall -fopenmp -O3 -march=native nbody-p.c options.c matrix.c trajectory.c util.c -o nbody-p -lm -lz
  * 
  * To run the program:
  *   ./nbody-p time-step total-time outputs-per-body input.npy output.npy [opt: num-threads]
@@ -39,25 +39,44 @@
 
 #include "matrix.h"
 #include "util.h"
+#include "options.h"
+#include "trajectory.h"
+#include "tlb_stats.h"
+#include "progress.h"
+#include "stop.h"
 
 #define BLOCK_SIZE 32
 #include "formulap.h"
+#include "formulas_small.h"
+#include "masses.h"
+#include "bodies.h"
+#include "diagnostics.h"
+#include "selection.h"
+#include "autotune.h"
 
 
 int main(int argc, const char* argv[]) {
     // parse arguments
-    if (argc != 6 && argc != 7) { fprintf(stderr, "usage: %s time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); return 1; }
+    Options opts;
+    if (!parse_options(&argc, argv, &opts)) { return 1; }
+    char tuning_file[4096];
+    bool use_tuning = tuning_path(opts.tuning_path, tuning_file, sizeof(tuning_file));
+    if (opts.autotune && !autotune(tuning_file, "nbody-p", get_num_cores_affinity())) { return 1; }
+    if (opts.autotune && argc == 1) { return 0; }
+    if (argc != 6 && argc != 7) { fprintf(stderr, "usage: %s [options] time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); print_options(stderr); return 1; }
     double time_step = atof(argv[1]), total_time = atof(argv[2]);
     if (time_step <= 0 || total_time <= 0 || time_step > total_time) { fprintf(stderr, "time-step and total-time must be positive with total-time > time-step\n"); return 1; }
     size_t num_outputs = atoi(argv[3]);
     if (num_outputs <= 0) { fprintf(stderr, "outputs-per-body must be positive\n"); return 1; }
     size_t num_threads = argc == 7 ? atoi(argv[6]) : get_num_cores_affinity()/2; // TODO: you may choose to adjust the default value
-    if (num_threads <= 0) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
-    Matrix* input = matrix_from_npy_path(argv[4]);
+    Matrix* input = matrix_from_npy_readonly_path(argv[4]);
     if (input == NULL) { perror("error reading input"); return 1; }
     if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); return 1; }
     size_t n = input->rows;
     if (n == 0) { fprintf(stderr, "input.npy must have at least 1 row\n"); return 1; }
+    // use the settings tuned for this machine and number of bodies (see --autotune)
+    if (use_tuning && tuning_load(tuning_file, "nbody-p", n, &kernel_tuning) && argc == 6 && kernel_tuning.threads) { num_threads = kernel_tuning.threads; }
+    if (num_threads <= 0) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
     if (num_threads > n) { num_threads = n; }
     size_t num_steps = (size_t)(total_time / time_step + 0.5);
     if (num_steps < num_outputs) { num_outputs = 1; }
@@ -79,93 +98,144 @@ int main(int argc, const char* argv[]) {
     clock_gettime(CLOCK_MONOTONIC, &start);
 
     // inside main function, after the start clock
-    Positions* positions = (Positions*)malloc(n * 3 * sizeof(Positions));
-    Positions* velocities = (Positions*)malloc(n * 3 * sizeof(Positions));
-    double* forces = (double*)malloc(n * 3 * sizeof(double));
-    double* masses = (double*)malloc(n * sizeof(double));
+    // every buffer of the run comes from one arena and is freed with it
+    Arena* arena = arena_create_huge(opts.hugepages);
+    Positions* positions = createBodyStore(arena, n);
+    Positions* velocities = createBodyStore(arena, n);
+    double* forces = (double*)arena_alloc(arena, n * 3 * sizeof(double));
+    Masses masses = createMasses(arena, n);
 
     // initialize positions, velocities, and masses
-    for (size_t i = 0; i < n; i++) {
-        masses[i] = MATRIX_AT(input, i, 0);
-        positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] = MATRIX_AT(input, i, 1);
-        positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] = MATRIX_AT(input, i, 2);
-        positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] = MATRIX_AT(input, i, 3);
-        velocities[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE] = MATRIX_AT(input, i, 4);
-        velocities[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE] = MATRIX_AT(input, i, 5);
-        velocities[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE] = MATRIX_AT(input, i, 6);
-    
-    }
-
-    // create the output matrix
-
-    Matrix* output = matrix_create_raw(num_outputs, 3*n);
+    loadBodies(input, positions, velocities, &masses);
 
+    // choose the positions that are saved (see --track, --region, and --every)
+    OutputSelection sel;
+    if (!createOutputSelection(&sel, arena, &opts, n, num_outputs)) { return 1; }
 
+    // create the output matrix, either in memory or directly in the output file
+    Matrix* output = createSelectedOutput(arena, &sel, argv[5], num_outputs);
+    if (output == NULL) { perror("error creating output"); return 1; }
 
     // save positions to row `0` of output
-    for (size_t i = 0; i < n; i++) {
-        MATRIX_AT(output, 0, i * 3 + 0) = MATRIX_AT(input, i, 1);
-        MATRIX_AT(output, 0, i * 3 + 1) = MATRIX_AT(input, i, 2);
-        MATRIX_AT(output, 0, i * 3 + 2) = MATRIX_AT(input, i, 3);
-    }
+    saveSelectedPositions(output, &sel, 0, positions, n);
+
+
+
+    // forces of equal-mass systems are unscaled so G * mass is folded into the time step
+    double kick = masses.gm_equal ? masses.gm_equal * time_step : time_step;
+
+    // extra output streams selected by the options
+    Diagnostics diag = createDiagnostics(arena, &opts, num_outputs, n);
+
+    // count the dTLB misses of the simulation
+    TLBStats tlb = { { 0 }, 0, 0 };
+    if (opts.tlb_stats) { tlb_stats_start(&tlb, num_threads); }
+
+    // report the progress from another thread
+    Progress progress;
+    if (!progress_start(&progress, &opts, num_steps, n, diag.energy, output_steps)) { return 1; }
+
+    // stop cleanly at the end of a step on SIGTERM, SIGUSR1, or SIGINT
+    StopPoint stop;
+    stop_install(&stop, num_steps);
+
+    bool small = n <= SMALL_N_MAX && !diag.enabled && !progress.enabled && !opts.checkpoint_path && !sel.enabled;
+    if (small) {
+        // tiny systems run entirely in registers with a kernel specialised for n
+        simulateSmall(input, output, num_steps, output_steps, time_step, &stop);
+    } else {
+        // run the simulation for each time step
+        #pragma omp parallel default(none) firstprivate(positions, velocities, masses, forces, n, output, opts, diag, sel) shared(progress, stop, time_step, kick, output_steps, num_steps) num_threads(num_threads)
+        for (size_t step = 1; step < num_steps && !stop_reached(&stop, step); step++) {
+            // compute time step, the diagnostics of an output step are recorded
+            // in the next step since its forces are from the same positions
+            bool record = diag.enabled && (step - 1) % output_steps == 0;
+            calculateStepForces(forces, record ? diag.potential : NULL, positions, &masses, n);
+            if (record) {
+                #pragma omp single
+                recordDiagnostics(&diag, (step - 1) / output_steps, positions, velocities, &masses, n);
+            }
+            //printf("%zu forces: %g %g %g\n", step, forces[3], forces[4], forces[5]);
+            calculateVelocities(velocities, forces, n, kick);
+            //printf("%zu velocities: %g %g %g\n", step, velocities[0].x[1], velocities[0].y[1], velocities[0].z[1]);
+            calculatePositions(positions, velocities, n, time_step);
+            if (omp_get_thread_num() == 0) { progress_step(&progress, step); stop_check(&stop, step); }
+            //printf("%zu positions: %g %g %g\n", step, positions[0].x[1], positions[0].y[1], positions[0].z[1]);
 
 
+            //if (step % 8) {
+                //printf("%zu velocities: %g %g %g\n", step, velocities[0].x[1], velocities[1].y[1], velocities[2].z[1]);
+                //printf("%zu positions: %g %g %g\n", step, positions[0].x[1], positions[1].y[1], positions[2].z[1]);
+            //}
 
-    // run the simulation for each time step
-    #pragma omp parallel default(none) firstprivate(positions, velocities, masses, forces, n, output) shared(time_step, output_steps, num_steps) num_threads(num_threads)
-    for (size_t step = 1; step < num_steps; step++) {
-        // compute time step
-        calculateForces(forces, positions, masses, n);
-        //printf("%zu forces: %g %g %g\n", step, forces[3], forces[4], forces[5]);
-        calculateVelocities(velocities, forces, masses, n, time_step);
-        //printf("%zu velocities: %g %g %g\n", step, velocities[0].x[1], velocities[0].y[1], velocities[0].z[1]);
-        calculatePositions(positions, velocities, n, time_step);
-        //printf("%zu positions: %g %g %g\n", step, positions[0].x[1], positions[0].y[1], positions[0].z[1]);
+            //if (step > 512) { break;}
 
+            // Periodically copy the positions to the output data
 
-        //if (step % 8) {
-            //printf("%zu velocities: %g %g %g\n", step, velocities[0].x[1], velocities[1].y[1], velocities[2].z[1]);
-            //printf("%zu positions: %g %g %g\n", step, positions[0].x[1], positions[1].y[1], positions[2].z[1]);
-        //}
+            if (step % output_steps == 0) {
+                #pragma omp single nowait
+                {
+                    saveSelectedPositions(output, &sel, step / output_steps, positions, n);
+                }
+            }
+        }
 
-        //if (step > 512) { break;}
+    }
 
-        // Periodically copy the positions to the output data
+    // a run stopped by a signal keeps the output rows of the steps it ran, the
+    // diagnostics are truncated before the last progress report reads them
+    size_t last_step = stop_last_step(&stop);
+    bool stopped = last_step + 1 < num_steps;
+    if (stopped) {
+        num_outputs = last_step / output_steps + 1;
+        truncateDiagnostics(&diag, num_outputs);
+    }
 
-        if (step % output_steps == 0) {
-            for (size_t i = 0; i < n; i++) {
-                MATRIX_AT(output, step / output_steps, i * 3 + 0) = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
-                MATRIX_AT(output, step / output_steps, i * 3 + 1) = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
-                MATRIX_AT(output, step / output_steps, i * 3 + 2) = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
-            }
-        }
+    if (diag.enabled && (stopped ? last_step % output_steps == 0 : num_steps % output_steps != 0 || (num_steps - 1) % output_steps == 0)) {
+        // the last output row has no next step so its forces are calculated once more
+        #pragma omp parallel default(none) firstprivate(positions, masses, forces, n, diag) num_threads(num_threads)
+        calculateStepForces(forces, diag.potential, positions, &masses, n);
+        recordDiagnostics(&diag, num_outputs - 1, positions, velocities, &masses, n);
     }
 
-    
-    if (num_steps % output_steps != 0) {
-        // save positions to row 'num_outputs - 1' of the output matrix
-        for (size_t i = 0; i < n; i++) {
-            // apply a unary function to each element of the matrix
-            MATRIX_AT(output, num_outputs - 1, i * 3 + 0) = positions[i/BLOCK_SIZE * 3].x[i%BLOCK_SIZE];
-            MATRIX_AT(output, num_outputs - 1, i * 3 + 1) = positions[i/BLOCK_SIZE * 3 + 1].y[i%BLOCK_SIZE];
-            MATRIX_AT(output, num_outputs - 1, i * 3 + 2) = positions[i/BLOCK_SIZE * 3 + 2].z[i%BLOCK_SIZE];
-        }
+    if (!small && !stopped && num_steps % output_steps != 0) {
+        // save positions to row 'num_outputs - 1' of the output matrix (the
+        // small kernels save it themselves)
+        saveSelectedPositions(output, &sel, num_outputs - 1, positions, n);
     }
 
+    progress_stop(&progress);
+
     // get the end and computation time
     clock_gettime(CLOCK_MONOTONIC, &end);
     double time = get_time_diff(&start, &end);
     printf("%f secs\n", time);
+    if (opts.tlb_stats) { tlb_stats_report(&tlb, arena, num_steps); }
 
-    // save results
-    matrix_to_npy_path(argv[5], output);
+    // keep only the completed rows of a run that was stopped early
+    if (stopped) {
+        fprintf(stderr, "stopped by signal %d after step %zu of %zu, saving %zu output rows\n", (int)stop_signal, last_step, num_steps - 1, num_outputs);
+        if (!truncateSelectedOutput(output, &sel, argv[5], num_outputs)) { perror("error truncating output"); }
+    }
+
+    // save results (a mapped output is already in the file)
+    if (opts.compress) {
+        if (!matrix_to_trajectory_path(argv[5], output, opts.precision)) { perror("error writing output"); }
+    } else if (!opts.mmap_output) {
+        matrix_to_npy_path(argv[5], output);
+    }
+    saveDiagnostics(&diag, &opts);
+    if (opts.checkpoint_path) {
+        if (!saveCheckpoint(opts.checkpoint_path, input, positions, velocities, n)) { perror("error writing checkpoint"); }
+        else if (stopped) { fprintf(stderr, "state after step %zu saved to %s, continue with total-time %g\n", last_step, opts.checkpoint_path, (num_steps - last_step) * time_step); }
+    }
 
     // cleanup
-    free(positions);
-    free(velocities);
-    free(masses);
-    free(forces);
     matrix_free(input);
+    matrix_free(output);
+    arena_free(arena);
 
-    return 0;
+    // a run stopped by a signal exits with 128 + the signal, as a shell reports
+    // a process killed by it, so a job script can tell it from a finished run
+    return stopped ? 128 + (int)stop_signal : 0;
 }
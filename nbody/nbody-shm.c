@@ -0,0 +1,393 @@
+/**
+ * Runs a simulation of the n-body problem in 3D with several cooperating
+ * processes that share the body store, each using OpenMP threads.
+ *
+ * To compile the program:
+ *   gcc -Wall -fopenmp -O3 -march=native nbody-shm.c options.c matrix.c trajectory.c util.c -o nbody-shm -lm -lz
+ *
+ * To run the program:
+ *   ./nbody-shm time-step total-time outputs-per-body input.npy output.npy [opt: num-procs [opt: num-threads]]
+ * where:
+ *   - time-step is the amount of time between steps (Δt, in seconds)
+ *   - total-time is the total amount of time to simulate (in seconds)
+ *   - outputs-per-body is the number of positions to output per body
+ *   - input.npy is the file describing the initial state of the system (below)
+ *   - output.npy is the output of the program (see below)
+ *   - num-procs is an optional number of processes (one per socket if not
+ *     provided)
+ *   - num-threads is an optional number of threads per process (the number of
+ *     cores the process is pinned to if not provided)
+ *
+ * input.npy and output.npy are the same as for nbody-p.
+ *
+ * The positions, velocities, and masses of all bodies are in one POSIX shared
+ * memory segment that the worker processes attach to when they are forked, so
+ * the memory used does not grow with the number of processes. Each process is
+ * pinned to its own group of cores (the cores of a socket are kept together)
+ * and is responsible for a contiguous range of the bodies, which it touches
+ * first so its pages are placed near it. The positions are double-buffered:
+ * each step reads one copy of every position and writes the new positions of
+ * the range of each process to the other copy, so the processes only have to
+ * meet at a single barrier per step. The barrier is a process-shared futex.
+ */
+
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "options.h"
+#include "trajectory.h"
+
+#define BLOCK_SIZE 32
+#include "formulap.h"
+#include "formulablock.h"
+#include "masses.h"
+#include "bodies.h"
+
+// number of times a process checks the barrier before sleeping on it
+#define BARRIER_SPINS 2000
+
+// this struct is a barrier for processes that share memory, the processes that
+// have to wait sleep on a futex
+typedef struct {
+    atomic_uint remaining; // number of processes still to arrive in this round
+    atomic_uint round;     // incremented when all processes have arrived (the futex word)
+    atomic_int aborted;    // set when a process has died, waiting then fails
+    unsigned int count;    // number of processes
+} ShmBarrier;
+
+// the barrier the SIGCHLD handler aborts if a worker dies
+static ShmBarrier* child_barrier = NULL;
+
+static long futex(atomic_uint* addr, int op, unsigned int val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+// this function waits until all of the processes have called it, returning
+// false if the barrier was aborted (before or while waiting, since a dead
+// process never arrives)
+static bool shmBarrierWait(ShmBarrier* barrier)
+{
+    if (atomic_load(&barrier->aborted)) { return false; }
+    unsigned int round = atomic_load(&barrier->round);
+    if (atomic_fetch_sub(&barrier->remaining, 1) == 1)
+    {
+        // the last process starts the next round and wakes the others
+        atomic_store(&barrier->remaining, barrier->count);
+        atomic_fetch_add(&barrier->round, 1);
+        futex(&barrier->round, FUTEX_WAKE, INT_MAX);
+    }
+    else
+    {
+        for (int spin = 0; spin < BARRIER_SPINS && !atomic_load(&barrier->aborted) && atomic_load(&barrier->round) == round; spin++) { }
+        while (!atomic_load(&barrier->aborted) && atomic_load(&barrier->round) == round) { futex(&barrier->round, FUTEX_WAIT, round); }
+    }
+    return !atomic_load(&barrier->aborted);
+}
+
+// this function aborts the barrier so every process waiting on it (now or
+// later) returns, it only uses atomics and a system call so it can be called
+// from a signal handler
+static void shmBarrierAbort(ShmBarrier* barrier)
+{
+    atomic_store(&barrier->aborted, 1);
+    atomic_fetch_add(&barrier->round, 1);
+    futex(&barrier->round, FUTEX_WAKE, INT_MAX);
+}
+
+// this handler aborts the barrier if a worker process exits unsuccessfully
+static void onChildExit(int sig)
+{
+    (void)sig;
+    int saved = errno, status;
+    while (waitpid(-1, &status, WNOHANG) > 0)
+    {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) { shmBarrierAbort(child_barrier); }
+    }
+    errno = saved;
+}
+
+// this function gets the cores this process may run on ordered so the cores of
+// each socket are together, returning how many there are
+static size_t getCoresBySocket(int* cores)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    int sockets[CPU_SETSIZE];
+    size_t count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &set)) { continue; }
+        char path[96];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        FILE* f = fopen(path, "r");
+        int socket = 0;
+        if (f) { if (fscanf(f, "%d", &socket) != 1) { socket = 0; } fclose(f); }
+
+        // insertion sort by socket, keeping the order of the cores of a socket
+        size_t i = count++;
+        for (; i > 0 && sockets[i-1] > socket; i--) { sockets[i] = sockets[i-1]; cores[i] = cores[i-1]; }
+        sockets[i] = socket;
+        cores[i] = cpu;
+    }
+    return count;
+}
+
+// this function counts the sockets of the ordered cores
+static size_t countSockets(const int* cores, size_t num_cores)
+{
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    size_t count = 0;
+    for (size_t i = 0; i < num_cores; i++)
+    {
+        char path[96];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cores[i]);
+        FILE* f = fopen(path, "r");
+        int socket = 0;
+        if (f) { if (fscanf(f, "%d", &socket) != 1) { socket = 0; } fclose(f); }
+        if (socket >= 0 && socket < CPU_SETSIZE && !CPU_ISSET(socket, &seen)) { CPU_SET(socket, &seen); count++; }
+    }
+    return count ? count : 1;
+}
+
+// this function pins the calling process to its share of the cores, returning
+// how many cores it has
+static size_t pinProcess(const int* cores, size_t num_cores, size_t proc, size_t num_procs)
+{
+    size_t first = proc * num_cores / num_procs, last = (proc + 1) * num_cores / num_procs;
+    if (last <= first) { first = proc % num_cores; last = first + 1; } // more processes than cores
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = first; i < last; i++) { CPU_SET(cores[i], &set); }
+    sched_setaffinity(0, sizeof(set), &set);
+    return last - first;
+}
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    Options opts;
+    if (!parse_options(&argc, argv, &opts)) { return 1; }
+    if (argc < 6 || argc > 8) { fprintf(stderr, "usage: %s [options] time-step total-time outputs-per-body input.npy output.npy [num-procs [num-threads]]\n", argv[0]); print_options(stderr); return 1; }
+    if (opts.velocities_path || opts.energy_path || opts.angular_momentum_path || opts.center_of_mass_path || opts.tlb_stats ||
+        opts.checkpoint_path || opts.track || opts.region || opts.every || opts.progress > 0 || opts.progress_path ||
+        opts.autotune || opts.tuning_path) {
+        fprintf(stderr, "--velocities, --energy, --angular-momentum, --center-of-mass, --tlb-stats, --checkpoint, --track, --region, --every, --progress, --progress-file, --autotune, and --tuning are not supported by %s\n", argv[0]);
+        return 1;
+    }
+    double time_step = atof(argv[1]), total_time = atof(argv[2]);
+    if (time_step <= 0 || total_time <= 0 || time_step > total_time) { fprintf(stderr, "time-step and total-time must be positive with total-time > time-step\n"); return 1; }
+    size_t num_outputs = atoi(argv[3]);
+    if (num_outputs <= 0) { fprintf(stderr, "outputs-per-body must be positive\n"); return 1; }
+    static int cores[CPU_SETSIZE];
+    size_t num_cores = getCoresBySocket(cores);
+    size_t num_procs = argc >= 7 ? atoi(argv[6]) : countSockets(cores, num_cores);
+    if (num_procs <= 0) { fprintf(stderr, "num-procs must be positive\n"); return 1; }
+    size_t num_threads = argc == 8 ? atoi(argv[7]) : 0; // 0 is the number of cores of each process
+    if (argc == 8 && num_threads <= 0) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
+
+    // no OpenMP threads may exist yet when the workers are forked
+    omp_set_num_threads(1);
+    Matrix* input = matrix_from_npy_readonly_path(argv[4]);
+    if (input == NULL) { perror("error reading input"); return 1; }
+    if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); return 1; }
+    size_t n = input->rows;
+    if (n == 0) { fprintf(stderr, "input.npy must have at least 1 row\n"); return 1; }
+    size_t num_steps = (size_t)(total_time / time_step + 0.5);
+    if (num_steps < num_outputs) { num_outputs = 1; }
+    size_t output_steps = num_steps/num_outputs;
+    num_outputs = (num_steps+output_steps-1)/output_steps;
+
+    // split the bodies into a range of whole blocks for each process, the last
+    // processes may have fewer bodies (or none)
+    size_t num_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (num_procs > num_blocks) { num_procs = num_blocks; }
+    size_t proc_blocks = (num_blocks + num_procs - 1) / num_procs;
+
+    // variables available now:
+    //   time_step    number of seconds between each time point
+    //   num_steps    number of time steps to simulate
+    //   num_outputs  number of times the position will be output for all bodies
+    //   output_steps number of steps between each output of the position
+    //   num_procs    number of processes to use
+    //   input        n-by-7 Matrix of input data
+    //   n            number of bodies to simulate
+
+    // start the clock
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // create the shared segment: the barrier, two copies of the positions, the
+    // velocities, and the masses, each starting on a new page
+    size_t page = sysconf(_SC_PAGE_SIZE);
+    size_t header_size = (sizeof(ShmBarrier) + page - 1) / page * page;
+    size_t store_size = (proc_blocks * num_procs * 3 * sizeof(Positions) + page - 1) / page * page;
+    size_t masses_size = (n * sizeof(double) + page - 1) / page * page;
+    size_t length = header_size + 3 * store_size + masses_size;
+    char name[64];
+    snprintf(name, sizeof(name), "/nbody-shm-%d", (int)getpid());
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) { perror("error creating shared memory"); return 1; }
+    shm_unlink(name); // the segment lives on until every process has unmapped it
+    if (ftruncate(fd, length) != 0) { perror("error creating shared memory"); return 1; }
+    char* segment = (char*)mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) { perror("error mapping shared memory"); return 1; }
+#ifdef MADV_HUGEPAGE
+    // a POSIX shared memory segment cannot use reserved huge pages, but it can
+    // use transparent ones if they are enabled for shared memory
+    if (opts.hugepages != HUGEPAGES_OFF) { madvise(segment, length, MADV_HUGEPAGE); }
+#endif
+    ShmBarrier* barrier = (ShmBarrier*)segment;
+    Positions* buffers[2] = { (Positions*)(segment + header_size), (Positions*)(segment + header_size + store_size) };
+    Positions* velocities = (Positions*)(segment + header_size + 2*store_size);
+    Masses masses = { (double*)(segment + header_size + 3*store_size), 0 };
+    atomic_init(&barrier->remaining, num_procs);
+    atomic_init(&barrier->round, 0);
+    atomic_init(&barrier->aborted, 0);
+    barrier->count = num_procs;
+
+    // whether all of the masses are equal is needed before the workers start
+    bool equal = true;
+    for (size_t i = 0; i < n; i++) { equal &= MATRIX_AT(input, i, 0) == MATRIX_AT(input, 0, 0); }
+    masses.gm_equal = equal ? G * MATRIX_AT(input, 0, 0) : 0;
+
+    // the buffers private to each process come from an arena (a copy of it
+    // after the workers are forked), freed all at once
+    Arena* arena = arena_create_huge(opts.hugepages);
+
+    // create the output matrix, either in memory or directly in the output file
+    Matrix* output = opts.mmap_output ? matrix_create_npy_path(argv[5], num_outputs, 3*n) : matrix_create_raw_in(arena, num_outputs, 3*n);
+    if (output == NULL) { perror("error creating output"); return 1; }
+
+    // save positions to row `0` of output
+    for (size_t i = 0; i < n; i++) {
+        MATRIX_AT(output, 0, i * 3 + 0) = MATRIX_AT(input, i, 1);
+        MATRIX_AT(output, 0, i * 3 + 1) = MATRIX_AT(input, i, 2);
+        MATRIX_AT(output, 0, i * 3 + 2) = MATRIX_AT(input, i, 3);
+    }
+
+    // fork the workers, this process is process 0
+    child_barrier = barrier;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onChildExit;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, NULL);
+    fflush(stdout);
+    fflush(stderr);
+    size_t proc = 0;
+    for (size_t p = 1; p < num_procs; p++) {
+        pid_t pid = fork();
+        if (pid < 0) { perror("error starting workers"); shmBarrierAbort(barrier); break; }
+        if (pid == 0) {
+            proc = p;
+            signal(SIGCHLD, SIG_DFL);
+            prctl(PR_SET_PDEATHSIG, SIGKILL); // never outlive process 0
+            if (getppid() == 1) { _exit(1); }
+            break;
+        }
+    }
+    size_t proc_cores = pinProcess(cores, num_cores, proc, num_procs);
+    if (num_threads == 0) { num_threads = proc_cores; }
+
+    // each process loads its own bodies so their pages are placed near it
+    size_t first = proc * proc_blocks * BLOCK_SIZE < n ? proc * proc_blocks * BLOCK_SIZE : n;
+    size_t count = (first + proc_blocks * BLOCK_SIZE < n ? first + proc_blocks * BLOCK_SIZE : n) - first;
+    if (num_threads > count && count > 0) { num_threads = count; }
+    size_t offset = first/BLOCK_SIZE * 3;
+    if (count > 0) {
+        Matrix range = *input;
+        range.rows = count;
+        range.size = count * 7;
+        range.data = &MATRIX_AT(input, first, 0);
+        Masses range_masses = { masses.gm + first, 0 };
+        loadBodies(&range, &buffers[0][offset], &velocities[offset], &range_masses);
+    }
+    double* forces = (double*)arena_alloc(arena, count * 3 * sizeof(double));
+    bool ok = shmBarrierWait(barrier);
+
+    // forces of equal-mass systems are unscaled so G * mass is folded into the time step
+    double kick = masses.gm_equal ? masses.gm_equal * time_step : time_step;
+
+    // run the simulation for each time step
+    #pragma omp parallel default(none) firstprivate(buffers, velocities, masses, forces, n, first, count, offset, proc, output, opts, barrier) shared(time_step, kick, output_steps, num_steps, ok) num_threads(num_threads)
+    for (size_t step = 1; ok && step < num_steps; step++) {
+        // each step reads one copy of the positions and writes the other
+        Positions* current = buffers[(step - 1) % 2];
+        Positions* next = buffers[step % 2];
+        if (masses.gm_equal) { calculateBlockForcesEqualMass(forces, &current[offset], count, current, n, true, first, false); }
+        else { calculateBlockForces(forces, &current[offset], count, current, masses.gm, n, true, first, false); }
+        calculateVelocities(&velocities[offset], forces, count, kick);
+        calculatePositionsInto(&next[offset], &current[offset], &velocities[offset], count, time_step);
+
+        // wait for the other processes to finish the step
+        #pragma omp master
+        ok = shmBarrierWait(barrier);
+        #pragma omp barrier
+
+        // Periodically copy the positions to the output data, nothing writes
+        // to this copy of the positions until after the next barrier
+        if (proc == 0 && ok && step % output_steps == 0) {
+            #pragma omp single nowait
+            {
+                savePositions(output, step / output_steps, next, n);
+                if (opts.mmap_output) { releaseOutputRows(output, step / output_steps); }
+            }
+        }
+    }
+
+    // the workers are done
+    if (proc != 0) { _exit(ok ? 0 : 1); }
+    if (!ok) { fprintf(stderr, "a worker process failed\n"); return 1; }
+    while (wait(NULL) > 0 || errno == EINTR) { }
+    if (atomic_load(&barrier->aborted)) { fprintf(stderr, "a worker process failed\n"); return 1; }
+
+    if (num_steps % output_steps != 0) {
+        // save positions to row 'num_outputs - 1' of the output matrix
+        savePositions(output, num_outputs - 1, buffers[(num_steps - 1) % 2], n);
+    }
+
+    // get the end and computation time
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time = get_time_diff(&start, &end);
+    printf("%f secs\n", time);
+
+    // save results (a mapped output is already in the file)
+    if (opts.compress) {
+        if (!matrix_to_trajectory_path(argv[5], output, opts.precision)) { perror("error writing output"); }
+    } else if (!opts.mmap_output) {
+        matrix_to_npy_path(argv[5], output);
+    }
+
+    // cleanup
+    munmap(segment, length);
+    matrix_free(input);
+    matrix_free(output);
+    arena_free(arena);
+
+    return 0;
+}
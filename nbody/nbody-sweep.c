@@ -0,0 +1,270 @@
+/**
+ * Runs a parameter sweep of the n-body problem in 3D: one input simulated with
+ * many time steps and total times, loading the input only once.
+ *
+ * To compile the program:
+ *   gcc -Wall -fopenmp -O3 -march=native nbody-sweep.c options.c matrix.c trajectory.c util.c -o nbody-sweep -lm -lz
+ *
+ * To run the program:
+ *   ./nbody-sweep sweep.txt input.npy [opt: num-threads [opt: runs-at-once]]
+ * where:
+ *   - sweep.txt lists the runs, one per line (see below)
+ *   - input.npy is the file describing the initial state of the system (the
+ *     same as for nbody-p)
+ *   - num-threads is an optional total number of threads (a reasonable default
+ *     is chosen if not provided)
+ *   - runs-at-once is an optional number of runs done at the same time, each
+ *     with its share of the threads (1 if not provided)
+ *
+ * Each line of sweep.txt has the arguments of a single run of nbody-p:
+ *   time-step total-time outputs-per-body output.npy
+ * separated by whitespace, blank lines and lines starting with # are skipped.
+ * The output of each run is the same as nbody-p would write for it, and the
+ * options (other than the diagnostics) apply to every run.
+ *
+ * The bodies are loaded into the body store once and copied into the buffers
+ * of each run, and the buffers are allocated once for each run done at the
+ * same time and then reused by every later run. The time spent preparing and
+ * writing each run is reported next to its simulation time.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "options.h"
+#include "trajectory.h"
+
+#define BLOCK_SIZE 32
+#include "formulap.h"
+#include "formulas_small.h"
+#include "masses.h"
+#include "bodies.h"
+
+// this struct is a single run of the sweep
+typedef struct {
+    double time_step;      // number of seconds between each time point
+    size_t num_steps;      // number of time steps to simulate
+    size_t num_outputs;    // number of times the position will be output for all bodies
+    size_t output_steps;   // number of steps between each output of the position
+    char path[PATH_MAX];   // output file
+    double setup_time;     // seconds spent copying the bodies and creating the output
+    double simulate_time;  // seconds spent simulating
+    double save_time;      // seconds spent writing the output
+    bool ok;               // whether the output was written
+} Run;
+
+// this struct is the buffers used by a run, reused by the runs after it
+typedef struct {
+    Positions* positions;
+    Positions* velocities;
+    double* forces;
+} RunBuffers;
+
+// this function reads the runs from a sweep file, returning the number of runs
+// or 0 (after printing an error) if the file cannot be read or is invalid
+static size_t readSweep(const char* path, Run** runs)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) { perror("error reading sweep file"); return 0; }
+    size_t count = 0, capacity = 16, line_num = 0;
+    *runs = (Run*)malloc(capacity * sizeof(Run));
+    char line[PATH_MAX + 256];
+    while (fgets(line, sizeof(line), file))
+    {
+        line_num++;
+        char* start = line + strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == '#') { continue; }
+        if (count == capacity) { *runs = (Run*)realloc(*runs, (capacity *= 2) * sizeof(Run)); }
+        Run* run = &(*runs)[count];
+        memset(run, 0, sizeof(Run));
+        double total_time;
+        long num_outputs;
+        char extra;
+        if (sscanf(start, "%lf %lf %ld %4095s %c", &run->time_step, &total_time, &num_outputs, run->path, &extra) != 4) {
+            fprintf(stderr, "%s:%zu: expected time-step total-time outputs-per-body output.npy\n", path, line_num);
+            fclose(file); return 0;
+        }
+        if (run->time_step <= 0 || total_time <= 0 || run->time_step > total_time) { fprintf(stderr, "%s:%zu: time-step and total-time must be positive with total-time > time-step\n", path, line_num); fclose(file); return 0; }
+        if (num_outputs <= 0) { fprintf(stderr, "%s:%zu: outputs-per-body must be positive\n", path, line_num); fclose(file); return 0; }
+
+        // the same number of steps and outputs as nbody-p
+        run->num_steps = (size_t)(total_time / run->time_step + 0.5);
+        run->num_outputs = num_outputs;
+        if (run->num_steps < run->num_outputs) { run->num_outputs = 1; }
+        run->output_steps = run->num_steps/run->num_outputs;
+        run->num_outputs = (run->num_steps+run->output_steps-1)/run->output_steps;
+        count++;
+    }
+    fclose(file);
+    if (count == 0) { fprintf(stderr, "%s: no runs\n", path); }
+    return count;
+}
+
+// this function does a single run from the loaded bodies with the given buffers
+static void simulateRun(Run* run, const Matrix* input, const Positions* initial_positions, const Positions* initial_velocities,
+                        const Masses* masses, RunBuffers* buffers, const Options* opts, size_t num_threads)
+{
+    struct timespec start, simulated, saved, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t n = input->rows, store_size = (n + BLOCK_SIZE - 1) / BLOCK_SIZE * 3 * sizeof(Positions);
+    size_t num_steps = run->num_steps, output_steps = run->output_steps, num_outputs = run->num_outputs;
+    double time_step = run->time_step;
+
+    // start from the loaded bodies
+    Positions* positions = buffers->positions;
+    Positions* velocities = buffers->velocities;
+    double* forces = buffers->forces;
+    memcpy(positions, initial_positions, store_size);
+    memcpy(velocities, initial_velocities, store_size);
+
+    // create the output matrix, either in memory or directly in the output file
+    Matrix* output = opts->mmap_output ? matrix_create_npy_path(run->path, num_outputs, 3*n) : matrix_create_raw(num_outputs, 3*n);
+    if (output == NULL) { perror(run->path); return; }
+
+    // save positions to row `0` of output
+    for (size_t i = 0; i < n; i++) {
+        MATRIX_AT(output, 0, i * 3 + 0) = MATRIX_AT(input, i, 1);
+        MATRIX_AT(output, 0, i * 3 + 1) = MATRIX_AT(input, i, 2);
+        MATRIX_AT(output, 0, i * 3 + 2) = MATRIX_AT(input, i, 3);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &simulated);
+
+    // forces of equal-mass systems are unscaled so G * mass is folded into the time step
+    double kick = masses->gm_equal ? masses->gm_equal * time_step : time_step;
+    bool mmap_output = opts->mmap_output;
+
+    if (n <= SMALL_N_MAX) {
+        // tiny systems run entirely in registers with a kernel specialised for
+        // n, a sweep does not stop early on a signal
+        StopPoint stop;
+        stop_init(&stop, num_steps);
+        simulateSmall(input, output, num_steps, output_steps, time_step, &stop);
+    } else {
+        // run the simulation for each time step
+        #pragma omp parallel default(none) firstprivate(positions, velocities, masses, forces, n, output, mmap_output) shared(time_step, kick, output_steps, num_steps) num_threads(num_threads)
+        for (size_t step = 1; step < num_steps; step++) {
+            calculateStepForces(forces, NULL, positions, masses, n);
+            calculateVelocities(velocities, forces, n, kick);
+            calculatePositions(positions, velocities, n, time_step);
+
+            // Periodically copy the positions to the output data
+            if (step % output_steps == 0) {
+                #pragma omp single nowait
+                {
+                    savePositions(output, step / output_steps, positions, n);
+                    if (mmap_output) { releaseOutputRows(output, step / output_steps); }
+                }
+            }
+        }
+
+        if (num_steps % output_steps != 0) {
+            // save positions to row 'num_outputs - 1' of the output matrix
+            savePositions(output, num_outputs - 1, positions, n);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &saved);
+
+    // save results (a mapped output is already in the file)
+    run->ok = true;
+    if (opts->compress) {
+        if (!matrix_to_trajectory_path(run->path, output, opts->precision)) { perror(run->path); run->ok = false; }
+    } else if (!opts->mmap_output) {
+        if (!matrix_to_npy_path(run->path, output)) { perror(run->path); run->ok = false; }
+    }
+    matrix_free(output);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    run->setup_time = get_time_diff(&start, &simulated);
+    run->simulate_time = get_time_diff(&simulated, &saved);
+    run->save_time = get_time_diff(&saved, &end);
+}
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    Options opts;
+    if (!parse_options(&argc, argv, &opts)) { return 1; }
+    if (argc < 3 || argc > 5) { fprintf(stderr, "usage: %s [options] sweep.txt input.npy [num-threads [runs-at-once]]\n", argv[0]); print_options(stderr); return 1; }
+    if (opts.velocities_path || opts.energy_path || opts.angular_momentum_path || opts.center_of_mass_path || opts.tlb_stats ||
+        opts.checkpoint_path || opts.track || opts.region || opts.every || opts.progress > 0 || opts.progress_path ||
+        opts.autotune || opts.tuning_path) {
+        fprintf(stderr, "--velocities, --energy, --angular-momentum, --center-of-mass, --tlb-stats, --checkpoint, --track, --region, --every, --progress, --progress-file, --autotune, and --tuning are not supported by %s\n", argv[0]);
+        return 1;
+    }
+    size_t num_threads = argc >= 4 ? atoi(argv[3]) : get_num_cores_affinity()/2;
+    if (argc >= 4 && num_threads <= 0) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
+    if (num_threads == 0) { num_threads = 1; }
+    size_t runs_at_once = argc == 5 ? atoi(argv[4]) : 1;
+    if (runs_at_once <= 0) { fprintf(stderr, "runs-at-once must be positive\n"); return 1; }
+    Run* runs;
+    size_t num_runs = readSweep(argv[1], &runs);
+    if (num_runs == 0) { return 1; }
+    if (runs_at_once > num_runs) { runs_at_once = num_runs; }
+    if (runs_at_once > num_threads) { runs_at_once = num_threads; }
+
+    // start the clock
+    struct timespec start, loaded, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // load the bodies once
+    Matrix* input = matrix_from_npy_readonly_path(argv[2]);
+    if (input == NULL) { perror("error reading input"); return 1; }
+    if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); return 1; }
+    size_t n = input->rows;
+    if (n == 0) { fprintf(stderr, "input.npy must have at least 1 row\n"); return 1; }
+    Arena* arena = arena_create_huge(opts.hugepages);
+    Positions* positions = createBodyStore(arena, n);
+    Positions* velocities = createBodyStore(arena, n);
+    Masses masses = createMasses(arena, n);
+    loadBodies(input, positions, velocities, &masses);
+
+    // the buffers for each of the runs done at the same time
+    size_t run_threads = num_threads / runs_at_once;
+    if (run_threads > n) { run_threads = n; }
+    RunBuffers* buffers = (RunBuffers*)arena_alloc(arena, runs_at_once * sizeof(RunBuffers));
+    for (size_t i = 0; i < runs_at_once; i++) {
+        buffers[i].positions = createBodyStore(arena, n);
+        buffers[i].velocities = createBodyStore(arena, n);
+        buffers[i].forces = (double*)arena_alloc(arena, n * 3 * sizeof(double));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &loaded);
+
+    // the runs are handed out to the outer threads, each running its own team
+    if (runs_at_once > 1) { omp_set_max_active_levels(2); }
+    #pragma omp parallel for schedule(dynamic, 1) default(none) shared(runs, num_runs, input, positions, velocities, masses, buffers, opts, run_threads) num_threads(runs_at_once)
+    for (size_t i = 0; i < num_runs; i++) {
+        simulateRun(&runs[i], input, positions, velocities, &masses, &buffers[omp_get_thread_num()], &opts, run_threads);
+    }
+
+    // get the end and computation time
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // report the time of each run
+    bool ok = true;
+    double overhead = 0;
+    printf("%-4s %12s %12s %10s %10s %12s %10s  %s\n", "run", "time-step", "steps", "outputs", "setup s", "simulate s", "save s", "output");
+    for (size_t i = 0; i < num_runs; i++) {
+        Run* run = &runs[i];
+        printf("%-4zu %12g %12zu %10zu %10.6f %12.6f %10.6f  %s%s\n", i + 1, run->time_step, run->num_steps, run->num_outputs,
+               run->setup_time, run->simulate_time, run->save_time, run->path, run->ok ? "" : " (failed)");
+        overhead += run->setup_time + run->save_time;
+        ok &= run->ok;
+    }
+    printf("loaded %zu bodies once in %f secs, per-run overhead %f secs on average\n", n, get_time_diff(&start, &loaded), overhead / num_runs);
+    printf("%f secs\n", get_time_diff(&start, &end));
+
+    // cleanup
+    free(runs);
+    matrix_free(input);
+    arena_free(arena);
+
+    return ok ? 0 : 1;
+}
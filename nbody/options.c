@@ -0,0 +1,149 @@
+/**
+ * Command-line options shared by all of the nbody programs.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "options.h"
+
+#define OPT_FLAG   1 // a bool set to true when the option is given, takes no value
+#define OPT_STRING 2 // a const char* pointing into argv
+#define OPT_DOUBLE 3 // a double
+#define OPT_SIZE   4 // a size_t
+#define OPT_CHOICE 5 // an int set to the index of the value in choices
+
+typedef struct {
+    const char* name;
+    char kind;     // one of the OPT_* values
+    size_t offset; // offset of the field in Options
+    const char* arg; // name of the value shown in the help, NULL for flags
+    const char* help;
+    const char* const* choices; // the allowed values of an OPT_CHOICE, ending with NULL
+    const char* implicit; // value used when the option is given without one, NULL if it is required
+} OptionInfo;
+
+static const char* const hugepages_choices[] = { "off", "thp", "explicit", NULL };
+
+static const OptionInfo option_info[] = {
+    { "mmap-output", OPT_FLAG, offsetof(Options, mmap_output), NULL,
+      "preallocate output.npy and write rows directly into a mapping of it" },
+    { "compress", OPT_FLAG, offsetof(Options, compress), NULL,
+      "write the output as a compressed trajectory (see scripts/trajectory.py)" },
+    { "precision", OPT_DOUBLE, offsetof(Options, precision), "value",
+      "round compressed positions to this absolute precision (default: lossless)" },
+    { "velocities", OPT_STRING, offsetof(Options, velocities_path), "path",
+      "also save the velocities of each output row to this npy file" },
+    { "energy", OPT_STRING, offsetof(Options, energy_path), "path",
+      "also save the kinetic, potential, and total energy of each output row" },
+    { "angular-momentum", OPT_STRING, offsetof(Options, angular_momentum_path), "path",
+      "also save the total angular momentum of each output row" },
+    { "center-of-mass", OPT_STRING, offsetof(Options, center_of_mass_path), "path",
+      "also save the center of mass position and velocity of each output row" },
+    { "hugepages", OPT_CHOICE, offsetof(Options, hugepages), "off|thp|explicit",
+      "back the body store and output with 2 MiB pages: transparent or reserved (default: off)",
+      hugepages_choices },
+    { "tlb-stats", OPT_FLAG, offsetof(Options, tlb_stats), NULL,
+      "report the dTLB misses of the simulation and the memory in huge pages" },
+    { "deterministic", OPT_FLAG, offsetof(Options, deterministic), NULL,
+      "give the same output for any number of threads (nbody-p3, the others always do)" },
+    { "autotune", OPT_FLAG, offsetof(Options, autotune), NULL,
+      "time the force kernel settings on this machine and save the fastest (nbody-p, nbody-p3)" },
+    { "tuning", OPT_STRING, offsetof(Options, tuning_path), "path",
+      "file of the tuned settings used at startup, or off (default: ~/.nbody-tuning)" },
+    { "progress", OPT_DOUBLE, offsetof(Options, progress), "secs",
+      "report the progress to stderr every secs seconds (default: 10) (s, s3, p, p3)", NULL, "10" },
+    { "progress-file", OPT_STRING, offsetof(Options, progress_path), "path",
+      "append the progress reports to this file as JSON lines instead" },
+    { "checkpoint", OPT_STRING, offsetof(Options, checkpoint_path), "path",
+      "save the state of the bodies at the end (or when stopped) as an input file" },
+    { "track", OPT_STRING, offsetof(Options, track), "ids",
+      "only save the positions of these bodies, like 0,3,10-19 (s, s3, p, p3)" },
+    { "region", OPT_STRING, offsetof(Options, region), "box",
+      "only save the bodies in xmin,ymin,zmin,xmax,ymax,zmax, as [row, body, x, y, z]" },
+    { "every", OPT_SIZE, offsetof(Options, every), "k",
+      "only save the positions of every k-th output row and the last (s, s3, p, p3)" },
+};
+#define NUM_OPTIONS (sizeof(option_info) / sizeof(option_info[0]))
+
+/**
+ * Sets a single option from its value (NULL if there was no =value).
+ */
+static bool set_option(const OptionInfo* info, const char* value, Options* opts) {
+    void* field = ((char*)opts) + info->offset;
+    if (!value) { value = info->implicit; }
+    char* end = (char*)value;
+    if (info->kind == OPT_FLAG) {
+        if (value) { fprintf(stderr, "--%s does not take a value\n", info->name); return false; }
+        *(bool*)field = true;
+        return true;
+    }
+    if (!value || !*value) { fprintf(stderr, "--%s requires a value\n", info->name); return false; }
+    switch (info->kind) {
+    case OPT_STRING: *(const char**)field = value; return true;
+    case OPT_DOUBLE: *(double*)field = strtod(value, &end); break;
+    case OPT_SIZE:   // strtoull would wrap a negative value around
+        if (*value != '-') { *(size_t*)field = strtoull(value, &end, 10); }
+        break;
+    case OPT_CHOICE:
+        for (int i = 0; info->choices[i]; i++) {
+            if (strcmp(info->choices[i], value) == 0) { *(int*)field = i; return true; }
+        }
+        break;
+    }
+    if (*end) { fprintf(stderr, "--%s has an invalid value: %s\n", info->name, value); return false; }
+    return true;
+}
+
+/**
+ * Parses and removes all of the options from argv, leaving only the program
+ * name and the positional arguments (argc is updated).
+ */
+bool parse_options(int* argc, const char* argv[], Options* opts) {
+    memset(opts, 0, sizeof(Options));
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0 || arg[2] == 0) { argv[out++] = arg; continue; }
+        arg += 2;
+        const char* value = strchr(arg, '=');
+        size_t len = value ? (size_t)(value - arg) : strlen(arg);
+        const OptionInfo* info = NULL;
+        for (size_t j = 0; j < NUM_OPTIONS; j++) {
+            if (strlen(option_info[j].name) == len && strncmp(option_info[j].name, arg, len) == 0) {
+                info = &option_info[j];
+                break;
+            }
+        }
+        if (!info) { fprintf(stderr, "unknown option: %s\n", argv[i]); return false; }
+        if (!set_option(info, value ? value + 1 : NULL, opts)) { return false; }
+    }
+    *argc = out;
+    argv[out] = NULL;
+
+    // check the combinations of options
+    if (opts->compress && opts->mmap_output) { fprintf(stderr, "--compress cannot be used with --mmap-output\n"); return false; }
+    if (opts->progress < 0) { fprintf(stderr, "--progress must not be negative\n"); return false; }
+    if (opts->precision < 0) { fprintf(stderr, "--precision must not be negative\n"); return false; }
+    if (opts->precision && !opts->compress) { fprintf(stderr, "--precision requires --compress\n"); return false; }
+    if (opts->region && opts->mmap_output) { fprintf(stderr, "--region cannot be used with --mmap-output\n"); return false; }
+    if (opts->region && opts->precision) { fprintf(stderr, "--region cannot be used with --precision\n"); return false; }
+    if (opts->autotune && opts->tuning_path && strcmp(opts->tuning_path, "off") == 0) { fprintf(stderr, "--autotune cannot be used with --tuning=off\n"); return false; }
+    return true;
+}
+
+/**
+ * Prints a description of every option, used after the usage line.
+ */
+void print_options(FILE* file) {
+    fprintf(file, "options:\n");
+    for (size_t i = 0; i < NUM_OPTIONS; i++) {
+        const OptionInfo* info = &option_info[i];
+        char name[64];
+        snprintf(name, sizeof(name), "--%s%s%s%s%s", info->name, info->implicit ? "[" : "",
+                 info->arg ? "=" : "", info->arg ? info->arg : "", info->implicit ? "]" : "");
+        fprintf(file, "  %-29s %s\n", name, info->help);
+    }
+}
@@ -0,0 +1,51 @@
+/**
+ * Command-line options shared by all of the nbody programs. Options are given
+ * as --name or --name=value anywhere on the command line, the positional
+ * arguments are left for each program to parse.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+
+// values of --hugepages, the same as the ARENA_PAGES_* values of arena.h
+#define HUGEPAGES_OFF      0
+#define HUGEPAGES_THP      1
+#define HUGEPAGES_EXPLICIT 2
+
+typedef struct {
+    bool mmap_output; // --mmap-output: write the output directly into a mapped file
+    bool compress;    // --compress: write the output as a compressed trajectory
+    double precision; // --precision: absolute precision of compressed values, 0 for lossless
+    const char* velocities_path;       // --velocities: npy file for the velocities of each output row
+    const char* energy_path;           // --energy: npy file for the kinetic, potential, and total energy
+    const char* angular_momentum_path; // --angular-momentum: npy file for the total angular momentum
+    const char* center_of_mass_path;   // --center-of-mass: npy file for the center of mass position and velocity
+    int hugepages;    // --hugepages: kind of pages for the body store and output, one of the HUGEPAGES_* values
+    bool tlb_stats;   // --tlb-stats: count the dTLB misses of the simulation and report them
+    bool deterministic; // --deterministic: add the forces in an order that does not depend on the number of threads
+    bool autotune;    // --autotune: find the fastest settings of the force kernel and save them
+    const char* tuning_path; // --tuning: file of the tuned settings, "off" to not use one
+    double progress;  // --progress: seconds between progress reports, 0 for none
+    const char* progress_path; // --progress-file: file the progress reports are appended to as JSON lines
+    const char* checkpoint_path; // --checkpoint: npy file for the state of the bodies at the end, in the input format
+    const char* track;  // --track: list of the bodies saved in the output, like 0,3,10-19
+    const char* region; // --region: box the bodies saved in the output are in, as xmin,ymin,zmin,xmax,ymax,zmax
+    size_t every;       // --every: only every this many output rows of positions are saved, 0 for all
+} Options;
+
+
+/**
+ * Parses and removes all of the options from argv, leaving only the program
+ * name and the positional arguments (argc is updated). Options that are not
+ * given are set to their defaults. If an option is not recognized or has a bad
+ * value, an error is printed and false is returned.
+ */
+bool parse_options(int* argc, const char* argv[], Options* opts);
+
+/**
+ * Prints a description of every option, used after the usage line.
+ */
+void print_options(FILE* file);
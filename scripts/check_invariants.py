@@ -0,0 +1,64 @@
+#!/usr/bin/bash python3
+"""Checks that the energy, momentum, and angular momentum saved by the n-body
+programs (with --energy, --center-of-mass, and --angular-momentum) stay close
+to their initial values. Several runs can be checked at once by giving the 3
+files of each run."""
+
+import sys
+import argparse
+
+import numpy
+
+
+def __drift(values, relative):
+    """The largest distance of the rows of values from the first row, relative
+    to the size of the first row if requested"""
+    values = values.reshape(values.shape[0], -1)
+    drift = numpy.linalg.norm(values - values[0], axis=1).max()
+    if relative:
+        size = numpy.linalg.norm(values[0])
+        drift = drift / size if size else numpy.inf if drift else 0.0
+    return drift
+
+
+def main():
+    # Setup argument parser
+    parser = argparse.ArgumentParser(description='Checks that the energy, momentum, and angular momentum of an n-body run are conserved')
+    parser.add_argument('files', nargs='+', metavar='energy.npy center-of-mass.npy angular-momentum.npy',
+                        help='files saved with --energy, --center-of-mass, and --angular-momentum by each run')
+    parser.add_argument('--energy', type=float, help='largest allowed change of the total energy, relative to the initial energy')
+    parser.add_argument('--momentum', type=float, help='largest allowed change of the center of mass velocity (which is the momentum over the total mass), in m/s')
+    parser.add_argument('--angular-momentum', type=float, help='largest allowed change of the angular momentum, relative to the initial angular momentum')
+
+    # Parse the command-line arguments
+    args = parser.parse_args()
+
+    if len(args.files) % 3 != 0: parser.error('3 files are needed for each run')
+
+    failed = False
+    for i in range(0, len(args.files), 3):
+        # Load the data and measure the changes
+        energy_path, center_of_mass_path, angular_momentum_path = args.files[i:i+3]
+        energy = numpy.load(energy_path)
+        center_of_mass = numpy.load(center_of_mass_path)
+        angular_momentum = numpy.load(angular_momentum_path)
+        checks = (
+            ('energy', __drift(energy[:,2], True), args.energy),
+            ('momentum', __drift(center_of_mass[:,3:], False), args.momentum),
+            ('angular momentum', __drift(angular_momentum, True), args.angular_momentum),
+        )
+
+        # Check the changes against the bounds
+        for name, drift, bound in checks:
+            if bound is None:
+                print("%s: %s drift %.3g" % (energy_path, name, drift))
+            elif drift <= bound:
+                print("%s: %s drift %.3g <= %.3g" % (energy_path, name, drift, bound))
+            else:
+                print("%s: %s drift %.3g > %.3g" % (energy_path, name, drift, bound))
+                failed = True
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
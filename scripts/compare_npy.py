@@ -6,12 +6,14 @@ import argparse
 
 import numpy
 
+import trajectory
+
 
 def main():
     # Setup argument parser
     parser = argparse.ArgumentParser(description='Compares 2 npy files to make sure that they are (almost) equal')
-    parser.add_argument('a.npy', type=argparse.FileType('rb'), help='first file to compare')
-    parser.add_argument('b.npy', type=argparse.FileType('rb'), help='second file to compare')
+    parser.add_argument('a.npy', type=argparse.FileType('rb'), help='first file to compare (npy or compressed trajectory)')
+    parser.add_argument('b.npy', type=argparse.FileType('rb'), help='second file to compare (npy or compressed trajectory)')
     parser.add_argument('--exact', action='store_true', help='must be exactly equal instead of close')
     parser.add_argument('--abs-tol', type=float, help='absolute tolerance when measuring closeness (default=1e-8)', default=1e-8)
     parser.add_argument('--rel-tol', type=float, help='relative tolerance when measuring closeness (default=1e-5)', default=1e-5)
@@ -20,8 +22,8 @@ def main():
     args = parser.parse_args()
 
     # Load the matrices
-    a = numpy.load(getattr(args, 'a.npy'))
-    b = numpy.load(getattr(args, 'b.npy'))
+    a = trajectory.load(getattr(args, 'a.npy'))
+    b = trajectory.load(getattr(args, 'b.npy'))
 
     # Check matrices
     if a.shape != b.shape:
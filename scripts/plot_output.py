@@ -1,11 +1,17 @@
 #!/usr/bin/bash python3
 """Plots the output of the n-body program over time."""
 
+import os
 import sys
+import shutil
 import argparse
+import tempfile
+import subprocess
 
 import numpy
 
+import trajectory
+
 from mpl_toolkits.mplot3d import Axes3D
 import matplotlib.pyplot as plt
 
@@ -16,22 +22,99 @@ def __die(msg):
     sys.exit(1)
 
 
+def __find_decimator():
+    """Finds the decimate-npy program in the current directory or on the PATH"""
+    if os.access('./decimate-npy', os.X_OK): return './decimate-npy'
+    return shutil.which('decimate-npy')
+
+
+def __npy_shape(f):
+    """Reads the shape of a npy file without loading it, None if it is not one"""
+    try:
+        version = numpy.lib.format.read_magic(f)
+        if version == (1, 0): shape = numpy.lib.format.read_array_header_1_0(f)[0]
+        else: shape = numpy.lib.format.read_array_header_2_0(f)[0]
+    except ValueError:
+        shape = None
+    f.seek(0)
+    return shape
+
+
+def __decimate(decimator, path, skip, bodies, bbox):
+    """Reads every skip-th frame of the selected bodies with decimate-npy, which
+    only reads those parts of the file"""
+    with tempfile.TemporaryDirectory() as tmp:
+        preview = os.path.join(tmp, 'preview.npy')
+        cmd = [decimator, '--every=%d' % skip]
+        if bodies: cmd.append('--bodies=' + bodies)
+        if bbox: cmd.append('--bbox=' + bbox)
+        if subprocess.run(cmd + [path, preview], stdout=subprocess.DEVNULL).returncode != 0:
+            __die("decimate-npy failed")
+        return numpy.load(preview)
+
+
+def __parse_bodies(bodies, n):
+    """Parses a list of bodies like 0-9,42 into their indices"""
+    indices = []
+    for part in bodies.split(','):
+        first, _, last = part.partition('-')
+        indices.extend(range(int(first), int(last or first) + 1))
+    if not indices or min(indices) < 0 or max(indices) >= n: __die("bodies out of range: " + bodies)
+    return sorted(set(indices))
+
+
+def __select(data, skip, bodies, bbox):
+    """Selects every skip-th frame and the bodies from loaded data, the same as
+    decimate-npy does"""
+    n = data.shape[1] // 3
+    data = data[::skip].reshape(-1, n, 3)
+    if bodies: data = data[:, __parse_bodies(bodies, n)]
+    if bbox:
+        box = numpy.array([float(x) for x in bbox.split(',')])
+        if len(box) != 6: __die("invalid box: " + bbox)
+        inside = ((data >= box[:3]) & (data <= box[3:])).all(axis=2).any(axis=0)
+        data = data[:, inside]
+    return data.reshape(data.shape[0], -1)
+
+
 def main():
     # Setup argument parser
     parser = argparse.ArgumentParser(description='Plots the output of the n-body program over time')
-    parser.add_argument('data.npy', type=argparse.FileType('rb'), help='file with the output data to plot')
+    parser.add_argument('data.npy', type=argparse.FileType('rb'), help='file with the output data to plot (npy or compressed trajectory)')
     parser.add_argument('--max-points', type=int, default=100000, help='maximum number of points to plot to speed up rendering, default is 100000')
     parser.add_argument('--same-size', action='store_true', help='all bodies are plotted as the same size, regardless of mass')
     parser.add_argument('--solid-color', action='store_true', help='draw in solid colors instead of gradients')
+    parser.add_argument('--bodies', help='only plot these bodies, a list of indices and ranges like 0-9,42')
+    parser.add_argument('--bbox', help='only plot the bodies inside the box x0,y0,z0,x1,y1,z1 at some point')
+    parser.add_argument('--decimate-npy', default=__find_decimator(), help='path of the decimate-npy program (tools/decimate-npy.c), used to read only the plotted points of npy files; without it the whole file is loaded (default: ./decimate-npy or on the PATH)')
 
     # Parse the command-line arguments
     args = parser.parse_args()
 
-    # Load the data file and reorganize the data
-    data = numpy.load(getattr(args, 'data.npy'))
-    if data.shape[1] % 3 != 0: __die("data file doesn't have 3 values per body")
-    num_steps, n = data.shape[0], data.shape[1] // 3
-    data = data.reshape(num_steps, n, 3)
+    # Find the shape of the data without loading it (trajectories are loaded)
+    file, data = getattr(args, 'data.npy'), None
+    shape = __npy_shape(file)
+    if shape is None or len(shape) != 2:
+        data = trajectory.load(file)
+        shape = data.shape
+    if shape[1] % 3 != 0: __die("data file doesn't have 3 values per body")
+    num_steps, n = shape[0], shape[1] // 3
+    if args.bodies: n = len(__parse_bodies(args.bodies, n))
+
+    # Number of points to display per body
+    points_per_body = (args.max_points + n - 1) // n
+    # Number of data points to skip per body
+    skip = max((num_steps + points_per_body - 1) // points_per_body, 1)
+
+    # Load only the points to plot and reorganize the data
+    if data is None and args.decimate_npy:
+        data = __decimate(args.decimate_npy, file.name, skip, args.bodies, args.bbox)
+    else:
+        if data is None: data = trajectory.load(file)
+        data = __select(data, skip, args.bodies, args.bbox)
+    if data.shape[1] == 0: __die("no bodies selected")
+    n = data.shape[1] // 3
+    data = data.reshape(data.shape[0], n, 3)
 
     # Create the 3D plotting figure
     fig = plt.figure()
@@ -43,11 +126,6 @@ def main():
         ax.yaxis.set_pane_color((0.15, 0.15, 0.15, 1.0))
         ax.zaxis.set_pane_color((0.15, 0.15, 0.15, 1.0))
 
-    # Number of points to display per body
-    points_per_body = (args.max_points + n - 1) // n
-    # Number of data points to skip per body
-    skip = max((num_steps + points_per_body - 1) // points_per_body, 1)
-
     # Setup the scatter line parameters depending on the command line arguments
     kwargs = {'s': 1}
     if not args.solid_color:
@@ -57,7 +135,7 @@ def main():
 
     # Plot each body's trajectory
     for i in range(n):
-        ax.scatter(data[::skip,i,0], data[::skip,i,1], data[::skip,i,2], **kwargs)
+        ax.scatter(data[:,i,0], data[:,i,1], data[:,i,2], **kwargs)
     
     # Set aspect ratio to 1
     #ax.set_aspect(1) # doesn't work with 3d plots
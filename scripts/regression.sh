@@ -0,0 +1,188 @@
+#!/usr/bin/bash
+
+# Regression tests: runs every program on the example inputs and checks that
+#   - the output is close to the expected output in examples/
+#   - the energy, momentum, and angular momentum are conserved (s, s3, p, p3)
+#   - the parallel programs give the same output for every thread count
+#     (exactly for the ones that are meant to be deterministic)
+#   - nbody-p3 loses no forces to a data race between its threads: its output
+#     for a system of heavy bodies that pull hard on each other (which the
+#     example systems do not) must match --deterministic to within rounding
+#   - nbody-shm fails, instead of hanging, when one of its processes dies
+#
+# Usage: scripts/regression.sh [bin-dir]
+#
+# bin-dir holds the compiled programs (default: the current directory). It must
+# have nbody-s, nbody-s3, nbody-p, nbody-p3, and the compare-npy and decimate-npy
+# tools. nbody-shm, nbody-sweep, and nbody-mpi (with mpirun) are tested when
+# they are there. THREADS sets the thread counts tried (default "1 2 4") and
+# EXAMPLES the directory of inputs (default examples/ next to this script).
+# Exits with 1 if any check fails. It takes about 30 seconds on a single core.
+
+BIN="${1:-.}"
+THREADS="${THREADS:-1 2 4}"
+SCRIPTS="$(cd "$(dirname "$0")" && pwd)"
+EXAMPLES="${EXAMPLES:-$SCRIPTS/../examples}"
+TMP="$(mktemp -d)"
+trap 'rm -rf "$TMP"' EXIT
+
+# programs whose output must not depend on the number of threads or processes,
+# a program:option is the program run with --option
+DETERMINISTIC="nbody-p nbody-p3:deterministic nbody-shm nbody-sweep"
+
+# input, time-step, total-time, outputs-per-body, expected output, and the
+# largest allowed drift of the energy (relative), center of mass velocity (m/s),
+# and angular momentum (relative), or - to not check one
+#
+# random25-expected.npy slowly moves away from the output of every version of
+# these programs after its 63rd frame, so only its first 60 frames are checked
+CASES="
+sun-earth           60      31557600  1000  sun-earth-expected.npy             1e-5  1e-12  1e-12
+solar-system        60      31557600  1000  solar-system-expected-1-year.npy   1e-6  1e-10  1e-12
+solar-system-inner  60      31557600  1000  solar-system-inner-expected.npy    1e-5  1e-12  1e-12
+pluto-charon        1       302400    1000  pluto-charon-expected.npy          1e-4  1e-10  1e-12
+figure8             0.0001  2.1       1000  figure8-expected.npy               1e-3  1e-12  -
+figure8-rotate      0.0001  75        1000  figure8-rotate-expected.npy        1e-3  1e-12  1e-12
+random25            1       30000     60    random25-expected.npy              1e-5  1e-15  -
+random100           1       1000      1000  random100-expected.npy             1e-7  1e-15  1e-12
+"
+
+for PROG in nbody-s nbody-s3 nbody-p nbody-p3 compare-npy decimate-npy; do
+    if [ ! -x "$BIN/$PROG" ]; then echo "missing $BIN/$PROG" >&2; exit 2; fi
+done
+OPTIONAL=""
+for PROG in nbody-shm nbody-sweep; do
+    if [ -x "$BIN/$PROG" ]; then OPTIONAL="$OPTIONAL $PROG"; else echo "skipping $PROG (not built)"; fi
+done
+if [ -x "$BIN/nbody-mpi" ] && command -v mpirun > /dev/null; then OPTIONAL="$OPTIONAL nbody-mpi"; else echo "skipping nbody-mpi (not built or no mpirun)"; fi
+
+PASSED=0
+FAILED=0
+
+# check NAME COMMAND...: runs a check and reports it, showing its output if it fails
+check() {
+    local NAME="$1"; shift
+    if "$@" > "$TMP/check.log" 2>&1; then
+        PASSED=$((PASSED+1))
+    else
+        FAILED=$((FAILED+1))
+        echo "FAIL $NAME"
+        sed 's/^/    /' "$TMP/check.log"
+        return 1
+    fi
+}
+
+# expected OUTPUT GOLDEN: the expected output with as many frames as OUTPUT
+expected() {
+    local ROWS=$(head -c 128 "$1" | grep -ao "'shape': ([0-9]*" | grep -o "[0-9]*$")
+    "$BIN/decimate-npy" --last="$ROWS" "$EXAMPLES/$2" "$TMP/expected.npy" 1 > /dev/null
+    echo "$TMP/expected.npy"
+}
+
+# run PROG THREADS OUTPUT [options] ARGS...: runs a program (or program:option)
+# with a thread count (or number of processes) and the usual arguments
+run() {
+    local PROG="${1%%:*}" OPTION="${1#*:}" N="$2" OUT="$3"; shift 3
+    local ARGS=("$@") NA=${#ARGS[@]}
+    local DT="${ARGS[NA-4]}" T="${ARGS[NA-3]}" OUTPUTS="${ARGS[NA-2]}" INPUT="${ARGS[NA-1]}"
+    local OPTS=("${ARGS[@]:0:NA-4}")
+    [ "$OPTION" != "$PROG" ] && OPTS+=(--"$OPTION")
+    case "$PROG" in
+    nbody-s|nbody-s3) "$BIN/$PROG" "${OPTS[@]}" "$DT" "$T" "$OUTPUTS" "$INPUT" "$OUT" ;;
+    nbody-shm) "$BIN/$PROG" "${OPTS[@]}" "$DT" "$T" "$OUTPUTS" "$INPUT" "$OUT" "$N" 1 ;;
+    nbody-mpi) mpirun --oversubscribe -np "$N" "$BIN/$PROG" "${OPTS[@]}" "$DT" "$T" "$OUTPUTS" "$INPUT" "$OUT" 1 < /dev/null ;;
+    nbody-sweep)
+        echo "$DT $T $OUTPUTS $OUT" > "$TMP/sweep.txt"
+        "$BIN/$PROG" "${OPTS[@]}" "$TMP/sweep.txt" "$INPUT" "$N" ;;
+    *) "$BIN/$PROG" "${OPTS[@]}" "$DT" "$T" "$OUTPUTS" "$INPUT" "$OUT" "$N" ;;
+    esac
+}
+
+# compare_runs PROG NAME OUTPUT REFERENCE: compares the outputs of two thread
+# counts, exactly if the program is deterministic
+compare_runs() {
+    if [[ " $DETERMINISTIC " == *" $1 "* ]]; then "$BIN/compare-npy" --exact "$3" "$4" 1
+    else "$BIN/compare-npy" "$3" "$4" 1; fi
+}
+
+while read NAME DT T OUTPUTS GOLDEN ENERGY MOMENTUM ANGULAR; do
+    [ -z "$NAME" ] && continue
+    INPUT="$EXAMPLES/$NAME.npy"
+    DIAGS=()
+    for PROG in nbody-s nbody-s3 nbody-p nbody-p3 nbody-p3:deterministic $OPTIONAL; do
+        case "$PROG" in nbody-s|nbody-s3) COUNTS=1 ;; nbody-shm|nbody-mpi) COUNTS="1 2" ;; *) COUNTS="$THREADS" ;; esac
+
+        # the expected output at each thread count, and the same output for all
+        FIRST=""
+        for N in $COUNTS; do
+            OUT="$TMP/$PROG-$N.npy"
+            check "$PROG $NAME (run, $N)" run "$PROG" "$N" "$OUT" "$DT" "$T" "$OUTPUTS" "$INPUT" || continue
+            [ -f "$OUT" ] || continue
+            check "$PROG $NAME (expected output, $N)" "$BIN/compare-npy" "$OUT" "$(expected "$OUT" "$GOLDEN")" 1
+            if [ -z "$FIRST" ]; then FIRST="$N"
+            else check "$PROG $NAME (same output for $FIRST and $N)" compare_runs "$PROG" "$NAME" "$OUT" "$TMP/$PROG-$FIRST.npy"; fi
+        done
+
+        # conservation laws, which also covers the general kernels for small systems
+        case "$PROG" in nbody-s|nbody-s3|nbody-p|nbody-p3) ;; *) continue ;; esac
+        OUT="$TMP/$PROG-diag.npy" DIAG="$TMP/$PROG"
+        check "$PROG $NAME (run with diagnostics)" run "$PROG" "${THREADS%% *}" "$OUT" \
+            --energy="$DIAG-energy.npy" --center-of-mass="$DIAG-com.npy" --angular-momentum="$DIAG-am.npy" \
+            "$DT" "$T" "$OUTPUTS" "$INPUT" || continue
+        check "$PROG $NAME (expected output with diagnostics)" "$BIN/compare-npy" "$OUT" "$(expected "$OUT" "$GOLDEN")" 1
+        DIAGS+=("$DIAG-energy.npy" "$DIAG-com.npy" "$DIAG-am.npy")
+    done
+
+    # the conservation laws of all of the programs at once (numpy is slow to load)
+    BOUNDS=()
+    [ "$ENERGY" != "-" ] && BOUNDS+=(--energy="$ENERGY")
+    [ "$MOMENTUM" != "-" ] && BOUNDS+=(--momentum="$MOMENTUM")
+    [ "$ANGULAR" != "-" ] && BOUNDS+=(--angular-momentum="$ANGULAR")
+    [ ${#DIAGS[@]} -gt 0 ] && check "$NAME (conservation)" python3 "$SCRIPTS/check_invariants.py" "${BOUNDS[@]}" "${DIAGS[@]}"
+    echo "$NAME: $PASSED passed, $FAILED failed so far"
+done <<< "$CASES"
+
+# the stress system: 2000 bodies of 1e26 to 1e28 kg in a cube 2e11 m wide. A
+# force lost by a race moves its body by far more than the 1e-9 relative
+# tolerance within the 100 steps, and the different order of the sums does not
+python3 -c "
+import sys, numpy
+rng = numpy.random.default_rng(1)
+n = 2000
+mass = 10**rng.uniform(26, 28, n)
+numpy.save(sys.argv[1], numpy.column_stack([mass, rng.uniform(-1e11, 1e11, (n, 3)), rng.normal(0, 1e3, (n, 3))]))
+" "$TMP/stress.npy"
+STRESS=(3600 360000 10 "$TMP/stress.npy")
+if check "nbody-p3:deterministic stress (run)" run nbody-p3:deterministic 1 "$TMP/stress-reference.npy" "${STRESS[@]}"; then
+    for N in $THREADS; do
+        check "nbody-p3 stress (run, $N)" run nbody-p3 "$N" "$TMP/stress-$N.npy" "${STRESS[@]}" || continue
+        check "nbody-p3 stress (no lost forces, $N)" "$BIN/compare-npy" --rel-tol=1e-9 --abs-tol=1 "$TMP/stress-$N.npy" "$TMP/stress-reference.npy" 1
+    done
+fi
+echo "stress: $PASSED passed, $FAILED failed so far"
+
+# shm_worker_dies: kills the worker process of a two-process nbody-shm run of
+# the stress system, process 0 must then fail within 20 seconds and not wait on
+# the barrier for the dead worker forever
+shm_worker_dies() {
+    timeout 20 "$BIN/nbody-shm" 3600 360000000 10 "$TMP/stress.npy" "$TMP/shm-killed.npy" 2 1 &
+    local PID=$! MAIN="" WORKER=""
+    for i in $(seq 100); do
+        MAIN=$(pgrep -P "$PID") && WORKER=$(pgrep -P "$MAIN") && break
+        sleep 0.1
+    done
+    [ -n "$WORKER" ] || { echo "the worker process did not start"; kill "$PID"; wait "$PID"; return 1; }
+    sleep 1
+    kill -9 "$WORKER"
+    wait "$PID"
+    local STATUS=$?
+    echo "exit status $STATUS"
+    [ "$STATUS" -ne 0 ] && [ "$STATUS" -ne 124 ]
+}
+if [[ " $OPTIONAL " == *" nbody-shm "* ]]; then
+    check "nbody-shm (fails when a worker dies)" shm_worker_dies
+    echo "worker failure: $PASSED passed, $FAILED failed so far"
+fi
+
+if [ "$FAILED" -ne 0 ]; then echo "$FAILED checks FAILED"; exit 1; fi
+echo "all $PASSED checks passed"
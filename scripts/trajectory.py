@@ -0,0 +1,41 @@
+#!/usr/bin/bash python3
+"""Loads output files of the n-body program, either npy files or compressed
+trajectory files (written with --compress, see matrix/trajectory.h)."""
+
+import struct
+import zlib
+
+import numpy
+
+
+MAGIC = b'\x93NBTRAJ\x01'
+HEADER = struct.Struct('<QQQdQ')  # rows, cols, chunk frames, precision, num chunks
+
+
+def __load_trajectory(f):
+    """Loads a compressed trajectory file after its magic has been read"""
+    rows, cols, chunk_frames, precision, num_chunks = HEADER.unpack(f.read(HEADER.size))
+    sizes = numpy.frombuffer(f.read(8*num_chunks), dtype='<u8')
+    data = numpy.empty((rows, cols))
+    for c, size in enumerate(sizes):
+        first = c * chunk_frames
+        count = min(rows - first, chunk_frames)
+        # undo the byte shuffle: byte b of every value is stored together
+        shuffled = numpy.frombuffer(zlib.decompress(f.read(int(size))), dtype=numpy.uint8)
+        words = shuffled.reshape(8, count*cols).T.copy().view('<u8').reshape(count, cols)
+        # undo the differences between frames
+        if precision == 0:
+            data[first:first+count] = numpy.bitwise_xor.accumulate(words, axis=0).view('<f8')
+        else:
+            q = (words >> numpy.uint64(1)).astype(numpy.int64) ^ -(words & numpy.uint64(1)).astype(numpy.int64)
+            data[first:first+count] = numpy.cumsum(q, axis=0) * precision
+    return data
+
+
+def load(file):
+    """Loads a npy or compressed trajectory file given a path or a binary file object"""
+    if isinstance(file, str):
+        with open(file, 'rb') as f: return load(f)
+    if file.read(len(MAGIC)) == MAGIC: return __load_trajectory(file)
+    file.seek(0)
+    return numpy.load(file)
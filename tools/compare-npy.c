@@ -0,0 +1,260 @@
+/**
+ * Compares 2 npy files to make sure they are (almost) equal, like
+ * scripts/compare_npy.py but without ever loading either file into memory, so
+ * trajectories much larger than the memory of the machine can be compared.
+ *
+ * To compile the program:
+ *   gcc -Wall -fopenmp -O3 -march=native compare-npy.c matrix.c trajectory.c util.c -o compare-npy -lm -lz
+ *
+ * To run the program:
+ *   ./compare-npy [options] a.npy b.npy [opt: num-threads]
+ * where the options are:
+ *   --exact            the values must be exactly equal instead of close
+ *   --abs-tol=value    absolute tolerance when measuring closeness (default 1e-8)
+ *   --rel-tol=value    relative tolerance when measuring closeness (default 1e-5)
+ *   --frames=path.csv  save the error of each frame (row) to a CSV file
+ *   --bodies=path.csv  save the error of each body to a CSV file
+ *
+ * The output and exit status are the same as compare_npy.py: "equal" or
+ * "all-close" (0), "unequal shapes" (2), or "not equal/allclose" (1) followed by
+ * the NaN counts, the fraction of close values, and the largest absolute and
+ * relative differences with their locations. When they are not close the frame
+ * and the body with the largest position error are also reported.
+ *
+ * Values are close with the same test as matrix_allclose(). The files are
+ * memory-mapped and compared in chunks of rows by all of the threads, and each
+ * chunk is released from memory once it is done, so the memory used does not
+ * depend on the number of frames. Compressed trajectories (see
+ * matrix/trajectory.h) are also accepted, but they are loaded into memory.
+ *
+ * The position error of a body in a frame is the distance between its
+ * positions in the two files (taking every 3 columns as the x, y, and z of a
+ * body). If the number of columns is not a multiple of 3 every column is its own
+ * "body". The frames file has the columns frame, max_error, rms_error, and
+ * not_close (the number of values that are not close) and the bodies file has
+ * the columns body, max_error, max_error_frame, rms_error, and not_close.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "trajectory.h"
+#include "util.h"
+
+// number of bytes of each file compared before they are released from memory
+#define CHUNK_BYTES (64 << 20)
+
+// most rows compared at once (for files with few columns)
+#define MAX_CHUNK_ROWS (1 << 16)
+
+// this struct is the statistics of the values compared by a single thread
+typedef struct {
+    size_t nan_a, nan_b;    // number of NaNs in each file
+    size_t num_close;       // number of values that are close (or equal with --exact)
+    size_t num_equal;       // number of values that are exactly equal
+    double max_abs, max_rel; // largest absolute and relative differences
+    size_t max_abs_at, max_rel_at; // index of the largest differences
+} Stats;
+
+// this struct is the error of a single body over all of the frames
+typedef struct {
+    double max_error;    // largest distance between the positions
+    size_t max_frame;    // frame of the largest distance
+    double sum_squares;  // sum of the squared distances
+    size_t not_close;    // number of values that are not close
+} BodyStats;
+
+// this function checks if the difference d is larger than the largest so far,
+// where NaN is larger than anything so it is always reported (like argmax)
+static inline bool isLarger(double d, double largest) { return !isnan(largest) && (isnan(d) || d > largest); }
+
+// this function checks if two differences are the same, including both NaN
+static inline bool isSame(double d, double e) { return d == e || (isnan(d) && isnan(e)); }
+
+// this function merges the statistics of a thread into the totals, the first
+// location is kept when differences are equal
+static inline void mergeStats(Stats* total, const Stats* s)
+{
+    total->nan_a += s->nan_a;
+    total->nan_b += s->nan_b;
+    total->num_close += s->num_close;
+    total->num_equal += s->num_equal;
+    if (isLarger(s->max_abs, total->max_abs) || (isSame(s->max_abs, total->max_abs) && s->max_abs_at < total->max_abs_at)) {
+        total->max_abs = s->max_abs; total->max_abs_at = s->max_abs_at;
+    }
+    if (isLarger(s->max_rel, total->max_rel) || (isSame(s->max_rel, total->max_rel) && s->max_rel_at < total->max_rel_at)) {
+        total->max_rel = s->max_rel; total->max_rel_at = s->max_rel_at;
+    }
+}
+
+// this function loads a npy file without writing to it, or a compressed trajectory
+static Matrix* load(const char* path)
+{
+    Matrix* M = is_trajectory_path(path) ? matrix_from_trajectory_path(path) : matrix_from_npy_readonly_path(path);
+    if (M == NULL) { fprintf(stderr, "error reading %s\n", path); }
+    return M;
+}
+
+// this function prints a location in the same way as numpy
+static void printValueAt(const char* label, double value, size_t at, const Matrix* A, const Matrix* B)
+{
+    printf("max %s difference is %.17g at (%zu, %zu) with %.17g and %.17g\n", label, value,
+           at / A->cols, at % A->cols, A->data[at], B->data[at]);
+}
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    bool exact = false;
+    double atol = 1e-8, rtol = 1e-5;
+    const char* frames_path = NULL, *bodies_path = NULL;
+    int num_args = 1;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        char* end = "";
+        if (strcmp(arg, "--exact") == 0) { exact = true; }
+        else if (strncmp(arg, "--abs-tol=", 10) == 0) { atol = strtod(arg + 10, &end); }
+        else if (strncmp(arg, "--rel-tol=", 10) == 0) { rtol = strtod(arg + 10, &end); }
+        else if (strncmp(arg, "--frames=", 9) == 0 && arg[9]) { frames_path = arg + 9; }
+        else if (strncmp(arg, "--bodies=", 9) == 0 && arg[9]) { bodies_path = arg + 9; }
+        else if (strncmp(arg, "--", 2) == 0 && arg[2]) { fprintf(stderr, "unknown option: %s\n", arg); return 3; }
+        else { argv[num_args++] = arg; }
+        if (*end || end == arg + 10) { fprintf(stderr, "invalid value: %s\n", arg); return 3; }
+    }
+    if (num_args != 3 && num_args != 4) {
+        fprintf(stderr, "usage: %s [--exact] [--abs-tol=value] [--rel-tol=value] [--frames=path.csv] [--bodies=path.csv] a.npy b.npy [num-threads]\n", argv[0]);
+        return 3;
+    }
+    size_t num_threads = num_args == 4 ? atoi(argv[3]) : get_num_cores_affinity();
+    if (num_threads <= 0) { fprintf(stderr, "num-threads must be positive\n"); return 3; }
+    if (atol < 0 || rtol < 0) { fprintf(stderr, "the tolerances must not be negative\n"); return 3; }
+
+    // load the matrices
+    Matrix* A = load(argv[1]);
+    if (A == NULL) { return 3; }
+    Matrix* B = load(argv[2]);
+    if (B == NULL) { matrix_free(A); return 3; }
+    if (A->rows != B->rows || A->cols != B->cols) {
+        printf("unequal shapes: (%zu, %zu) (%zu, %zu)\n", A->rows, A->cols, B->rows, B->cols);
+        matrix_free(A); matrix_free(B);
+        return 2;
+    }
+    size_t rows = A->rows, cols = A->cols;
+    size_t dims = cols % 3 == 0 ? 3 : 1, num_bodies = cols / dims;
+    FILE* frames_file = NULL;
+    if (frames_path && !(frames_file = fopen(frames_path, "w"))) { perror("error creating frames file"); return 3; }
+
+    // the statistics of each thread, merged at the end
+    size_t chunk_rows = CHUNK_BYTES / (cols * sizeof(double) + 1);
+    if (chunk_rows == 0) { chunk_rows = 1; }
+    if (chunk_rows > MAX_CHUNK_ROWS) { chunk_rows = MAX_CHUNK_ROWS; }
+    Stats* stats = (Stats*)calloc(num_threads, sizeof(Stats));
+    BodyStats* body_stats = (BodyStats*)calloc(num_threads * num_bodies, sizeof(BodyStats));
+    Matrix* frame_stats = matrix_zeros(chunk_rows, 4);
+    if (!stats || !body_stats || !frame_stats) { fprintf(stderr, "out of memory\n"); return 3; }
+
+    // compare a chunk of rows at a time
+    for (size_t first = 0; first < rows; first += chunk_rows) {
+        size_t last = first + chunk_rows < rows ? first + chunk_rows : rows;
+        #pragma omp parallel num_threads(num_threads)
+        {
+            Stats* s = &stats[omp_get_thread_num()];
+            BodyStats* bs = &body_stats[omp_get_thread_num() * num_bodies];
+            #pragma omp for schedule(static)
+            for (size_t i = first; i < last; i++) {
+                const double* a = &A->data[i * cols], *b = &B->data[i * cols];
+                double frame_max = 0, frame_squares = 0;
+                size_t frame_not_close = 0;
+                for (size_t body = 0; body < num_bodies; body++) {
+                    double squares = 0;
+                    size_t not_close = 0;
+                    for (size_t k = body * dims; k < (body + 1) * dims; k++) {
+                        // same test as matrix_allclose() (false for NaN)
+                        double diff = fabs(a[k] - b[k]);
+                        bool equal = a[k] == b[k];
+                        bool close = exact ? equal : diff <= atol + rtol * fabs(b[k]);
+                        s->nan_a += isnan(a[k]);
+                        s->nan_b += isnan(b[k]);
+                        s->num_equal += equal;
+                        s->num_close += close;
+                        not_close += !close;
+                        double largest = fmax(fabs(a[k]), fabs(b[k]));
+                        double rel = largest == 0 ? 0 : diff / largest;
+                        if (isLarger(diff, s->max_abs)) { s->max_abs = diff; s->max_abs_at = i * cols + k; }
+                        if (isLarger(rel, s->max_rel)) { s->max_rel = rel; s->max_rel_at = i * cols + k; }
+                        squares += diff * diff;
+                    }
+                    double error = sqrt(squares);
+                    if (isLarger(error, bs[body].max_error)) { bs[body].max_error = error; bs[body].max_frame = i; }
+                    bs[body].sum_squares += squares;
+                    bs[body].not_close += not_close;
+                    if (isLarger(error, frame_max)) { frame_max = error; }
+                    frame_squares += squares;
+                    frame_not_close += not_close;
+                }
+                double* fs = &MATRIX_AT(frame_stats, i - first, 0);
+                fs[0] = i; fs[1] = frame_max; fs[2] = sqrt(frame_squares / num_bodies); fs[3] = frame_not_close;
+            }
+        }
+        if (frames_file) {
+            Matrix chunk = { last - first, 4, (last - first) * 4, frame_stats->data, frame_stats->data_source };
+            matrix_to_csv(frames_file, &chunk);
+        }
+        matrix_npy_release_rows(A, first, last);
+        matrix_npy_release_rows(B, first, last);
+    }
+    if (frames_file) { fclose(frames_file); }
+
+    // merge the statistics of the threads, in order of the frames they compared
+    // for the first location of equal differences
+    Stats total = stats[0];
+    for (size_t t = 1; t < num_threads; t++) { mergeStats(&total, &stats[t]); }
+    Matrix* bodies = matrix_zeros(num_bodies, 5);
+    size_t worst_body = 0;
+    for (size_t body = 0; body < num_bodies; body++) {
+        BodyStats b = body_stats[body];
+        for (size_t t = 1; t < num_threads; t++) {
+            const BodyStats* bt = &body_stats[t * num_bodies + body];
+            if (isLarger(bt->max_error, b.max_error) || (isSame(bt->max_error, b.max_error) && bt->max_frame < b.max_frame)) { b.max_error = bt->max_error; b.max_frame = bt->max_frame; }
+            b.sum_squares += bt->sum_squares;
+            b.not_close += bt->not_close;
+        }
+        double* row = &MATRIX_AT(bodies, body, 0);
+        row[0] = body; row[1] = b.max_error; row[2] = b.max_frame; row[3] = sqrt(b.sum_squares / rows); row[4] = b.not_close;
+        if (isLarger(row[1], MATRIX_AT(bodies, worst_body, 1))) { worst_body = body; }
+    }
+    if (bodies_path && !matrix_to_csv_path(bodies_path, bodies)) { perror("error saving bodies file"); }
+
+    // report the results
+    int status = 0;
+    size_t size = rows * cols;
+    if (total.num_close == size && total.num_equal == size) { printf("equal\n"); }
+    else if (total.num_close == size) { printf("all-close\n"); }
+    else {
+        status = 1;
+        printf("not equal/allclose\n");
+        if (total.nan_a) { printf("a has %zu NANs\n", total.nan_a); }
+        if (total.nan_b) { printf("b has %zu NANs\n", total.nan_b); }
+        printf("there are %zu (%.2f%%) close values\n", total.num_close, total.num_close * 100.0 / size);
+        printValueAt("absolute", total.max_abs, total.max_abs_at, A, B);
+        printValueAt("relative", total.max_rel, total.max_rel_at, A, B);
+        const double* worst = &MATRIX_AT(bodies, worst_body, 0);
+        printf("max position error is %.17g for body %zu in frame %zu (%zu values of the body are not close)\n",
+               worst[1], worst_body, (size_t)worst[2], (size_t)worst[4]);
+    }
+
+    // cleanup
+    matrix_free(bodies);
+    matrix_free(frame_stats);
+    free(body_stats);
+    free(stats);
+    matrix_free(A);
+    matrix_free(B);
+    return status;
+}
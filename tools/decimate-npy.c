@@ -0,0 +1,188 @@
+/**
+ * Takes a small part of the output of the nbody programs, such as every k-th
+ * frame of some of the bodies, and saves it as a new npy file, for previews
+ * and plots of runs that are too large to load. Only the parts of the output
+ * that are used are read from the file (see matrix_from_npy_sparse()).
+ *
+ * To compile the program:
+ *   gcc -Wall -fopenmp -O3 -march=native decimate-npy.c matrix.c trajectory.c util.c -o decimate-npy -lm -lz
+ *
+ * To run the program:
+ *   ./decimate-npy [options] output.npy preview.npy [opt: num-threads]
+ * where the options are:
+ *   --first=f         first frame (row) to keep (default 0)
+ *   --last=l          frame to stop before (default the number of frames)
+ *   --every=k         keep every k-th frame from the first (default 1)
+ *   --max-points=p    choose every so that at most about p positions are kept
+ *                     (if --every is not given), like plot_output.py
+ *   --bodies=list     keep these bodies, a list of indices and inclusive
+ *                     ranges like 0-9,42 (default all)
+ *   --bbox=x0,y0,z0,x1,y1,z1
+ *                     of those, only keep bodies that are inside this box in
+ *                     at least one of the kept frames
+ *
+ * The preview has one row for each kept frame with the x, y, and z of each kept
+ * body, so it is the same format as output.npy. With --max-points the number of
+ * bodies before --bbox is used. Compressed trajectories (see matrix/trajectory.h)
+ * are also accepted, but they are loaded into memory.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "trajectory.h"
+#include "util.h"
+
+// number of frames copied before they are released from memory
+#define CHUNK_FRAMES 1024
+
+// this function parses a size, returning false if it is not valid
+static bool parseSize(const char* str, size_t* value)
+{
+    char* end;
+    *value = strtoull(str, &end, 10);
+    return end != str && !*end && *str != '-';
+}
+
+// this function marks the bodies of a list like 0-9,42 in keep, returning
+// false after printing an error if the list is invalid
+static bool parseBodies(const char* list, bool* keep, size_t n)
+{
+    const char* str = list;
+    while (*str) {
+        char* end;
+        size_t first = strtoull(str, &end, 10), last = first;
+        if (end == str || *str == '-') { break; }
+        if (*end == '-') {
+            str = end + 1;
+            last = strtoull(str, &end, 10);
+            if (end == str || *str == '-') { break; }
+        }
+        if (last < first || last >= n) { fprintf(stderr, "bodies out of range: %s\n", list); return false; }
+        for (size_t i = first; i <= last; i++) { keep[i] = true; }
+        if (!*end) { return true; }
+        if (*end != ',') { break; }
+        str = end + 1;
+    }
+    fprintf(stderr, "invalid list of bodies: %s\n", list);
+    return false;
+}
+
+// this function parses a box as x0,y0,z0,x1,y1,z1, returning false if invalid
+static bool parseBox(const char* str, double box[6])
+{
+    for (int i = 0; i < 6; i++) {
+        char* end;
+        box[i] = strtod(str, &end);
+        if (end == str || *end != (i == 5 ? 0 : ',')) { return false; }
+        str = end + 1;
+    }
+    return box[0] <= box[3] && box[1] <= box[4] && box[2] <= box[5];
+}
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    size_t first = 0, last = SIZE_MAX, every = 0, max_points = 0;
+    const char* bodies_list = NULL, *box_str = NULL;
+    int num_args = 1;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool valid = true;
+        if (strncmp(arg, "--first=", 8) == 0) { valid = parseSize(arg + 8, &first); }
+        else if (strncmp(arg, "--last=", 7) == 0) { valid = parseSize(arg + 7, &last); }
+        else if (strncmp(arg, "--every=", 8) == 0) { valid = parseSize(arg + 8, &every) && every > 0; }
+        else if (strncmp(arg, "--max-points=", 13) == 0) { valid = parseSize(arg + 13, &max_points) && max_points > 0; }
+        else if (strncmp(arg, "--bodies=", 9) == 0) { bodies_list = arg + 9; }
+        else if (strncmp(arg, "--bbox=", 7) == 0) { box_str = arg + 7; }
+        else if (strncmp(arg, "--", 2) == 0 && arg[2]) { fprintf(stderr, "unknown option: %s\n", arg); return 1; }
+        else { argv[num_args++] = arg; }
+        if (!valid) { fprintf(stderr, "invalid value: %s\n", arg); return 1; }
+    }
+    if (num_args != 3 && num_args != 4) {
+        fprintf(stderr, "usage: %s [--first=f] [--last=l] [--every=k] [--max-points=p] [--bodies=list] [--bbox=x0,y0,z0,x1,y1,z1] output.npy preview.npy [num-threads]\n", argv[0]);
+        return 1;
+    }
+    size_t num_threads = num_args == 4 ? atoi(argv[3]) : get_num_cores_affinity();
+    if (num_threads <= 0) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
+    double box[6];
+    if (box_str && !parseBox(box_str, box)) { fprintf(stderr, "invalid box (x0,y0,z0,x1,y1,z1 with x0 <= x1 and so on): %s\n", box_str); return 1; }
+
+    // map the output without reading it
+    Matrix* input = is_trajectory_path(argv[1]) ? matrix_from_trajectory_path(argv[1]) : matrix_from_npy_sparse_path(argv[1]);
+    if (input == NULL) { perror("error reading input"); return 1; }
+    if (input->cols == 0 || input->cols % 3 != 0) { fprintf(stderr, "input doesn't have 3 values per body\n"); return 1; }
+    size_t num_frames = input->rows, n = input->cols / 3;
+    if (last > num_frames) { last = num_frames; }
+    if (first >= last) { fprintf(stderr, "no frames selected (the input has %zu)\n", num_frames); return 1; }
+
+    // the bodies to keep
+    bool* keep = (bool*)calloc(n, sizeof(bool));
+    size_t* bodies = (size_t*)malloc(n * sizeof(size_t));
+    if (!keep || !bodies) { fprintf(stderr, "out of memory\n"); return 1; }
+    if (bodies_list) { if (!parseBodies(bodies_list, keep, n)) { return 1; } }
+    else { memset(keep, true, n * sizeof(bool)); }
+    size_t num_bodies = 0;
+    for (size_t i = 0; i < n; i++) { if (keep[i]) { bodies[num_bodies++] = i; } }
+
+    // the frames to keep, spread evenly over the range if limited by points
+    if (every == 0) {
+        size_t per_body = max_points ? (max_points + num_bodies - 1) / num_bodies : last - first;
+        every = (last - first + per_body - 1) / per_body;
+        if (every == 0) { every = 1; }
+    }
+    size_t num_kept = (last - first + every - 1) / every;
+
+    // only keep the bodies inside the box in at least one kept frame, each
+    // thread checks its own bodies in every frame
+    if (box_str) {
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (size_t b = 0; b < num_bodies; b++) {
+            bool inside = false;
+            for (size_t f = first; f < last && !inside; f += every) {
+                const double* p = &MATRIX_AT(input, f, 3 * bodies[b]);
+                inside = p[0] >= box[0] && p[1] >= box[1] && p[2] >= box[2] &&
+                         p[0] <= box[3] && p[1] <= box[4] && p[2] <= box[5];
+            }
+            keep[bodies[b]] = inside;
+        }
+        size_t num_inside = 0;
+        for (size_t b = 0; b < num_bodies; b++) { if (keep[bodies[b]]) { bodies[num_inside++] = bodies[b]; } }
+        num_bodies = num_inside;
+    }
+    if (num_bodies == 0) { fprintf(stderr, "no bodies selected\n"); return 1; }
+
+    // copy the kept positions straight into the preview
+    Matrix* output = matrix_create_npy_path(argv[2], num_kept, 3 * num_bodies);
+    if (output == NULL) { perror("error creating preview"); return 1; }
+    for (size_t chunk = 0; chunk < num_kept; chunk += CHUNK_FRAMES) {
+        size_t end = chunk + CHUNK_FRAMES < num_kept ? chunk + CHUNK_FRAMES : num_kept;
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (size_t row = chunk; row < end; row++) {
+            const double* in = &MATRIX_AT(input, first + row * every, 0);
+            double* out = &MATRIX_AT(output, row, 0);
+            for (size_t b = 0; b < num_bodies; b++) {
+                out[3*b] = in[3*bodies[b]];
+                out[3*b+1] = in[3*bodies[b]+1];
+                out[3*b+2] = in[3*bodies[b]+2];
+            }
+        }
+        matrix_npy_release_rows(input, first + chunk * every, first + (end - 1) * every + 1);
+        matrix_npy_release_rows(output, chunk, end);
+    }
+    printf("kept %zu of %zu frames (every %zu from %zu) and %zu of %zu bodies\n", num_kept, num_frames, every, first, num_bodies, n);
+
+    // cleanup
+    matrix_free(output);
+    matrix_free(input);
+    free(bodies);
+    free(keep);
+    return 0;
+}
@@ -0,0 +1,340 @@
+/**
+ * Generates the initial state of a system of bodies for the nbody programs,
+ * like scripts/generate_data.py but without numpy and fast enough for inputs
+ * of many millions of bodies.
+ *
+ * To compile the program:
+ *   gcc -Wall -fopenmp -O3 -march=native generate-data.c matrix.c util.c -o generate-data -lm
+ *
+ * To run the program:
+ *   ./generate-data [options] distribution n output.npy [opt: num-threads]
+ * where:
+ *   - distribution is one of (see below):
+ *       uniform  bodies in a cube with random velocities (generate_data.py)
+ *       plummer  a Plummer sphere in equilibrium
+ *       disk     an exponential disk in circular orbits around its center
+ *       cold     a uniform sphere at rest (or nearly), which collapses
+ *   - n is the number of bodies to generate
+ *   - output.npy is the n-by-7 output file (the input.npy of the nbody programs)
+ *   - num-threads is an optional number of threads (a reasonable default is
+ *     chosen if not provided)
+ *
+ * Every random value comes from a counter-based generator (Philox4x32-10)
+ * keyed by the seed and counting by body, so the output only depends on the
+ * seed and the options and never on the number of threads. The rows are
+ * written straight into the mapped output file in chunks that are released as
+ * they are done, so the memory used does not grow with n.
+ *
+ * All values are in SI units. The default total mass of the plummer, disk, and
+ * cold systems is about a solar mass and the default radius is 1 AU.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "util.h"
+
+#define G 6.6743015e-11
+
+// number of rows generated before they are released from memory
+#define CHUNK_ROWS (1 << 16)
+
+//////////////////// Random Numbers ////////////////////
+
+// this struct is the random numbers of a single body: the counter is the body
+// and the number of values used so far, so every body has its own stream
+typedef struct {
+    uint32_t key[2];  // from the seed
+    uint64_t body;    // index of the body
+    uint64_t draw;    // number of blocks of random bits used
+    uint64_t bits[2]; // the current block of random bits
+    int used;         // number of values of the current block used
+} Stream;
+
+// this function is the Philox4x32-10 counter-based generator (Salmon et al.,
+// "Parallel random numbers: as easy as 1, 2, 3"), giving 128 random bits for
+// each counter and key
+static inline void philox4x32(uint32_t ctr[4], const uint32_t seed[2])
+{
+    uint32_t key[2] = { seed[0], seed[1] };
+    for (int round = 0; round < 10; round++)
+    {
+        uint64_t p0 = (uint64_t)0xD2511F53 * ctr[0];
+        uint64_t p1 = (uint64_t)0xCD9E8D57 * ctr[2];
+        uint32_t c1 = ctr[1], c3 = ctr[3];
+        ctr[0] = (uint32_t)(p1 >> 32) ^ c1 ^ key[0];
+        ctr[1] = (uint32_t)p1;
+        ctr[2] = (uint32_t)(p0 >> 32) ^ c3 ^ key[1];
+        ctr[3] = (uint32_t)p0;
+        key[0] += 0x9E3779B9;
+        key[1] += 0xBB67AE85;
+    }
+}
+
+static inline Stream createStream(uint64_t seed, uint64_t body)
+{
+    Stream s = { { (uint32_t)seed, (uint32_t)(seed >> 32) }, body, 0, { 0, 0 }, 2 };
+    return s;
+}
+
+// this function returns a uniform random number in (0, 1)
+static inline double uniform(Stream* s)
+{
+    if (s->used == 2)
+    {
+        uint32_t ctr[4] = { (uint32_t)s->draw, (uint32_t)(s->draw >> 32), (uint32_t)s->body, (uint32_t)(s->body >> 32) };
+        philox4x32(ctr, s->key);
+        s->bits[0] = ((uint64_t)ctr[0] << 32) | ctr[1];
+        s->bits[1] = ((uint64_t)ctr[2] << 32) | ctr[3];
+        s->draw++;
+        s->used = 0;
+    }
+    return ((s->bits[s->used++] >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+// this function returns a uniform random number in (min, max)
+static inline double uniformRange(Stream* s, double min, double max) { return min + (max - min) * uniform(s); }
+
+// this function returns a random number from the standard normal distribution
+static inline double normal(Stream* s)
+{
+    double u = uniform(s), v = uniform(s);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// this function sets (x, y, z) to a random direction times a length
+static inline void randomDirection(Stream* s, double length, double* x, double* y, double* z)
+{
+    double cos_theta = uniformRange(s, -1, 1), sin_theta = sqrt(1 - cos_theta * cos_theta);
+    double phi = uniformRange(s, 0, 2 * M_PI);
+    *x = length * sin_theta * cos(phi);
+    *y = length * sin_theta * sin(phi);
+    *z = length * cos_theta;
+}
+
+//////////////////// Options ////////////////////
+
+typedef struct {
+    double min_mass, max_mass, mass;             // uniform: the mass of each body
+    double min_position, max_position;           // uniform: the cube the bodies are in
+    double min_velocity, max_velocity, velocity; // uniform: the speed of each body
+    double total_mass;   // plummer, disk, cold: the total mass of the bodies
+    double radius;       // plummer: scale radius, disk: scale length, cold: radius of the sphere
+    double thickness;    // disk: scale height as a fraction of the scale length
+    double central_mass; // disk: mass of an extra body at the center
+    double dispersion;   // disk: random velocities as a fraction of the circular velocity
+    double virial_ratio; // cold: 2K/|W| of the random velocities, 0 for a cold start
+    double seed;         // seed of the random numbers
+} Options;
+
+typedef struct {
+    const char* name;
+    double* value;
+    const char* help;
+} OptionInfo;
+
+static Options opts = {
+    0.1, 1.0, NAN, -1.0, 1.0, 0.0, 1.0, NAN,
+    1.989e30, 1.496e11, 0.1, 0, 0.05, 0, 0,
+};
+
+static const OptionInfo option_info[] = {
+    { "min-mass", &opts.min_mass, "uniform: minimum mass of a body (default 0.1)" },
+    { "max-mass", &opts.max_mass, "uniform: maximum mass of a body (default 1.0)" },
+    { "mass", &opts.mass, "uniform: fixed mass of every body, overrides min-mass and max-mass" },
+    { "min-position", &opts.min_position, "uniform: minimum of each coordinate (default -1.0)" },
+    { "max-position", &opts.max_position, "uniform: maximum of each coordinate (default 1.0)" },
+    { "min-velocity", &opts.min_velocity, "uniform: minimum speed of a body (default 0.0)" },
+    { "max-velocity", &opts.max_velocity, "uniform: maximum speed of a body (default 1.0)" },
+    { "velocity", &opts.velocity, "uniform: fixed speed of every body, overrides min-velocity and max-velocity" },
+    { "total-mass", &opts.total_mass, "plummer, disk, cold: total mass of the bodies (default 1.989e30)" },
+    { "radius", &opts.radius, "plummer: scale radius, disk: scale length, cold: radius (default 1.496e11)" },
+    { "thickness", &opts.thickness, "disk: scale height as a fraction of the scale length (default 0.1)" },
+    { "central-mass", &opts.central_mass, "disk: mass of an extra body at the center (default 0, none)" },
+    { "dispersion", &opts.dispersion, "disk: random velocity as a fraction of the circular velocity (default 0.05)" },
+    { "virial-ratio", &opts.virial_ratio, "cold: 2K/|W| of random initial velocities (default 0, at rest)" },
+    { "seed", &opts.seed, "seed of the random numbers, the same seed gives the same output (default 0)" },
+};
+#define NUM_OPTIONS (sizeof(option_info) / sizeof(option_info[0]))
+
+// this function parses and removes the --name=value options from argv,
+// returning false after printing an error if any are invalid
+static bool parseOptions(int* argc, const char* argv[])
+{
+    int out = 1;
+    for (int i = 1; i < *argc; i++)
+    {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0 || arg[2] == 0) { argv[out++] = arg; continue; }
+        arg += 2;
+        const char* value = strchr(arg, '=');
+        size_t len = value ? (size_t)(value - arg) : strlen(arg);
+        const OptionInfo* info = NULL;
+        for (size_t j = 0; j < NUM_OPTIONS; j++)
+        {
+            if (strlen(option_info[j].name) == len && strncmp(option_info[j].name, arg, len) == 0) { info = &option_info[j]; break; }
+        }
+        if (!info) { fprintf(stderr, "unknown option: %s\n", argv[i]); return false; }
+        char* end;
+        if (!value || !value[1] || (*info->value = strtod(value + 1, &end), *end)) { fprintf(stderr, "--%s requires a number\n", info->name); return false; }
+    }
+    *argc = out;
+    return true;
+}
+
+static void printOptions(FILE* file)
+{
+    fprintf(file, "options (as --name=value):\n");
+    for (size_t i = 0; i < NUM_OPTIONS; i++) { fprintf(file, "  --%-14s %s\n", option_info[i].name, option_info[i].help); }
+}
+
+//////////////////// Distributions ////////////////////
+
+// each function generates the 7 values of a row (mass, position, and velocity)
+// for body i of n using only the random numbers of that body
+typedef void (*Generator)(double* row, size_t i, size_t n, Stream* s);
+
+// bodies in a cube with random velocities, the same as generate_data.py
+static void generateUniform(double* row, size_t i, size_t n, Stream* s)
+{
+    (void)i; (void)n;
+    row[0] = isnan(opts.mass) ? uniformRange(s, opts.min_mass, opts.max_mass) : opts.mass;
+    for (int k = 1; k <= 3; k++) { row[k] = uniformRange(s, opts.min_position, opts.max_position); }
+    double speed = isnan(opts.velocity) ? uniformRange(s, opts.min_velocity, opts.max_velocity) : opts.velocity;
+    randomDirection(s, speed, &row[4], &row[5], &row[6]);
+}
+
+// a Plummer sphere in equilibrium with equal masses (Aarseth, Henon & Wielen,
+// 1974), the positions are cut off at about 22.8 scale radii
+static void generatePlummer(double* row, size_t i, size_t n, Stream* s)
+{
+    (void)i;
+    double a = opts.radius, m = opts.total_mass;
+    row[0] = m / n;
+
+    // the radius from the fraction of the mass inside it
+    double x;
+    do { x = uniform(s); } while (x > 0.999);
+    double r = a / sqrt(pow(x, -2.0 / 3.0) - 1);
+    randomDirection(s, r, &row[1], &row[2], &row[3]);
+
+    // the speed as a fraction q of the escape speed, from g(q) = q^2 (1-q^2)^3.5
+    double q, y;
+    do { q = uniform(s); y = 0.1 * uniform(s); } while (y > q * q * pow(1 - q * q, 3.5));
+    double escape = sqrt(2 * G * m / a) * pow(1 + r * r / (a * a), -0.25);
+    randomDirection(s, q * escape, &row[4], &row[5], &row[6]);
+}
+
+// an exponential disk in the x-y plane (surface density proportional to
+// exp(-R/radius) and a sech^2 vertical profile) in circular orbits, using the
+// mass inside each radius as if it were spherical, with an optional central
+// body as body 0
+static void generateDisk(double* row, size_t i, size_t n, Stream* s)
+{
+    double rd = opts.radius, central = opts.central_mass;
+    size_t num_disk = central > 0 ? n - 1 : n;
+    if (central > 0 && i == 0)
+    {
+        row[0] = central;
+        for (int k = 1; k < 7; k++) { row[k] = 0; }
+        return;
+    }
+    row[0] = opts.total_mass / num_disk;
+
+    // the radius has a gamma(2) distribution, the height a sech^2 one
+    double radius = -rd * log(uniform(s) * uniform(s));
+    double phi = uniformRange(s, 0, 2 * M_PI);
+    double z = opts.thickness * rd * atanh(uniformRange(s, -1, 1));
+    row[1] = radius * cos(phi);
+    row[2] = radius * sin(phi);
+    row[3] = z;
+
+    // circular velocity from the mass inside the radius plus some dispersion
+    double inside = central + opts.total_mass * (1 - (1 + radius / rd) * exp(-radius / rd));
+    double circular = radius > 0 ? sqrt(G * inside / radius) : 0;
+    double sigma = opts.dispersion * circular;
+    row[4] = -circular * sin(phi) + sigma * normal(s);
+    row[5] = circular * cos(phi) + sigma * normal(s);
+    row[6] = sigma * normal(s);
+}
+
+// a uniform sphere with equal masses, at rest or with random velocities that
+// have the given virial ratio (the potential energy is -3/5 G M^2 / radius)
+static void generateCold(double* row, size_t i, size_t n, Stream* s)
+{
+    (void)i;
+    double a = opts.radius, m = opts.total_mass;
+    row[0] = m / n;
+    randomDirection(s, a * cbrt(uniform(s)), &row[1], &row[2], &row[3]);
+    double sigma = sqrt(opts.virial_ratio * 0.2 * G * m / a); // 3/2 M sigma^2 = Q/2 |W|
+    for (int k = 4; k < 7; k++) { row[k] = sigma * normal(s); }
+}
+
+static const struct { const char* name; Generator generate; } distributions[] = {
+    { "uniform", generateUniform },
+    { "plummer", generatePlummer },
+    { "disk", generateDisk },
+    { "cold", generateCold },
+};
+#define NUM_DISTRIBUTIONS (sizeof(distributions) / sizeof(distributions[0]))
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    if (!parseOptions(&argc, argv)) { return 1; }
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage: %s [options] uniform|plummer|disk|cold n output.npy [num-threads]\n", argv[0]);
+        printOptions(stderr);
+        return 1;
+    }
+    Generator generate = NULL;
+    for (size_t i = 0; i < NUM_DISTRIBUTIONS; i++) {
+        if (strcmp(argv[1], distributions[i].name) == 0) { generate = distributions[i].generate; }
+    }
+    if (!generate) { fprintf(stderr, "unknown distribution: %s\n", argv[1]); return 1; }
+    size_t n = atol(argv[2]);
+    if (n <= 0) { fprintf(stderr, "n must be positive\n"); return 1; }
+    size_t num_threads = argc == 5 ? atoi(argv[4]) : get_num_cores_affinity();
+    if (num_threads <= 0) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
+    if (opts.min_mass <= 0 || opts.max_mass < opts.min_mass || opts.mass <= 0) { fprintf(stderr, "the masses must be positive with max-mass >= min-mass\n"); return 1; }
+    if (opts.max_position <= opts.min_position) { fprintf(stderr, "max-position must be greater than min-position\n"); return 1; }
+    if (opts.min_velocity < 0 || opts.max_velocity < opts.min_velocity || opts.velocity < 0) { fprintf(stderr, "the velocities must be non-negative with max-velocity >= min-velocity\n"); return 1; }
+    if (opts.total_mass <= 0 || opts.radius <= 0) { fprintf(stderr, "total-mass and radius must be positive\n"); return 1; }
+    if (opts.thickness < 0 || opts.central_mass < 0 || opts.dispersion < 0 || opts.virial_ratio < 0) { fprintf(stderr, "thickness, central-mass, dispersion, and virial-ratio must not be negative\n"); return 1; }
+    if (opts.seed < 0 || opts.seed != floor(opts.seed)) { fprintf(stderr, "seed must be a non-negative integer\n"); return 1; }
+    if (generate == generateDisk && opts.central_mass > 0 && n < 2) { fprintf(stderr, "a disk with a central mass needs n >= 2\n"); return 1; }
+    uint64_t seed = (uint64_t)opts.seed;
+
+    // start the clock
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the rows are written directly into the output file
+    Matrix* output = matrix_create_npy_path(argv[3], n, 7);
+    if (output == NULL) { perror("error creating output"); return 1; }
+    for (size_t first = 0; first < n; first += CHUNK_ROWS) {
+        size_t last = first + CHUNK_ROWS < n ? first + CHUNK_ROWS : n;
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (size_t i = first; i < last; i++) {
+            Stream s = createStream(seed, i);
+            generate(&MATRIX_AT(output, i, 0), i, n, &s);
+        }
+        matrix_npy_release_rows(output, first, last);
+    }
+    matrix_free(output);
+
+    // get the end and computation time
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time = get_time_diff(&start, &end);
+    printf("%f secs\n", time);
+
+    return 0;
+}
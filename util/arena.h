@@ -0,0 +1,198 @@
+/**
+ * A run-scoped arena allocator: memory is taken from large mapped chunks and
+ * is all given back at once by arena_free().
+ *
+ * Every allocation starts on an ARENA_ALIGN-byte boundary (a cache line) so
+ * the kernels can use aligned loads, and allocations of at least
+ * ARENA_HUGE_ALIGN bytes start on a huge-page boundary so they can be backed by
+ * huge pages. The memory is zeroed when it is first allocated.
+ *
+ * An arena created by arena_create_huge() asks for huge pages for those big
+ * allocations, either transparent huge pages (with madvise()) or huge pages
+ * reserved by the administrator (with MAP_HUGETLB). When no reserved huge
+ * pages are left it falls back to transparent huge pages, and when those are
+ * disabled the allocations simply use normal pages.
+ *
+ * When compiled with -DARENA_DEBUG every allocation gets its own mapping with
+ * a guard page right after it, so writing past the end of an allocation (by
+ * more than its rounding up to ARENA_ALIGN bytes) faults immediately.
+ *
+ * An arena must only be used by one thread at a time.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+// alignment (in bytes) of every allocation
+#define ARENA_ALIGN 64
+
+// allocations of at least this many bytes start on a huge-page boundary
+#define ARENA_HUGE_ALIGN (2 << 20)
+
+// default size of the chunks the small allocations are taken from
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+// kinds of pages used for the big allocations (see arena_create_huge())
+#define ARENA_PAGES_NORMAL   0 // whatever the system uses by default
+#define ARENA_PAGES_THP      1 // transparent huge pages, with madvise(MADV_HUGEPAGE)
+#define ARENA_PAGES_EXPLICIT 2 // reserved huge pages, with MAP_HUGETLB
+
+// this struct is a single mapping of an arena
+typedef struct ArenaChunk {
+    struct ArenaChunk* next; // the chunk mapped before this one
+    char* data;              // start of the mapping
+    size_t size;             // length of the mapping
+    size_t used;             // number of bytes allocated from the start of data
+} ArenaChunk;
+
+// this struct is an arena, see arena_create()
+typedef struct {
+    ArenaChunk* chunks; // most recently mapped chunk first
+    size_t chunk_size;  // size of the chunks for small allocations
+    size_t allocated;   // total bytes allocated
+    int pages;          // one of the ARENA_PAGES_* values, for the big allocations
+    bool fell_back;     // true if reserved huge pages were asked for but not available
+} Arena;
+
+// this function maps a new chunk of at least size bytes starting on an align
+// boundary (a multiple of the page size), returning NULL if it cannot be mapped,
+// chunks aligned to ARENA_HUGE_ALIGN use the kind of pages of the arena
+inline static ArenaChunk* __arena_map(Arena* arena, size_t size, size_t align)
+{
+    size_t page = sysconf(_SC_PAGE_SIZE);
+    if (align < page) { align = page; }
+    size = (size + page - 1) / page * page;
+    bool huge = align == ARENA_HUGE_ALIGN;
+    char* data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge && arena->pages == ARENA_PAGES_EXPLICIT) {
+        // reserved huge pages are always aligned, if there are not enough the
+        // rest of the arena uses transparent huge pages instead
+        size_t huge_size = (size + ARENA_HUGE_ALIGN - 1) / ARENA_HUGE_ALIGN * ARENA_HUGE_ALIGN;
+        data = (char*)mmap(NULL, huge_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED) { size = huge_size; }
+        else { arena->pages = ARENA_PAGES_THP; arena->fell_back = true; }
+    }
+#endif
+    if (data == MAP_FAILED) {
+        size_t length = size + align - page; // extra to find an aligned start in
+        char* map = (char*)mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED) { return NULL; }
+
+        // give back the unaligned head and the tail after the chunk
+        data = (char*)(((uintptr_t)map + align - 1) & ~(uintptr_t)(align - 1));
+        if (data > map) { munmap(map, data - map); }
+        if (data + size < map + length) { munmap(data + size, map + length - (data + size)); }
+#ifdef MADV_HUGEPAGE
+        // this fails harmlessly if transparent huge pages are disabled
+        if (huge && arena->pages == ARENA_PAGES_THP) { madvise(data, size, MADV_HUGEPAGE); }
+#endif
+    }
+
+    ArenaChunk* chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk));
+    chunk->next = arena->chunks;
+    chunk->data = data;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+    return chunk;
+}
+
+/**
+ * Creates an empty arena whose allocations of at least ARENA_HUGE_ALIGN bytes
+ * use the given kind of pages (one of the ARENA_PAGES_* values). Memory is only
+ * mapped when it is allocated from.
+ */
+inline static Arena* arena_create_huge(int pages)
+{
+    Arena* arena = (Arena*)malloc(sizeof(Arena));
+    arena->chunks = NULL;
+    arena->chunk_size = ARENA_CHUNK_SIZE;
+    arena->allocated = 0;
+    arena->pages = pages;
+    arena->fell_back = false;
+    return arena;
+}
+
+/**
+ * Creates an empty arena using normal pages (see arena_create_huge()).
+ */
+inline static Arena* arena_create(void)
+{
+    return arena_create_huge(ARENA_PAGES_NORMAL);
+}
+
+/**
+ * Allocates size bytes from the arena, aligned to ARENA_ALIGN bytes (or
+ * ARENA_HUGE_ALIGN bytes if size is at least that). The memory is zeroed and
+ * stays valid until arena_free(). Returns NULL if the memory cannot be mapped.
+ */
+inline static void* arena_alloc(Arena* arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (size == 0) { size = ARENA_ALIGN; }
+#ifdef ARENA_DEBUG
+    // the allocation ends right before an inaccessible page
+    size_t page = sysconf(_SC_PAGE_SIZE), pages = (size + page - 1) / page * page;
+    ArenaChunk* chunk = __arena_map(arena, pages + page, page);
+    if (!chunk) { return NULL; }
+    mprotect(chunk->data + pages, page, PROT_NONE);
+    chunk->used = chunk->size;
+    arena->allocated += size;
+    return chunk->data + pages - size;
+#else
+    // use the space left in the newest chunk, otherwise map a new chunk (big
+    // allocations get a chunk of their own so the space left in the newest
+    // chunk is not wasted)
+    size_t align = size >= ARENA_HUGE_ALIGN ? ARENA_HUGE_ALIGN : ARENA_ALIGN;
+    ArenaChunk* chunk = arena->chunks;
+    size_t start = chunk ? (chunk->used + align - 1) / align * align : 0;
+    if (!chunk || start + size > chunk->size) {
+        bool own = size >= arena->chunk_size / 4;
+        ArenaChunk* newest = arena->chunks;
+        chunk = __arena_map(arena, own ? size : arena->chunk_size, align);
+        if (!chunk) { return NULL; }
+        if (own && newest) {
+            // keep allocating small values from the previous chunk
+            arena->chunks = chunk->next;
+            chunk->next = newest->next;
+            newest->next = chunk;
+        }
+        start = 0;
+    }
+    chunk->used = start + size;
+    arena->allocated += size;
+    return chunk->data + start;
+#endif
+}
+
+/**
+ * Allocates a copy of the size bytes at data from the arena (see arena_alloc()).
+ */
+inline static void* arena_memdup(Arena* arena, const void* data, size_t size)
+{
+    char* copy = (char*)arena_alloc(arena, size);
+    if (copy) { memcpy(copy, data, size); }
+    return copy;
+}
+
+/**
+ * Gives back all of the memory of the arena and frees it.
+ */
+inline static void arena_free(Arena* arena)
+{
+    if (!arena) { return; }
+    for (ArenaChunk* chunk = arena->chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        munmap(chunk->data, chunk->size);
+        free(chunk);
+    }
+    free(arena);
+}
@@ -0,0 +1,194 @@
+/**
+ * Reports the progress of a long simulation while it runs (see --progress and
+ * --progress-file). A separate thread wakes up every few seconds and reads the
+ * number of the last completed step, which the step loop stores with a single
+ * atomic store and no locks or barriers. From it, it reports the steps and
+ * interactions (n * (n - 1) per step for every program so they can be
+ * compared) per second since the last report, the time left at the average
+ * rate so far, the relative change of the total energy from the first row of
+ * --energy to the newest (if it is recorded), and the resident memory.
+ *
+ * Without --progress-file a line of text is printed to stderr:
+ *   progress: step 1200 of 9999 (12.0%), 35.2 steps/s, 3.52e+09 interactions/s, ETA 4m10s, energy drift 1.2e-09, RSS 120.5 MiB
+ * otherwise a JSON object is appended to the file on a line of its own:
+ *   {"elapsed": 34.1, "step": 1200, "steps": 9999, "steps_per_sec": 35.2, "interactions_per_sec": 3.52e+09,
+ *    "eta": 250.1, "energy_drift": 1.2e-09, "rss": 126353408, "done": false}
+ * with "energy_drift": null without --energy. A last report with "done": true
+ * is made when the simulation ends.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "matrix.h"
+#include "options.h"
+#include "util.h"
+
+// seconds between reports when only --progress-file is given
+#define PROGRESS_DEFAULT_SECS 10
+
+// this struct is the state of the reporting thread of a simulation
+typedef struct {
+    _Atomic size_t step;  // last completed step, stored by the step loop
+    size_t num_steps;     // steps of the step loop (the first is step 1)
+    double interactions;  // interactions per step
+    const Matrix* energy; // energy of each output row, NULL if it is not recorded
+    size_t output_steps;  // steps between the output rows
+    double interval;      // seconds between reports
+    FILE* json;           // file of the JSON reports, NULL for text on stderr
+    bool enabled;
+    bool stop;            // set to end the thread, protected by lock
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct timespec start, last; // times of the start and of the last report
+    size_t last_step;            // step at the last report
+} Progress;
+
+// this function returns the resident memory of the process in bytes, or 0 if
+// it cannot be read
+inline static size_t __progress_rss(void)
+{
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file) { return 0; }
+    size_t pages = 0, resident = 0;
+    if (fscanf(file, "%zu %zu", &pages, &resident) != 2) { resident = 0; }
+    fclose(file);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// this function makes one report
+inline static void __progress_report(Progress* progress, bool done)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size_t step = atomic_load_explicit(&progress->step, memory_order_acquire);
+    double elapsed = get_time_diff(&progress->start, &now), since = get_time_diff(&progress->last, &now);
+    double rate = since > 0 ? (step - progress->last_step) / since : 0;
+    if (done) { rate = elapsed > 0 ? step / elapsed : 0; }
+    double eta = step ? (progress->num_steps - step) * elapsed / step : NAN;
+    progress->last = now;
+    progress->last_step = step;
+
+    // the energy rows recorded so far (row r is recorded during step r * output_steps + 1)
+    double drift = NAN;
+    size_t rows = done ? (progress->energy ? progress->energy->rows : 0) : step ? (step - 1) / progress->output_steps + 1 : 0;
+    if (progress->energy && rows)
+    {
+        if (rows > progress->energy->rows) { rows = progress->energy->rows; }
+        double first = MATRIX_AT(progress->energy, 0, 2), last = MATRIX_AT(progress->energy, rows - 1, 2);
+        drift = first ? fabs((last - first) / first) : fabs(last - first);
+    }
+
+    size_t rss = __progress_rss();
+    if (progress->json)
+    {
+        fprintf(progress->json, "{\"elapsed\": %.3f, \"step\": %zu, \"steps\": %zu, \"steps_per_sec\": %.6g, \"interactions_per_sec\": %.6g, ",
+                elapsed, step, progress->num_steps, rate, rate * progress->interactions);
+        if (isnan(eta)) { fprintf(progress->json, "\"eta\": null, "); } else { fprintf(progress->json, "\"eta\": %.3f, ", eta); }
+        if (isnan(drift)) { fprintf(progress->json, "\"energy_drift\": null, "); } else { fprintf(progress->json, "\"energy_drift\": %.6g, ", drift); }
+        fprintf(progress->json, "\"rss\": %zu, \"done\": %s}\n", rss, done ? "true" : "false");
+        fflush(progress->json);
+    }
+    else
+    {
+        char eta_str[48] = "ETA unknown", drift_str[32] = "";
+        size_t secs = (size_t)((done ? elapsed : eta) + 0.5);
+        if (done || !isnan(eta)) { snprintf(eta_str, sizeof(eta_str), "%s %zum%02zus", done ? "done in" : "ETA", secs / 60, secs % 60); }
+        if (!isnan(drift)) { snprintf(drift_str, sizeof(drift_str), ", energy drift %.2g", drift); }
+        fprintf(stderr, "progress: step %zu of %zu (%.1f%%), %.3g steps/s, %.3g interactions/s, %s%s, RSS %.1f MiB\n",
+                step, progress->num_steps, progress->num_steps ? 100.0 * step / progress->num_steps : 100.0,
+                rate, rate * progress->interactions, eta_str, drift_str, rss / 1048576.0);
+    }
+}
+
+// this function is the reporting thread, it reports every interval seconds
+// until it is stopped
+inline static void* __progress_thread(void* arg)
+{
+    Progress* progress = (Progress*)arg;
+    pthread_mutex_lock(&progress->lock);
+    while (!progress->stop)
+    {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        double secs = floor(progress->interval), frac = progress->interval - secs;
+        until.tv_sec += (time_t)secs;
+        until.tv_nsec += (long)(frac * 1e9);
+        if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+        while (!progress->stop && pthread_cond_timedwait(&progress->wake, &progress->lock, &until) != ETIMEDOUT) {}
+        if (!progress->stop) { __progress_report(progress, false); }
+    }
+    pthread_mutex_unlock(&progress->lock);
+    return NULL;
+}
+
+/**
+ * Starts the reporting thread if --progress or --progress-file was given, for a
+ * step loop of num_steps steps (starting at 1) of n bodies. energy is the
+ * energy of each output row (or NULL) and output_steps the steps between them.
+ * Returns false after printing an error if the file cannot be opened or the
+ * thread cannot be started.
+ */
+inline static bool progress_start(Progress* progress, const Options* opts, size_t num_steps, size_t n, const Matrix* energy, size_t output_steps)
+{
+    memset(progress, 0, sizeof(Progress));
+    atomic_init(&progress->step, 0);
+    progress->enabled = opts->progress > 0 || opts->progress_path;
+    if (!progress->enabled) { return true; }
+    progress->num_steps = num_steps > 0 ? num_steps - 1 : 0;
+    progress->interactions = (double)n * (n - 1);
+    progress->energy = energy;
+    progress->output_steps = output_steps;
+    progress->interval = opts->progress > 0 ? opts->progress : PROGRESS_DEFAULT_SECS;
+    if (opts->progress_path && !(progress->json = fopen(opts->progress_path, "a"))) { perror("error opening the progress file"); return false; }
+    clock_gettime(CLOCK_MONOTONIC, &progress->start);
+    progress->last = progress->start;
+    pthread_mutex_init(&progress->lock, NULL);
+    pthread_cond_init(&progress->wake, NULL);
+    if (pthread_create(&progress->thread, NULL, __progress_thread, progress) != 0)
+    {
+        fprintf(stderr, "error starting the progress thread\n");
+        progress->enabled = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Marks a step as completed, called by the step loop (by one thread) after each
+ * step. The release makes the diagnostics recorded before it visible to the
+ * reporting thread.
+ */
+inline static void progress_step(Progress* progress, size_t step)
+{
+    atomic_store_explicit(&progress->step, step, memory_order_release);
+}
+
+/**
+ * Stops the reporting thread after a last report.
+ */
+inline static void progress_stop(Progress* progress)
+{
+    if (!progress->enabled) { return; }
+    pthread_mutex_lock(&progress->lock);
+    progress->stop = true;
+    pthread_cond_signal(&progress->wake);
+    pthread_mutex_unlock(&progress->lock);
+    pthread_join(progress->thread, NULL);
+    __progress_report(progress, true);
+    if (progress->json) { fclose(progress->json); }
+    pthread_mutex_destroy(&progress->lock);
+    pthread_cond_destroy(&progress->wake);
+    progress->enabled = false;
+}
@@ -0,0 +1,92 @@
+/**
+ * Stops a simulation cleanly when the process receives SIGTERM, SIGUSR1, or
+ * SIGINT, for example from a batch system before the time limit of a job (such
+ * as SLURM with sbatch --signal=USR1@120). The signal only sets a flag. The step
+ * loop checks it after each step and stops at the end of a step, so the output
+ * rows completed so far can still be saved (see the programs). A second signal
+ * ends the process right away.
+ *
+ * With several threads, one thread turns the flag into the step to stop before,
+ * which is the step after next. Every thread passes a barrier of the next step
+ * after it is set, so they all see it before that step and stop together, and
+ * no synchronisation is added to the loop.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <string.h>
+
+// the signal that asked the simulation to stop, 0 if none
+static volatile sig_atomic_t stop_signal = 0;
+
+// this struct is the step a simulation stops before
+typedef struct {
+    _Atomic size_t step; // step to stop before, num_steps if it runs to the end
+    size_t num_steps;    // steps of the step loop (the first is step 1)
+} StopPoint;
+
+// this function is the handler of the signals, it only records the signal
+inline static void __stop_handler(int sig)
+{
+    stop_signal = sig;
+}
+
+/**
+ * Initialises the stop point of a step loop that runs the steps 1 to
+ * num_steps - 1 without installing the handler, so it only stops if a handler
+ * installed before sets the flag.
+ */
+inline static void stop_init(StopPoint* stop, size_t num_steps)
+{
+    atomic_init(&stop->step, num_steps);
+    stop->num_steps = num_steps;
+}
+
+/**
+ * Installs the handler of SIGTERM, SIGUSR1, and SIGINT for a step loop that
+ * runs the steps 1 to num_steps - 1.
+ */
+inline static void stop_install(StopPoint* stop, size_t num_steps)
+{
+    stop_init(stop, num_steps);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = __stop_handler;
+    action.sa_flags = SA_RESETHAND; // the next signal has the default action
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+}
+
+/**
+ * Called by one thread after each step, sets the step to stop before once a
+ * signal was received.
+ */
+inline static void stop_check(StopPoint* stop, size_t step)
+{
+    if (stop_signal && atomic_load_explicit(&stop->step, memory_order_relaxed) == stop->num_steps && step + 2 < stop->num_steps)
+    {
+        atomic_store_explicit(&stop->step, step + 2, memory_order_relaxed);
+    }
+}
+
+/**
+ * Returns true if the loop has to stop before step.
+ */
+inline static bool stop_reached(StopPoint* stop, size_t step)
+{
+    return step >= atomic_load_explicit(&stop->step, memory_order_relaxed);
+}
+
+/**
+ * Returns the last step that was run, which is num_steps - 1 unless the
+ * simulation was stopped early.
+ */
+inline static size_t stop_last_step(StopPoint* stop)
+{
+    return atomic_load_explicit(&stop->step, memory_order_relaxed) - 1;
+}
@@ -0,0 +1,119 @@
+/**
+ * Counts the data TLB misses of a simulation with the hardware performance
+ * counters (perf_event_open()) and reports them along with how much of the
+ * memory of the process is in huge pages, so the effect of --hugepages can be
+ * measured.
+ *
+ * Counters only count the thread that opened them, so with OpenMP a counter is
+ * opened by each thread of a team of the size used by the simulation (the
+ * same threads then run the parallel regions of the simulation).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "arena.h"
+
+// most threads that are counted
+#define TLB_STATS_MAX_THREADS 1024
+
+// this struct is the counters of the threads of a simulation
+typedef struct {
+    int fds[TLB_STATS_MAX_THREADS]; // counter of each thread, -1 if it could not be opened
+    size_t count;                    // number of threads
+    int error;                       // errno of the first counter that could not be opened
+} TLBStats;
+
+// this function opens a counter of the dTLB load misses of the calling thread
+// in user space, returning -1 if the counter is not available
+inline static int __tlb_stats_open(int* error)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0 && !*error) { *error = errno; }
+    return fd;
+}
+
+/**
+ * Starts counting the dTLB load misses of the num_threads threads that run the
+ * simulation (just the calling thread without OpenMP).
+ */
+inline static void tlb_stats_start(TLBStats* stats, size_t num_threads)
+{
+    stats->count = num_threads < TLB_STATS_MAX_THREADS ? num_threads : TLB_STATS_MAX_THREADS;
+    if (stats->count == 0) { stats->count = 1; }
+    stats->error = 0;
+    for (size_t i = 0; i < TLB_STATS_MAX_THREADS; i++) { stats->fds[i] = -1; }
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(stats->count)
+    {
+        int error = 0, fd = __tlb_stats_open(&error);
+        stats->fds[omp_get_thread_num()] = fd;
+        #pragma omp critical
+        if (error && !stats->error) { stats->error = error; }
+    }
+#else
+    stats->count = 1;
+    stats->fds[0] = __tlb_stats_open(&stats->error);
+#endif
+}
+
+// this function returns the number of bytes of the process in huge pages
+// (transparent or reserved), or 0 if it cannot be found
+inline static size_t __tlb_stats_huge_bytes(void)
+{
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (!file) { return 0; }
+    char line[256];
+    size_t total = 0, kb;
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[64];
+        if (sscanf(line, "%63[^:]: %zu kB", name, &kb) == 2 &&
+            (strcmp(name, "AnonHugePages") == 0 || strcmp(name, "ShmemPmdMapped") == 0 ||
+             strcmp(name, "Shared_Hugetlb") == 0 || strcmp(name, "Private_Hugetlb") == 0)) { total += kb * 1024; }
+    }
+    fclose(file);
+    return total;
+}
+
+/**
+ * Stops the counters and prints the total dTLB load misses (and the misses per
+ * step), the memory in huge pages, and the kind of pages the arena used.
+ */
+inline static void tlb_stats_report(TLBStats* stats, const Arena* arena, size_t num_steps)
+{
+    static const char* pages[] = { "off", "thp", "explicit" };
+    long long total = 0;
+    size_t counted = 0;
+    for (size_t i = 0; i < stats->count; i++)
+    {
+        long long value;
+        if (stats->fds[i] < 0) { continue; }
+        if (read(stats->fds[i], &value, sizeof(value)) == sizeof(value)) { total += value; counted++; }
+        close(stats->fds[i]);
+        stats->fds[i] = -1;
+    }
+    if (counted) { printf("dTLB load misses: %lld (%.1f per step, %zu threads)\n", total, (double)total / (num_steps ? num_steps : 1), counted); }
+    else { printf("dTLB load misses: not available (%s)\n", strerror(stats->error)); }
+    printf("huge pages: %.1f MiB in use, --hugepages=%s%s\n", __tlb_stats_huge_bytes() / 1048576.0,
+           pages[arena->pages], arena->fell_back ? " (no reserved huge pages, fell back to thp)" : "");
+}
@@ -0,0 +1,182 @@
+/**
+ * Settings of the force kernels of the parallel programs that can be tuned for
+ * a machine (see --autotune and formulas/autotune.h), and the file they are
+ * kept in between runs.
+ *
+ * The file has one line for each program, CPU model, and range of the number
+ * of bodies:
+ *   program n-min n-max threads schedule chunk tile unroll cpu-model
+ * for example:
+ *   nbody-p 512 2048 8 dynamic 32 1024 2 AMD EPYC 7742 64-Core Processor
+ * where n-max is exclusive and 0 means no limit. Lines starting with # are
+ * comments. A run uses the line of its program, the CPU it runs on, and its
+ * number of bodies, and the defaults of the kernel if there is none.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// the kinds of OpenMP schedules of the rows of the force loop
+#define TUNING_STATIC  0
+#define TUNING_DYNAMIC 1
+#define TUNING_GUIDED  2
+
+// most lines kept in the file
+#define TUNING_MAX_LINES 256
+
+// this struct is the settings of a force kernel
+typedef struct {
+    int schedule;   // how the chunks of rows are shared by the threads, one of the TUNING_* values
+    size_t chunk;   // number of rows (values of i) given to a thread at once
+    size_t tile;    // number of bodies (values of j) each chunk of rows goes through at once, 0 for all
+    size_t unroll;  // number of rows each body is loaded for at once: 1, 2, or 4
+    size_t threads; // number of threads when not given on the command line, 0 for the default
+} Tuning;
+
+// this struct is the settings of a program for a range of the number of bodies
+typedef struct {
+    size_t n_min, n_max; // range of the number of bodies, n_max is exclusive and 0 for no limit
+    Tuning tuning;
+} TuningRange;
+
+static const char* const tuning_schedules[] = { "static", "dynamic", "guided" };
+
+/**
+ * Finds the model of the CPU from /proc/cpuinfo ("unknown" if it cannot be
+ * found).
+ */
+inline static void tuning_cpu_model(char* model, size_t size)
+{
+    snprintf(model, size, "unknown");
+    FILE* file = fopen("/proc/cpuinfo", "r");
+    if (!file) { return; }
+    char line[512];
+    while (fgets(line, sizeof(line), file))
+    {
+        char* value = strchr(line, ':');
+        if (strncmp(line, "model name", 10) != 0 || !value) { continue; }
+        value += strspn(value + 1, " \t") + 1;
+        value[strcspn(value, "\n")] = 0;
+        if (*value) { snprintf(model, size, "%s", value); }
+        break;
+    }
+    fclose(file);
+}
+
+/**
+ * Finds the path of the file of tuned settings: the path given with --tuning,
+ * otherwise ~/.nbody-tuning. Returns false if no file should be used (the path
+ * is "off").
+ */
+inline static bool tuning_path(const char* option, char* path, size_t size)
+{
+    if (option && strcmp(option, "off") == 0) { return false; }
+    if (option) { snprintf(path, size, "%s", option); return true; }
+    const char* home = getenv("HOME");
+    snprintf(path, size, "%s/.nbody-tuning", home ? home : ".");
+    return true;
+}
+
+// this function parses a line of the file, returning false if it is a comment
+// or invalid, cpu points into the line
+inline static bool __tuning_parse(char* line, char* program, size_t program_size, TuningRange* range, char** cpu)
+{
+    char schedule[16];
+    int end = 0;
+    char format[64];
+    snprintf(format, sizeof(format), "%%%zus %%zu %%zu %%zu %%15s %%zu %%zu %%zu %%n", program_size - 1);
+    if (line[0] == '#' || sscanf(line, format, program, &range->n_min, &range->n_max, &range->tuning.threads,
+                                 schedule, &range->tuning.chunk, &range->tuning.tile, &range->tuning.unroll, &end) != 8 || !end) { return false; }
+    range->tuning.schedule = -1;
+    for (int i = 0; i < 3; i++) { if (strcmp(schedule, tuning_schedules[i]) == 0) { range->tuning.schedule = i; } }
+    Tuning* t = &range->tuning;
+    if (t->schedule < 0 || t->chunk == 0 || (t->unroll != 1 && t->unroll != 2 && t->unroll != 4)) { return false; }
+    *cpu = line + end;
+    (*cpu)[strcspn(*cpu, "\n")] = 0;
+    return true;
+}
+
+/**
+ * Loads the settings of a program for n bodies on this CPU from the file at
+ * path. Returns false (leaving tuning as it is) if the file or the line does
+ * not exist.
+ */
+inline static bool tuning_load(const char* path, const char* program, size_t n, Tuning* tuning)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) { return false; }
+    char model[256], line[512], name[64];
+    tuning_cpu_model(model, sizeof(model));
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file))
+    {
+        TuningRange range;
+        char* cpu;
+        if (!__tuning_parse(line, name, sizeof(name), &range, &cpu)) { continue; }
+        if (strcmp(name, program) != 0 || strcmp(cpu, model) != 0) { continue; }
+        if (n < range.n_min || (range.n_max && n >= range.n_max)) { continue; }
+        *tuning = range.tuning;
+        found = true;
+    }
+    fclose(file);
+    return found;
+}
+
+/**
+ * Saves the settings of a program on this CPU for count ranges of the number of
+ * bodies to the file at path. The lines of other programs and CPUs are kept,
+ * and the old lines of this program and CPU are replaced. Returns false if the
+ * file cannot be written.
+ */
+inline static bool tuning_save(const char* path, const char* program, const TuningRange* ranges, size_t count)
+{
+    // keep the lines of the other programs and CPUs
+    char model[256], name[64];
+    tuning_cpu_model(model, sizeof(model));
+    char* kept[TUNING_MAX_LINES];
+    size_t num_kept = 0;
+    FILE* file = fopen(path, "r");
+    if (file)
+    {
+        char line[512], copy[512];
+        while (num_kept < TUNING_MAX_LINES && fgets(line, sizeof(line), file))
+        {
+            TuningRange range;
+            char* cpu;
+            strcpy(copy, line);
+            if (line[0] == '#' || !__tuning_parse(copy, name, sizeof(name), &range, &cpu)) { continue; }
+            if (strcmp(name, program) == 0 && strcmp(cpu, model) == 0) { continue; }
+            kept[num_kept++] = strdup(line);
+        }
+        fclose(file);
+    }
+
+    // write them back with the new lines
+    file = fopen(path, "w");
+    if (file)
+    {
+        fprintf(file, "# program n-min n-max threads schedule chunk tile unroll cpu-model (written by --autotune)\n");
+        for (size_t i = 0; i < num_kept; i++) { fputs(kept[i], file); }
+        for (size_t i = 0; i < count; i++)
+        {
+            const Tuning* t = &ranges[i].tuning;
+            fprintf(file, "%s %zu %zu %zu %s %zu %zu %zu %s\n", program, ranges[i].n_min, ranges[i].n_max,
+                    t->threads, tuning_schedules[t->schedule], t->chunk, t->tile, t->unroll, model);
+        }
+    }
+    for (size_t i = 0; i < num_kept; i++) { free(kept[i]); }
+    return file && fclose(file) == 0;
+}
+
+/**
+ * Prints settings on one line (without a newline).
+ */
+inline static void tuning_print(FILE* out, const Tuning* tuning)
+{
+    fprintf(out, "%zu threads, %s %zu, tile %zu, unroll %zu", tuning->threads,
+            tuning_schedules[tuning->schedule], tuning->chunk, tuning->tile, tuning->unroll);
+}